@@ -0,0 +1,668 @@
+// Benchmarks the code generated by wcomp. Every kernel of the corpus is
+// compiled under each configuration of flags, assembled, linked with the
+// runtime, and run a number of times while the hardware counters of the
+// process are read through perf_event_open. The medians are reported along
+// with the overhead of each configuration relative to the first one, the
+// plain build, and the whole run can be written as JSON to track the
+// generated code over time.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <CLI/CLI.hpp>
+
+namespace fs = std::filesystem;
+
+namespace {
+[[noreturn]] void fail(const std::string &msg) {
+  throw std::runtime_error{msg};
+}
+
+/// A set of wcomp flags the kernels are compiled with.
+struct configuration {
+  std::string name;
+  std::vector<std::string> flags;
+};
+
+const std::string default_seed = "42";
+
+/// The transformations one at a time, then all of them together.
+std::vector<configuration> default_configurations() {
+  return {
+      {"plain", {}},
+      {"flatten", {"--flatten-cfg"}},
+      {"xor", {"--xor-encode-constants"}},
+      {"remap", {"--remap-basic-block-ids=" + default_seed}},
+      {"serialize",
+       {"--random-basic-block-serialization-seed=" + default_seed}},
+      {"all",
+       {"--flatten-cfg", "--xor-encode-constants",
+        "--remap-basic-block-ids=" + default_seed,
+        "--random-basic-block-serialization-seed=" + default_seed}},
+  };
+}
+
+/// Parses 'name=flags', where the flags are separated by whitespace.
+configuration parse_configuration(const std::string &spec) {
+  const auto eq = spec.find('=');
+  if (eq == 0 || eq == std::string::npos)
+    fail("Expected a configuration as name=flags, got '" + spec + "'.");
+  configuration res{spec.substr(0, eq), {}};
+  std::istringstream flags{spec.substr(eq + 1)};
+  for (std::string flag; flags >> flag;)
+    res.flags.push_back(flag);
+  return res;
+}
+
+struct kernel {
+  std::string name;
+  fs::path source;
+  /// The standard input of the runs, /dev/null if the kernel has no .in file.
+  fs::path input;
+};
+
+/// The .ok files of the corpus, by name.
+std::vector<kernel> find_kernels(const fs::path &corpus,
+                                 const std::vector<std::string> &only) {
+  std::vector<kernel> res;
+  for (const fs::directory_entry &entry : fs::directory_iterator{corpus}) {
+    const fs::path &source = entry.path();
+    if (source.extension() != ".ok")
+      continue;
+    const std::string name = source.stem().string();
+    if (!only.empty() &&
+        std::find(only.begin(), only.end(), name) == only.end())
+      continue;
+    fs::path input = source;
+    input.replace_extension(".in");
+    res.push_back({name, source, fs::exists(input) ? input : "/dev/null"});
+  }
+  std::sort(res.begin(), res.end(), [](const kernel &lhs, const kernel &rhs) {
+    return lhs.name < rhs.name;
+  });
+  if (res.empty())
+    fail("No kernels to run in " + corpus.string() + '.');
+  return res;
+}
+
+std::string command_line(const std::vector<std::string> &args) {
+  std::string res;
+  for (const std::string &arg : args)
+    res += (res.empty() ? "" : " ") + arg;
+  return res;
+}
+
+/// Runs the command with the standard output redirected to the file, if one
+/// is given, and fails unless it succeeds.
+void run_command(const std::vector<std::string> &args,
+                 const std::optional<fs::path> &output = std::nullopt) {
+  std::vector<char *> argv;
+  for (const std::string &arg : args)
+    argv.push_back(const_cast<char *>(arg.c_str()));
+  argv.push_back(nullptr);
+
+  std::cout.flush();
+  const pid_t child = fork();
+  if (child == -1)
+    fail("Failed to fork for '" + command_line(args) + "'.");
+  if (child == 0) {
+    if (output.has_value()) {
+      const int fd = open(output->c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd == -1 || dup2(fd, STDOUT_FILENO) == -1)
+        _exit(127);
+    }
+    execvp(argv[0], argv.data());
+    _exit(127);
+  }
+  int status = 0;
+  waitpid(child, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    fail("'" + command_line(args) + "' failed.");
+}
+
+/// The quantities measured for a run, with the wall time last. A counter the
+/// processor or the kernel does not provide is empty.
+enum metric { cycles, instructions, branch_misses, icache_misses, seconds };
+constexpr std::size_t metric_count = 5;
+constexpr const char *metric_names[metric_count] = {
+    "cycles", "instructions", "branch_misses", "icache_misses", "seconds"};
+using measurement = std::array<std::optional<double>, metric_count>;
+
+struct counter_event {
+  std::uint32_t type;
+  std::uint64_t config;
+};
+
+constexpr counter_event counter_events[seconds] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1I |
+                             (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+
+/// The user space hardware counters of a process, from its exec until its
+/// exit. The events are opened separately rather than as a group, so that
+/// an event the processor lacks, such as the i-cache misses on many virtual
+/// machines, leaves the others working. If the events have to share the
+/// counters, the counts are scaled by the share of the time they ran.
+class process_counters {
+  std::array<int, seconds> fds;
+
+public:
+  explicit process_counters(pid_t pid) {
+    for (std::size_t i = 0; i < fds.size(); ++i) {
+      perf_event_attr attr{};
+      attr.size = sizeof(attr);
+      attr.type = counter_events[i].type;
+      attr.config = counter_events[i].config;
+      attr.disabled = 1;
+      attr.enable_on_exec = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format =
+          PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      fds[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, pid, -1,
+                                        -1, PERF_FLAG_FD_CLOEXEC));
+    }
+  }
+  process_counters(const process_counters &) = delete;
+  process_counters &operator=(const process_counters &) = delete;
+  ~process_counters() {
+    for (int fd : fds)
+      if (fd != -1)
+        close(fd);
+  }
+
+  bool any_available() const {
+    return std::any_of(fds.begin(), fds.end(), [](int fd) { return fd != -1; });
+  }
+
+  void read_into(measurement &m) const {
+    for (std::size_t i = 0; i < fds.size(); ++i) {
+      std::uint64_t values[3];
+      if (fds[i] == -1 || read(fds[i], values, sizeof(values)) !=
+                              static_cast<ssize_t>(sizeof(values)))
+        continue;
+      const auto [value, enabled, running] = values;
+      if (running != 0)
+        m[i] = static_cast<double>(value) * enabled / running;
+    }
+  }
+};
+
+/// The result of running a binary once.
+struct run_result {
+  measurement counts;
+  /// The FNV-1a hash of the standard output.
+  std::uint64_t output_hash = 14695981039346656037u;
+  std::size_t output_bytes = 0;
+  /// Whether no counter could be opened.
+  bool counters_missing = false;
+};
+
+/// Runs the binary on the input. The child waits until its counters are open
+/// before it execs, so that they count the program from its first
+/// instruction on, but nothing of the harness.
+run_result run_binary(const fs::path &binary, const fs::path &input) {
+  int start_pipe[2];
+  int output_pipe[2];
+  if (pipe2(start_pipe, O_CLOEXEC) != 0 || pipe2(output_pipe, O_CLOEXEC) != 0)
+    fail("Failed to create the pipes for " + binary.string() + '.');
+  const int input_fd = open(input.c_str(), O_RDONLY | O_CLOEXEC);
+  if (input_fd == -1)
+    fail("Failed to open " + input.string() + '.');
+
+  std::cout.flush();
+  const pid_t child = fork();
+  if (child == -1)
+    fail("Failed to fork for " + binary.string() + '.');
+  if (child == 0) {
+    char go;
+    if (dup2(input_fd, STDIN_FILENO) == -1 ||
+        dup2(output_pipe[1], STDOUT_FILENO) == -1 ||
+        read(start_pipe[0], &go, 1) != 1)
+      _exit(127);
+    char *argv[] = {const_cast<char *>(binary.c_str()), nullptr};
+    execv(argv[0], argv);
+    _exit(127);
+  }
+  close(input_fd);
+  close(start_pipe[0]);
+  close(output_pipe[1]);
+
+  run_result res;
+  const process_counters counters{child};
+  res.counters_missing = !counters.any_available();
+  const auto start = std::chrono::steady_clock::now();
+  const bool started = write(start_pipe[1], "x", 1) == 1;
+  close(start_pipe[1]);
+  char buffer[1 << 16];
+  for (ssize_t n; (n = read(output_pipe[0], buffer, sizeof(buffer))) > 0;) {
+    for (ssize_t i = 0; i < n; ++i)
+      res.output_hash =
+          (res.output_hash ^ static_cast<unsigned char>(buffer[i])) *
+          1099511628211u;
+    res.output_bytes += n;
+  }
+  close(output_pipe[0]);
+  int status = 0;
+  waitpid(child, &status, 0);
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  if (!started || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    fail(binary.string() + " failed on " + input.string() + '.');
+  counters.read_into(res.counts);
+  res.counts[seconds] = elapsed.count();
+  return res;
+}
+
+struct tools {
+  std::string wcomp;
+  std::string nasm;
+  std::string cc;
+  fs::path runtime_object;
+};
+
+/// Compiles the runtime once for every binary. It is freestanding, so the
+/// runs measure neither the dynamic loader nor the stdio of the libc.
+fs::path build_runtime(const std::string &cc, const fs::path &runtime,
+                       const fs::path &work_dir) {
+  const fs::path object = work_dir / "runtime.o";
+  run_command({cc, "-m32", "-O2", "-DWCOMP_FREESTANDING", "-ffreestanding",
+               "-fno-stack-protector", "-c", runtime.string(), "-o",
+               object.string()});
+  return object;
+}
+
+struct build_result {
+  fs::path binary;
+  std::uintmax_t object_bytes;
+};
+
+build_result build(const tools &t, const kernel &k, const configuration &c,
+                   const fs::path &work_dir) {
+  const fs::path base = work_dir / (k.name + '.' + c.name);
+  const fs::path assembly = base.string() + ".asm";
+  const fs::path object = base.string() + ".o";
+  std::vector<std::string> compile{t.wcomp, "-c", k.source.string()};
+  compile.insert(compile.end(), c.flags.begin(), c.flags.end());
+  run_command(compile, assembly);
+  run_command({t.nasm, "-felf", assembly.string(), "-o", object.string()});
+  run_command({t.cc, "-m32", "-nostdlib", "-static", "-Wl,-z,noexecstack",
+               object.string(), t.runtime_object.string(), "-o",
+               base.string()});
+  return {base, fs::file_size(object)};
+}
+
+/// The measurements of a kernel under a configuration.
+struct result {
+  std::uintmax_t object_bytes = 0;
+  bool output_matches = true;
+  std::vector<measurement> runs;
+  measurement median;
+};
+
+measurement median_of(const std::vector<measurement> &runs) {
+  measurement res;
+  for (std::size_t i = 0; i < metric_count; ++i) {
+    std::vector<double> values;
+    for (const measurement &m : runs)
+      if (m[i].has_value())
+        values.push_back(*m[i]);
+    if (values.size() != runs.size() || values.empty())
+      continue;
+    std::sort(values.begin(), values.end());
+    const std::size_t mid = values.size() / 2;
+    res[i] = values.size() % 2 == 1 ? values[mid]
+                                    : (values[mid - 1] + values[mid]) / 2;
+  }
+  return res;
+}
+
+/// The relative cost of a configuration over the baseline, 0.25 meaning 25%
+/// more of the metric.
+measurement overhead_of(const measurement &m, const measurement &baseline) {
+  measurement res;
+  for (std::size_t i = 0; i < metric_count; ++i)
+    if (m[i].has_value() && baseline[i].has_value() && *baseline[i] > 0)
+      res[i] = *m[i] / *baseline[i] - 1;
+  return res;
+}
+
+/// The geometric mean of the ratios, as an overhead again.
+measurement geomean_overhead(const std::vector<measurement> &overheads) {
+  measurement res;
+  for (std::size_t i = 0; i < metric_count; ++i) {
+    double log_sum = 0;
+    std::size_t count = 0;
+    for (const measurement &m : overheads)
+      if (m[i].has_value() && *m[i] > -1) {
+        log_sum += std::log1p(*m[i]);
+        ++count;
+      }
+    if (count == overheads.size() && count != 0)
+      res[i] = std::expm1(log_sum / count);
+  }
+  return res;
+}
+
+/// The overhead shown in the tables: the cycles if they were counted, the
+/// wall time otherwise.
+std::string format_overhead(const measurement &overhead) {
+  const std::optional<double> &x =
+      overhead[cycles].has_value() ? overhead[cycles] : overhead[seconds];
+  if (!x.has_value())
+    return "-";
+  std::ostringstream ss;
+  ss << std::showpos << std::fixed << std::setprecision(1) << *x * 100 << '%';
+  return ss.str();
+}
+
+void print_header(std::ostream &os) {
+  os << "  " << std::left << std::setw(16) << "configuration" << std::right
+     << std::setw(14) << "cycles" << std::setw(14) << "instructions"
+     << std::setw(14) << "br-misses" << std::setw(14) << "ic-misses"
+     << std::setw(10) << "seconds" << std::setw(10) << "overhead\n";
+}
+
+void print_row(std::ostream &os, const std::string &name, const measurement &m,
+               const measurement &overhead) {
+  os << "  " << std::left << std::setw(16) << name << std::right;
+  for (std::size_t i = 0; i < seconds; ++i) {
+    os << std::setw(14);
+    if (m[i].has_value())
+      os << std::llround(*m[i]);
+    else
+      os << '-';
+  }
+  os << std::setw(10) << std::fixed << std::setprecision(4) << *m[seconds]
+     << std::setw(10) << format_overhead(overhead) << '\n';
+}
+
+std::string json_string(std::string_view s) {
+  std::ostringstream ss;
+  ss << '"';
+  for (const char c : s) {
+    if (c == '"' || c == '\\')
+      ss << '\\' << c;
+    else if (static_cast<unsigned char>(c) < 0x20)
+      ss << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+         << static_cast<int>(c) << std::dec << std::setfill(' ');
+    else
+      ss << c;
+  }
+  ss << '"';
+  return ss.str();
+}
+
+std::string json_measurement(const measurement &m, bool counts) {
+  std::ostringstream ss;
+  ss << std::setprecision(counts ? 6 : 4);
+  ss << '{';
+  for (std::size_t i = 0; i < metric_count; ++i) {
+    ss << (i == 0 ? "" : ",") << json_string(metric_names[i]) << ':';
+    if (!m[i].has_value())
+      ss << "null";
+    else if (counts && i != seconds)
+      ss << std::llround(*m[i]);
+    else
+      ss << *m[i];
+  }
+  ss << '}';
+  return ss.str();
+}
+
+std::string utc_timestamp() {
+  const std::time_t now = std::time(nullptr);
+  std::tm utc{};
+  gmtime_r(&now, &utc);
+  char buffer[32];
+  std::strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%SZ", &utc);
+  return buffer;
+}
+
+std::string host_name() {
+  utsname name{};
+  return uname(&name) == 0 ? name.nodename : "";
+}
+
+struct benchmark {
+  std::vector<configuration> configurations;
+  std::vector<kernel> kernels;
+  unsigned runs = 0;
+  std::string label;
+  bool counters_missing = false;
+  /// The results of each kernel, in the order of the configurations.
+  std::vector<std::vector<result>> results;
+
+  /// The overhead of each configuration on each kernel.
+  std::vector<measurement> overheads(std::size_t config) const {
+    std::vector<measurement> res;
+    for (const std::vector<result> &r : results)
+      res.push_back(overhead_of(r[config].median, r[0].median));
+    return res;
+  }
+
+  void print(std::ostream &os) const {
+    if (counters_missing)
+      os << "The hardware counters are not available, only the wall time is "
+            "measured.\n";
+    for (std::size_t k = 0; k < kernels.size(); ++k) {
+      os << kernels[k].name << " (median of " << runs << " runs)\n";
+      print_header(os);
+      const measurement &baseline = results[k][0].median;
+      for (std::size_t c = 0; c < configurations.size(); ++c) {
+        const result &r = results[k][c];
+        print_row(os, configurations[c].name, r.median,
+                  overhead_of(r.median, baseline));
+        if (!r.output_matches)
+          os << "    the output differs from the "
+             << configurations[0].name << " build\n";
+      }
+    }
+    os << "geometric mean overhead\n";
+    for (std::size_t c = 1; c < configurations.size(); ++c)
+      os << "  " << std::left << std::setw(16) << configurations[c].name
+         << std::right << std::setw(10)
+         << format_overhead(geomean_overhead(overheads(c))) << '\n';
+  }
+
+  std::string json() const {
+    std::ostringstream ss;
+    ss << "{\"timestamp\":" << json_string(utc_timestamp())
+       << ",\"host\":" << json_string(host_name())
+       << ",\"label\":" << json_string(label) << ",\"runs\":" << runs
+       << ",\"counters\":" << (counters_missing ? "false" : "true")
+       << ",\"configurations\":[";
+    for (std::size_t c = 0; c < configurations.size(); ++c) {
+      ss << (c == 0 ? "" : ",")
+         << "{\"name\":" << json_string(configurations[c].name)
+         << ",\"flags\":[";
+      for (std::size_t i = 0; i < configurations[c].flags.size(); ++i)
+        ss << (i == 0 ? "" : ",") << json_string(configurations[c].flags[i]);
+      ss << "]}";
+    }
+    ss << "],\"kernels\":[";
+    for (std::size_t k = 0; k < kernels.size(); ++k) {
+      ss << (k == 0 ? "" : ",") << "{\"name\":" << json_string(kernels[k].name)
+         << ",\"results\":[";
+      for (std::size_t c = 0; c < configurations.size(); ++c) {
+        const result &r = results[k][c];
+        ss << (c == 0 ? "" : ",")
+           << "{\"configuration\":" << json_string(configurations[c].name)
+           << ",\"object_bytes\":" << r.object_bytes << ",\"output_matches\":"
+           << (r.output_matches ? "true" : "false")
+           << ",\"median\":" << json_measurement(r.median, true)
+           << ",\"overhead\":"
+           << json_measurement(overhead_of(r.median, results[k][0].median),
+                               false)
+           << '}';
+      }
+      ss << "]}";
+    }
+    ss << "],\"geomean_overhead\":{";
+    for (std::size_t c = 1; c < configurations.size(); ++c)
+      ss << (c == 1 ? "" : ",") << json_string(configurations[c].name) << ':'
+         << json_measurement(geomean_overhead(overheads(c)), false);
+    ss << "}}";
+    return ss.str();
+  }
+
+  bool outputs_match() const {
+    for (const std::vector<result> &r : results)
+      for (const result &x : r)
+        if (!x.output_matches)
+          return false;
+    return true;
+  }
+};
+
+int run(int argc, char **argv) {
+  CLI::App app("Benchmarks the code generated by wcomp");
+  std::string wcomp;
+  app.add_option("--wcomp", wcomp, "The compiler to benchmark.")
+      ->required()
+      ->check(CLI::ExistingFile);
+  std::string corpus;
+  app.add_option("--corpus", corpus,
+                 "The directory of the kernels: every .ok file, run with the "
+                 "standard input from the .in file of the same name.")
+      ->required()
+      ->check(CLI::ExistingDirectory);
+  std::string runtime;
+  app.add_option("--runtime", runtime, "The runtime/runtime.c of wcomp.")
+      ->required()
+      ->check(CLI::ExistingFile);
+  std::string nasm = "nasm";
+  app.add_option("--nasm", nasm, "The assembler.");
+  std::string cc = "cc";
+  app.add_option("--cc", cc, "The C compiler linking the binaries.");
+  unsigned runs = 5;
+  app.add_option("--runs", runs,
+                 "The runs of each binary after a warm-up run; the median is "
+                 "reported.")
+      ->check(CLI::Range(1, 1000));
+  std::vector<std::string> only;
+  app.add_option("--kernel", only, "Runs only the kernels of these names.");
+  std::vector<std::string> extra;
+  app.add_option("--configuration", extra,
+                 "Adds a configuration as 'name=flags', for example "
+                 "'--configuration=hier=--flatten-cfg=hierarchical "
+                 "--merge-tails'.");
+  bool only_extra = false;
+  app.add_flag("--no-default-configurations", only_extra,
+               "Runs only the plain build and the --configuration ones.");
+  std::string work_dir = (fs::temp_directory_path() / "wbench").string();
+  app.add_option("--work-dir", work_dir,
+                 "Where the assembly and the binaries are built.");
+  std::optional<std::string> output;
+  app.add_option("--output", output, "Writes the results to this JSON file.");
+  std::optional<std::string> history;
+  app.add_option("--history", history,
+                 "Appends the results as a line of JSON to this file.");
+  std::string label;
+  app.add_option("--label", label,
+                 "Stored with the results, such as the revision of wcomp.");
+  CLI11_PARSE(app, argc, argv);
+
+  benchmark b;
+  b.configurations = default_configurations();
+  if (only_extra)
+    b.configurations.resize(1);
+  for (const std::string &spec : extra)
+    b.configurations.push_back(parse_configuration(spec));
+  b.kernels = find_kernels(corpus, only);
+  b.runs = runs;
+  b.label = label;
+
+  fs::create_directories(work_dir);
+  // CMake passes an empty compiler when C is not among its languages.
+  if (cc.empty())
+    cc = "cc";
+  tools t{wcomp, nasm, cc, build_runtime(cc, runtime, work_dir)};
+
+  for (const kernel &k : b.kernels) {
+    std::cerr << "Running " << k.name << "...\n";
+    std::vector<build_result> binaries;
+    for (const configuration &c : b.configurations)
+      binaries.push_back(build(t, k, c, work_dir));
+
+    // The warm-up run brings the binaries and the input into the page cache
+    // and records the output each configuration has to reproduce.
+    std::vector<result> results(binaries.size());
+    run_result reference;
+    for (std::size_t c = 0; c < binaries.size(); ++c) {
+      const run_result warm_up = run_binary(binaries[c].binary, k.input);
+      if (c == 0)
+        reference = warm_up;
+      results[c].object_bytes = binaries[c].object_bytes;
+      results[c].output_matches =
+          warm_up.output_hash == reference.output_hash &&
+          warm_up.output_bytes == reference.output_bytes;
+      b.counters_missing |= warm_up.counters_missing;
+    }
+    // The configurations take turns, so that a change in the load of the
+    // machine affects all of them alike.
+    for (unsigned i = 0; i < runs; ++i)
+      for (std::size_t c = 0; c < binaries.size(); ++c)
+        results[c].runs.push_back(
+            run_binary(binaries[c].binary, k.input).counts);
+    for (result &r : results)
+      r.median = median_of(r.runs);
+    b.results.push_back(std::move(results));
+  }
+
+  b.print(std::cout);
+  const std::string json = b.json();
+  if (output.has_value()) {
+    std::ofstream os{*output};
+    os << json << '\n';
+    if (!os)
+      fail("Failed to write " + *output + '.');
+  }
+  if (history.has_value()) {
+    std::ofstream os{*history, std::ios::app};
+    os << json << '\n';
+    if (!os)
+      fail("Failed to append to " + *history + '.');
+  }
+  if (!b.outputs_match()) {
+    std::cerr << "Error: A configuration changed the output of a kernel.\n";
+    return 1;
+  }
+  return 0;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  try {
+    return run(argc, argv);
+  } catch (const std::exception &e) {
+    std::cerr << "Error: " << e.what() << '\n';
+    return 1;
+  }
+}
@@ -0,0 +1,214 @@
+// Runtime library of the programs generated by wcomp.
+//
+// The input and the output go through large buffers, the numbers are parsed
+// and formatted by hand, and the output is flushed when the program exits or
+// before blocking on more input. The behaviour matches test/io.c in a 32 bit
+// build.
+//
+// Link it with libc:
+//   cc -m32 -O2 program.o runtime.c
+// or without any, using raw syscalls and its own entry point:
+//   cc -m32 -O2 -DWCOMP_FREESTANDING -ffreestanding -fno-stack-protector
+//      -nostdlib -static program.o runtime.c
+
+#ifndef WCOMP_BUFFER_SIZE
+#define WCOMP_BUFFER_SIZE (1 << 16)
+#endif
+
+#ifdef WCOMP_FREESTANDING
+#if !defined(__i386__) || !defined(__linux__)
+#error "The freestanding runtime supports only 32 bit x86 Linux."
+#endif
+
+enum { sys_exit = 1, sys_read = 3, sys_write = 4 };
+enum { eintr = 4 };
+
+static long syscall3(long number, long a, long b, long c) {
+  long ret;
+  __asm__ volatile("int $0x80"
+                   : "=a"(ret)
+                   : "a"(number), "b"(a), "c"(b), "d"(c)
+                   : "memory");
+  return ret;
+}
+
+static long sys_read_fd(int fd, char *buf, unsigned long count) {
+  long ret;
+  do
+    ret = syscall3(sys_read, fd, (long)buf, (long)count);
+  while (ret == -eintr);
+  return ret;
+}
+
+static long sys_write_fd(int fd, const char *buf, unsigned long count) {
+  long ret;
+  do
+    ret = syscall3(sys_write, fd, (long)buf, (long)count);
+  while (ret == -eintr);
+  return ret;
+}
+#else
+#include <errno.h>
+#include <unistd.h>
+
+static long sys_read_fd(int fd, char *buf, unsigned long count) {
+  long ret;
+  do
+    ret = read(fd, buf, count);
+  while (ret < 0 && errno == EINTR);
+  return ret;
+}
+
+static long sys_write_fd(int fd, const char *buf, unsigned long count) {
+  long ret;
+  do
+    ret = write(fd, buf, count);
+  while (ret < 0 && errno == EINTR);
+  return ret;
+}
+#endif
+
+static char input[WCOMP_BUFFER_SIZE];
+static unsigned long input_pos;
+static unsigned long input_end;
+static int input_eof;
+
+static char output[WCOMP_BUFFER_SIZE];
+static unsigned long output_end;
+
+static void flush_output(void) {
+  unsigned long written = 0;
+  while (written < output_end) {
+    long ret = sys_write_fd(1, output + written, output_end - written);
+    if (ret <= 0)
+      break;
+    written += (unsigned long)ret;
+  }
+  output_end = 0;
+}
+
+// Returns the next byte without consuming it, or -1 at the end of the input.
+static int peek_input(void) {
+  if (input_pos == input_end) {
+    if (input_eof)
+      return -1;
+    // Someone might wait for the output before providing more input.
+    flush_output();
+    long ret = sys_read_fd(0, input, sizeof input);
+    input_pos = 0;
+    input_end = ret > 0 ? (unsigned long)ret : 0;
+    if (ret <= 0) {
+      input_eof = 1;
+      return -1;
+    }
+  }
+  return (unsigned char)input[input_pos];
+}
+
+static int is_space(int c) {
+  return c == ' ' || c == '\n' || c == '\t' || c == '\v' || c == '\f' ||
+         c == '\r';
+}
+
+static int skip_spaces(void) {
+  int c;
+  while (is_space(c = peek_input()))
+    ++input_pos;
+  return c;
+}
+
+static void reserve_output(unsigned long count) {
+  if (sizeof output - output_end < count)
+    flush_output();
+}
+
+void write_natural(unsigned n) {
+  char digits[10];
+  int count = 0;
+  do {
+    digits[count++] = (char)('0' + n % 10);
+    n /= 10;
+  } while (n != 0);
+
+  reserve_output(sizeof digits + 1);
+  while (count != 0)
+    output[output_end++] = digits[--count];
+  output[output_end++] = '\n';
+}
+
+// Like scanf("%u") of a 32 bit glibc: an optional sign followed by decimal
+// digits, negated modulo 2^32, and the largest natural if the digits
+// overflow it, whatever the sign. Returns zero if there is no number.
+unsigned read_natural(void) {
+  int c = skip_spaces();
+  int negative = 0;
+  if (c == '+' || c == '-') {
+    negative = c == '-';
+    ++input_pos;
+    c = peek_input();
+  }
+
+  const unsigned largest = ~0u;
+  unsigned ret = 0;
+  int overflow = 0;
+  while (c >= '0' && c <= '9') {
+    const unsigned digit = (unsigned)(c - '0');
+    if (ret > (largest - digit) / 10)
+      overflow = 1;
+    else
+      ret = ret * 10 + digit;
+    ++input_pos;
+    c = peek_input();
+  }
+  if (overflow)
+    return largest;
+  return negative ? 0u - ret : ret;
+}
+
+void write_boolean(char b) {
+  static const char true_text[] = "true\n";
+  static const char false_text[] = "false\n";
+  const char *text = b ? true_text : false_text;
+  const unsigned long length = b ? sizeof true_text - 1 : sizeof false_text - 1;
+
+  reserve_output(length);
+  for (unsigned long i = 0; i < length; ++i)
+    output[output_end++] = text[i];
+}
+
+// Like scanf("%5s") followed by a comparison with "true".
+char read_boolean(void) {
+  static const char true_text[] = "true";
+  int c = skip_spaces();
+  int length = 0;
+  int matches = 1;
+  while (c != -1 && !is_space(c) && length < 5) {
+    matches &= length < 4 && c == true_text[length];
+    ++length;
+    ++input_pos;
+    c = peek_input();
+  }
+  return (char)(matches && length == 4);
+}
+
+#ifdef WCOMP_FREESTANDING
+int main(void);
+
+__attribute__((noreturn)) void wcomp_start(void) {
+  int status = main();
+  flush_output();
+  syscall3(sys_exit, status, 0, 0);
+  __builtin_unreachable();
+}
+
+// The stack is only 4 byte aligned at the entry point.
+__asm__(".globl _start\n"
+        ".type _start,@function\n"
+        "_start:\n"
+        "  xor %ebp,%ebp\n"
+        "  and $-16,%esp\n"
+        "  call wcomp_start\n"
+        "  hlt\n");
+#else
+__attribute__((destructor)) static void flush_at_exit(void) { flush_output(); }
+#endif
@@ -3,15 +3,14 @@
 #include "statements.h"
 #include "utility.h"
 
+#include <utility>
 #include <variant>
 
 namespace {
 struct ast_to_cfg_visitor {
-  cfg graph;
+  cfg &graph;
   basicblock *current_bb;
 
-  ast_to_cfg_visitor() : current_bb{graph.entry} {}
-
   basicblock *operator()(statements &&xs);
   basicblock *operator()(invalid_statement &&x);
   basicblock *operator()(assign_statement &&x);
@@ -23,9 +22,42 @@ struct ast_to_cfg_visitor {
 } // namespace
 
 cfg ast_to_cfg(statements &&ast) {
-  ast_to_cfg_visitor converter;
-  converter.graph.exit = converter(std::move(ast));
-  return std::move(converter.graph);
+  cfg graph;
+  ast_to_cfg_visitor converter{graph, graph.entry};
+  graph.exit = converter(std::move(ast));
+  return graph;
+}
+
+streaming_ast_to_cfg::streaming_ast_to_cfg(block_consumer consume,
+                                           std::size_t max_block_size)
+    : current{graph.entry}, entry{graph.entry}, consume{std::move(consume)},
+      max_block_size{max_block_size} {}
+
+void streaming_ast_to_cfg::lower(statement &&x) {
+  // Cut the long straight-line regions.
+  if (current->instructions.size() >= max_block_size) {
+    basicblock *next = graph.create_bb();
+    current->add_ir_instruction(jump{*next});
+    current = next;
+  }
+
+  ast_to_cfg_visitor converter{graph, current};
+  current = std::visit(converter, std::move(x));
+  hand_over(false);
+}
+
+void streaming_ast_to_cfg::finish() { hand_over(true); }
+
+void streaming_ast_to_cfg::hand_over(bool last) {
+  // Nothing lowered later can jump into a statement lowered earlier, so only
+  // the current block might receive more instructions or edges.
+  for (const auto &bb : graph.blocks)
+    if (last || bb.get() != current)
+      consume(*bb, bb.get() == entry, last && bb.get() == current);
+  std::erase_if(graph.blocks,
+                [&](const auto &bb) { return last || bb.get() != current; });
+  if (entry != current)
+    entry = nullptr;
 }
 
 basicblock *ast_to_cfg_visitor::operator()(statements &&xs) {
@@ -4,6 +4,38 @@
 #include "cfg.h"
 #include "statements.h"
 
+#include <cstddef>
+#include <functional>
+
 cfg ast_to_cfg(statements &&xs);
 
+/// Lowers the top-level statements of a program one at a time, handing over
+/// every block as soon as it is complete and freeing it right after. Only
+/// the block the next statement continues in is kept, and that is cut into
+/// blocks of at most max_block_size instructions, so the memory is bounded
+/// by the largest top-level statement.
+class streaming_ast_to_cfg {
+public:
+  /// Receives a complete block, telling whether it is the entry or the exit.
+  using block_consumer =
+      std::function<void(const basicblock &bb, bool entry, bool exit)>;
+
+  explicit streaming_ast_to_cfg(block_consumer consume,
+                                std::size_t max_block_size = 1024);
+
+  void lower(statement &&x);
+  /// Hands over the last block as the exit.
+  void finish();
+
+private:
+  void hand_over(bool last);
+
+  cfg graph;
+  basicblock *current;
+  /// Not yet handed over, if not null.
+  const basicblock *entry;
+  block_consumer consume;
+  std::size_t max_block_size;
+};
+
 #endif // AST_TO_CFG_H
@@ -0,0 +1,525 @@
+#include "batch_interpreter.h"
+#include "cfg_analysis.h"
+#include "typecheck.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <limits>
+#include <map>
+#include <new>
+#include <ostream>
+#include <set>
+#include <string>
+#include <variant>
+#include <vector>
+
+// The lanes of a vector are spread over the ymm registers where available.
+#if defined(__x86_64__) && defined(__linux__)
+#define BATCH_TARGET_CLONES [[gnu::target_clones("avx2", "default")]]
+#else
+#define BATCH_TARGET_CLONES
+#endif
+
+namespace {
+constexpr unsigned lane_count = 8;
+
+/// A value for each lane. The booleans are 0 or 1, the masks are 0 or ~0.
+typedef std::uint32_t lanes
+    __attribute__((vector_size(lane_count * sizeof(std::uint32_t))));
+
+/// Targets without 256 bit registers align the vectors to 16 bytes only, the
+/// clones using them need the full 32.
+constexpr std::size_t lanes_alignment = sizeof(lanes);
+
+template <class T> struct lanes_allocator {
+  using value_type = T;
+
+  lanes_allocator() = default;
+  template <class U> lanes_allocator(const lanes_allocator<U> &) {}
+
+  T *allocate(std::size_t n) {
+    return static_cast<T *>(::operator new(
+        n * sizeof(T), std::align_val_t{lanes_alignment}));
+  }
+  void deallocate(T *p, std::size_t) {
+    ::operator delete(p, std::align_val_t{lanes_alignment});
+  }
+  bool operator==(const lanes_allocator &) const { return true; }
+};
+
+using lanes_vector = std::vector<lanes, lanes_allocator<lanes>>;
+
+/// The program counter of the lanes without a record.
+constexpr std::uint32_t idle = ~0u;
+
+enum class opcode : std::uint8_t {
+  constant,
+  variable,
+  add,
+  sub,
+  mul,
+  div,
+  mod,
+  lt,
+  gt,
+  le,
+  ge,
+  eq,
+  logical_and,
+  logical_or,
+  logical_not,
+};
+
+struct operation {
+  opcode op;
+  /// The value of a constant, or the index of a variable.
+  std::uint32_t operand = 0;
+  int line = -1;
+};
+
+/// An expression in postfix order.
+using compiled_expression = std::vector<operation>;
+
+struct compiled_instruction {
+  enum { assign, read, write, select } kind;
+  type ty;
+  unsigned var = 0;
+  compiled_expression value;
+  /// The values assigned by a select, if the condition holds or not.
+  std::uint32_t true_value = 0;
+  std::uint32_t false_value = 0;
+};
+
+struct compiled_block {
+  std::vector<compiled_instruction> body;
+  enum { finish, jump, branch, dispatch } terminator = finish;
+  compiled_expression condition;
+  /// The next block of a jump, or the two branches of a selector.
+  std::uint32_t targets[2] = {0, 0};
+  /// The variable of a switcher, and the block index of each of its ids.
+  unsigned var = 0;
+  std::vector<std::pair<std::uint32_t, std::uint32_t>> cases;
+};
+
+std::vector<const basicblock *> reverse_postorder(const cfg &graph) {
+  std::vector<const basicblock *> order;
+  std::set<const basicblock *> visited{graph.entry};
+  std::vector<std::pair<const basicblock *, std::size_t>> stack{
+      {graph.entry, 0}};
+  while (!stack.empty()) {
+    auto &[bb, next_succ] = stack.back();
+    const auto succs = successors(*bb);
+    if (next_succ == succs.size()) {
+      order.push_back(bb);
+      stack.pop_back();
+      continue;
+    }
+    const basicblock *succ = succs[next_succ++];
+    if (visited.insert(succ).second)
+      stack.emplace_back(succ, 0);
+  }
+  return {order.rbegin(), order.rend()};
+}
+
+/// Translates the graph into a form cheap to interpret: the variables and the
+/// blocks are referred to by their index, the expressions are flattened.
+class batch_compiler {
+  const symbols &syms;
+  std::map<std::string_view, unsigned> var_indices;
+  std::map<const basicblock *, std::uint32_t> block_indices;
+  std::vector<const basicblock *> order;
+
+public:
+  std::vector<compiled_block> blocks;
+  std::vector<type> var_types;
+  std::size_t max_stack_depth = 1;
+
+  batch_compiler(const symbols &syms, const cfg &graph)
+      : syms{syms}, order{reverse_postorder(graph)} {
+    for (const auto &[name, sym] : syms) {
+      var_indices.emplace(sym.name, var_types.size());
+      var_types.push_back(sym.symbol_type);
+    }
+    for (const basicblock *bb : order)
+      block_indices.emplace(bb, block_indices.size());
+    for (const basicblock *bb : order)
+      blocks.push_back(compile(*bb));
+  }
+
+private:
+  unsigned var(const std::string &name) const {
+    const auto it = var_indices.find(name);
+    if (it == var_indices.end())
+      error(-1, "Bug: Undeclared variable: " + name);
+    return it->second;
+  }
+
+  type type_of(const std::string &name) const {
+    return var_types[var(name)];
+  }
+
+  std::size_t flatten(const expression &x, compiled_expression &code) const {
+    return std::visit(
+        overloaded{
+            [&](const number_expression &x) -> std::size_t {
+              code.push_back({opcode::constant, x.value});
+              return 1;
+            },
+            [&](const boolean_expression &x) -> std::size_t {
+              code.push_back({opcode::constant, x.value});
+              return 1;
+            },
+            [&](const id_expression &x) -> std::size_t {
+              code.push_back({opcode::variable, var(x.name), x.line});
+              return 1;
+            },
+            [&](const binop_expression &x) -> std::size_t {
+              static const std::map<std::string_view, opcode> opcodes{
+                  {"+", opcode::add},          {"-", opcode::sub},
+                  {"*", opcode::mul},          {"/", opcode::div},
+                  {"%", opcode::mod},          {"<", opcode::lt},
+                  {">", opcode::gt},           {"<=", opcode::le},
+                  {">=", opcode::ge},          {"=", opcode::eq},
+                  {"and", opcode::logical_and}, {"or", opcode::logical_or}};
+              const auto it = opcodes.find(x.op);
+              if (it == opcodes.end())
+                error(x.line, "Bug: Unsupported binary operator: " + x.op);
+              const std::size_t left = flatten(*x.left, code);
+              const std::size_t right = flatten(*x.right, code);
+              code.push_back({it->second, 0, x.line});
+              return std::max(left, right + 1);
+            },
+            [&](const not_expression &x) -> std::size_t {
+              const std::size_t depth = flatten(*x.operand, code);
+              code.push_back({opcode::logical_not, 0, x.line});
+              return depth;
+            }},
+        x);
+  }
+
+  compiled_expression compile(const expression &x) {
+    compiled_expression code;
+    max_stack_depth = std::max(max_stack_depth, flatten(x, code));
+    return code;
+  }
+
+  compiled_block compile(const basicblock &bb) {
+    compiled_block res;
+    for (const ir_instruction &inst : bb.instructions) {
+      std::visit(
+          overloaded{
+              [&](const assign_statement &x) {
+                res.body.push_back({compiled_instruction::assign,
+                                    type_of(x.left), var(x.left),
+                                    compile(*x.right)});
+              },
+              [&](const read_statement &x) {
+                res.body.push_back(
+                    {compiled_instruction::read, type_of(x.id), var(x.id)});
+              },
+              [&](const write_statement &x) {
+                res.body.push_back({compiled_instruction::write,
+                                    infer_expression_type(syms, *x.value), 0,
+                                    compile(*x.value)});
+              },
+              [&](const cassign &x) {
+                res.body.push_back({compiled_instruction::select, natural,
+                                    var(x.var.name), compile(*x.condition),
+                                    static_cast<std::uint32_t>(x.true_value),
+                                    static_cast<std::uint32_t>(x.false_value)});
+              },
+              [&](const jump &x) {
+                res.terminator = compiled_block::jump;
+                res.targets[0] = block_indices.at(&x.target);
+              },
+              [&](const selector &x) {
+                res.terminator = compiled_block::branch;
+                res.condition = compile(*x.condition);
+                res.targets[0] = block_indices.at(&x.true_branch);
+                res.targets[1] = block_indices.at(&x.false_branch);
+              },
+              [&](const switcher &x) {
+                res.terminator = compiled_block::dispatch;
+                res.var = var(x.var.name);
+                for (const basicblock *target : x.branches)
+                  res.cases.emplace_back(target->id,
+                                         block_indices.at(target));
+              },
+              [&](const auto &x) {
+                error(-1, "Bug: Unexpected instruction in a basic block.");
+              }},
+          inst);
+    }
+    return res;
+  }
+};
+
+/// The record processed by a lane.
+struct lane_record {
+  std::size_t index = 0;
+  std::string input;
+  std::size_t position = 0;
+  std::string output;
+};
+
+class batch_interpreter {
+  const batch_compiler &program;
+  std::istream &records;
+  std::ostream &os;
+
+  lanes_vector vars;
+  lanes_vector stack;
+  /// The index of the block each lane executes next.
+  alignas(lanes_alignment) lanes pcs;
+  lane_record lane_records[lane_count];
+
+  std::size_t next_record = 0;
+  std::size_t next_to_print = 0;
+  std::map<std::size_t, std::string> finished;
+
+public:
+  batch_interpreter(const batch_compiler &program, std::istream &records,
+                    std::ostream &os)
+      : program{program}, records{records}, os{os},
+        vars(program.var_types.size()), stack(program.max_stack_depth) {
+    for (unsigned lane = 0; lane < lane_count; ++lane)
+      start_next_record(lane);
+  }
+
+  BATCH_TARGET_CLONES void run() {
+    for (;;) {
+      // Run the block most lanes are waiting at. Among equals the earliest
+      // one in reverse postorder, so the others can catch up with it.
+      std::uint32_t current = idle;
+      unsigned most = 0;
+      for (unsigned lane = 0; lane < lane_count; ++lane) {
+        if (pcs[lane] == idle)
+          continue;
+        unsigned count = 0;
+        for (unsigned other = 0; other < lane_count; ++other)
+          count += pcs[other] == pcs[lane];
+        if (count > most || (count == most && pcs[lane] < current)) {
+          most = count;
+          current = pcs[lane];
+        }
+      }
+      if (current == idle)
+        return;
+
+      const lanes mask = (lanes)(pcs == current);
+      execute(program.blocks[current], mask);
+    }
+  }
+
+private:
+  [[gnu::always_inline]] static void blend(lanes &dst, const lanes &src,
+                                           const lanes &mask) {
+    dst = (src & mask) | (dst & ~mask);
+  }
+
+  [[gnu::always_inline]] void evaluate(const compiled_expression &code,
+                                       const lanes &mask, lanes &res) {
+    std::size_t top = 0;
+    for (const operation &op : code) {
+      if (op.op == opcode::constant) {
+        stack[top++] = lanes{} + op.operand;
+        continue;
+      }
+      if (op.op == opcode::variable) {
+        stack[top++] = vars[op.operand];
+        continue;
+      }
+      if (op.op == opcode::logical_not) {
+        stack[top - 1] ^= 1;
+        continue;
+      }
+
+      lanes rhs = stack[--top];
+      lanes &lhs = stack[top - 1];
+      switch (op.op) {
+      case opcode::add:
+        lhs += rhs;
+        break;
+      case opcode::sub:
+        lhs -= rhs;
+        break;
+      case opcode::mul:
+        lhs *= rhs;
+        break;
+      case opcode::div:
+      case opcode::mod:
+        // The lanes not running this block might hold anything.
+        blend(rhs, lanes{} + 1, ~mask);
+        for (unsigned lane = 0; lane < lane_count; ++lane)
+          if (rhs[lane] == 0)
+            error(op.line, "Division by zero.");
+        if (op.op == opcode::div)
+          lhs /= rhs;
+        else
+          lhs %= rhs;
+        break;
+      case opcode::lt:
+        lhs = (lanes)(lhs < rhs) & 1;
+        break;
+      case opcode::gt:
+        lhs = (lanes)(lhs > rhs) & 1;
+        break;
+      case opcode::le:
+        lhs = (lanes)(lhs <= rhs) & 1;
+        break;
+      case opcode::ge:
+        lhs = (lanes)(lhs >= rhs) & 1;
+        break;
+      case opcode::eq:
+        lhs = (lanes)(lhs == rhs) & 1;
+        break;
+      case opcode::logical_and:
+        lhs &= rhs;
+        break;
+      case opcode::logical_or:
+        lhs |= rhs;
+        break;
+      default:
+        unreachable();
+      }
+    }
+    res = stack[0];
+  }
+
+  [[gnu::always_inline]] void execute(const compiled_block &bb,
+                                      const lanes &mask) {
+    lanes value;
+    for (const compiled_instruction &inst : bb.body) {
+      switch (inst.kind) {
+      case compiled_instruction::assign:
+        evaluate(inst.value, mask, value);
+        blend(vars[inst.var], value, mask);
+        break;
+      case compiled_instruction::select:
+        evaluate(inst.value, mask, value);
+        value = (inst.true_value & -value) | (inst.false_value & (value - 1));
+        blend(vars[inst.var], value, mask);
+        break;
+      case compiled_instruction::read:
+        for (unsigned lane = 0; lane < lane_count; ++lane)
+          if (mask[lane] != 0)
+            vars[inst.var][lane] = read(lane_records[lane], inst.ty);
+        break;
+      case compiled_instruction::write:
+        evaluate(inst.value, mask, value);
+        for (unsigned lane = 0; lane < lane_count; ++lane)
+          if (mask[lane] != 0)
+            write(lane_records[lane], inst.ty, value[lane]);
+        break;
+      }
+    }
+
+    switch (bb.terminator) {
+    case compiled_block::finish:
+      for (unsigned lane = 0; lane < lane_count; ++lane) {
+        if (mask[lane] != 0) {
+          finish_record(lane);
+          start_next_record(lane);
+        }
+      }
+      break;
+    case compiled_block::jump:
+      blend(pcs, lanes{} + bb.targets[0], mask);
+      break;
+    case compiled_block::branch: {
+      evaluate(bb.condition, mask, value);
+      const lanes taken = -value;
+      lanes targets = lanes{} + bb.targets[1];
+      blend(targets, lanes{} + bb.targets[0], taken);
+      blend(pcs, targets, mask);
+      break;
+    }
+    case compiled_block::dispatch: {
+      const lanes &selected = vars[bb.var];
+      lanes targets = lanes{} + idle;
+      for (const auto &[id, target] : bb.cases)
+        blend(targets, lanes{} + target, (lanes)(selected == id));
+      for (unsigned lane = 0; lane < lane_count; ++lane)
+        if (mask[lane] != 0 && targets[lane] == idle)
+          error(-1, "Bug: The switcher has no branch for the selected id.");
+      blend(pcs, targets, mask);
+      break;
+    }
+    }
+  }
+
+  /// Like scanf("%u"), and scanf("%5s") compared with "true".
+  static std::uint32_t read(lane_record &record, type ty) {
+    const std::string &in = record.input;
+    std::size_t &pos = record.position;
+    while (pos < in.size() && std::isspace(static_cast<unsigned char>(in[pos])))
+      ++pos;
+
+    if (ty == boolean) {
+      const std::size_t begin = pos;
+      while (pos < in.size() && pos - begin < 5 &&
+             !std::isspace(static_cast<unsigned char>(in[pos])))
+        ++pos;
+      return in.compare(begin, pos - begin, "true") == 0;
+    }
+
+    bool negative = false;
+    if (pos < in.size() && (in[pos] == '+' || in[pos] == '-'))
+      negative = in[pos++] == '-';
+    // Saturates on overflow, like scanf("%u") of the 32 bit io.c.
+    constexpr std::uint32_t largest = std::numeric_limits<std::uint32_t>::max();
+    std::uint32_t value = 0;
+    bool overflow = false;
+    for (; pos < in.size() && in[pos] >= '0' && in[pos] <= '9'; ++pos) {
+      const std::uint32_t digit = in[pos] - '0';
+      if (value > (largest - digit) / 10)
+        overflow = true;
+      else
+        value = value * 10 + digit;
+    }
+    if (overflow)
+      return largest;
+    return negative ? 0u - value : value;
+  }
+
+  static void write(lane_record &record, type ty, std::uint32_t value) {
+    if (ty == boolean)
+      record.output += value != 0 ? "true\n" : "false\n";
+    else
+      (record.output += std::to_string(value)) += '\n';
+  }
+
+  void start_next_record(unsigned lane) {
+    lane_record &record = lane_records[lane];
+    if (!std::getline(records, record.input)) {
+      pcs[lane] = idle;
+      return;
+    }
+    record.index = next_record++;
+    record.position = 0;
+    record.output.clear();
+    for (lanes &var : vars)
+      var[lane] = 0;
+    pcs[lane] = 0;
+  }
+
+  void finish_record(unsigned lane) {
+    lane_record &record = lane_records[lane];
+    finished.emplace(record.index, std::move(record.output));
+    for (auto it = finished.begin();
+         it != finished.end() && it->first == next_to_print;
+         it = finished.erase(it), ++next_to_print)
+      os << it->second << '\n';
+  }
+};
+} // namespace
+
+void run_batch(const symbols &syms, const cfg &graph, std::istream &records,
+               std::ostream &os) {
+  const batch_compiler program{syms, graph};
+  batch_interpreter{program, records, os}.run();
+}
@@ -0,0 +1,18 @@
+#ifndef BATCH_INTERPRETER_H
+#define BATCH_INTERPRETER_H
+
+#include "cfg.h"
+#include "expressions.h"
+
+#include <iosfwd>
+
+/// Runs the program for every line of the input as a separate input record.
+/// Several records are executed in lockstep, each in a lane of a SIMD vector;
+/// where the lanes diverge, the blocks are executed under a mask, always the
+/// one most lanes are waiting at. A lane picks up the next record as soon as
+/// it finishes its own. The output of each record is printed in the order of
+/// the records, followed by an empty line.
+void run_batch(const symbols &syms, const cfg &graph, std::istream &records,
+               std::ostream &os);
+
+#endif // BATCH_INTERPRETER_H
@@ -2,6 +2,7 @@
 
 #include <algorithm>
 #include <cassert>
+#include <map>
 #include <memory>
 #include <variant>
 
@@ -39,3 +40,57 @@ basicblock *cfg::create_bb() {
   blocks.push_back(std::make_unique<basicblock>(idx));
   return blocks.back().get();
 }
+
+cfg clone(const cfg &graph) {
+  cfg res;
+  res.blocks.clear();
+  res.next_bb_idx = graph.next_bb_idx;
+
+  std::map<const basicblock *, basicblock *> mapping;
+  for (const auto &bb : graph.blocks) {
+    res.blocks.push_back(std::make_unique<basicblock>(bb->id));
+    mapping.emplace(bb.get(), res.blocks.back().get());
+  }
+  res.entry = mapping.at(graph.entry);
+  res.exit = mapping.at(graph.exit);
+
+  const auto clone_expr = [](const std::unique_ptr<expression> &x) {
+    return std::make_unique<expression>(*x);
+  };
+  for (const auto &bb : graph.blocks) {
+    basicblock &copy = *mapping.at(bb.get());
+    copy.instructions.reserve(bb->instructions.size());
+    for (const ir_instruction &inst : bb->instructions) {
+      copy.instructions.push_back(std::visit(
+          overloaded{
+              [&](const auto &x) -> ir_instruction { return x; },
+              [&](const assign_statement &x) -> ir_instruction {
+                return assign_statement{x.get_line(), x.left,
+                                        clone_expr(x.right)};
+              },
+              [&](const write_statement &x) -> ir_instruction {
+                return write_statement{x.get_line(), clone_expr(x.value)};
+              },
+              [&](const selector &x) -> ir_instruction {
+                return selector{clone_expr(x.condition),
+                                *mapping.at(&x.true_branch),
+                                *mapping.at(&x.false_branch)};
+              },
+              [&](const jump &x) -> ir_instruction {
+                return jump{*mapping.at(&x.target)};
+              },
+              [&](const switcher &x) -> ir_instruction {
+                switcher res{x.var, {}};
+                for (const basicblock *branch : x.branches)
+                  res.branches.push_back(mapping.at(branch));
+                return res;
+              },
+              [&](const cassign &x) -> ir_instruction {
+                return cassign{x.var, clone_expr(x.condition), x.true_value,
+                               x.false_value};
+              }},
+          inst));
+    }
+  }
+  return res;
+}
@@ -69,4 +69,7 @@ public:
   basicblock *create_bb();
 };
 
+/// Deep copies the graph, preserving the ids of the blocks and their order.
+cfg clone(const cfg &graph);
+
 #endif // CFG_H
@@ -0,0 +1,153 @@
+#include "cfg_analysis.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <variant>
+
+namespace {
+// The static estimation assumes this many iterations for every loop.
+constexpr double assumed_trip_count = 10.0;
+
+// Deeper nesting levels would not change the ordering of the blocks anymore.
+constexpr unsigned max_estimated_depth = 8;
+} // namespace
+
+std::vector<basicblock *> successors(const basicblock &bb) {
+  if (bb.instructions.empty())
+    return {};
+
+  return std::visit(
+      overloaded{[](const auto &) { return std::vector<basicblock *>{}; },
+                 [](const selector &x) {
+                   return std::vector<basicblock *>{&x.true_branch,
+                                                    &x.false_branch};
+                 },
+                 [](const jump &x) {
+                   return std::vector<basicblock *>{&x.target};
+                 },
+                 [](const switcher &x) { return x.branches; }},
+      bb.instructions.back());
+}
+
+std::vector<basicblock *> reachable_blocks(const cfg &graph) {
+  std::vector<basicblock *> res;
+  std::set<const basicblock *> visited;
+  std::vector<basicblock *> worklist{graph.entry};
+
+  while (!worklist.empty()) {
+    basicblock *bb = worklist.back();
+    worklist.pop_back();
+    if (!visited.insert(bb).second)
+      continue;
+    res.push_back(bb);
+
+    // Push in reverse order to visit the first successor first.
+    const auto succs = successors(*bb);
+    worklist.insert(worklist.end(), succs.rbegin(), succs.rend());
+  }
+  return res;
+}
+
+loop_info::loop_info(const cfg &graph) {
+  // Find the back-edges using an iterative depth-first traversal.
+  std::map<const basicblock *, std::vector<const basicblock *>> preds;
+  std::map<const basicblock *, std::vector<const basicblock *>> latches;
+  std::set<const basicblock *> visited;
+  std::set<const basicblock *> on_stack;
+  std::vector<std::pair<const basicblock *, std::size_t>> stack;
+
+  visited.insert(graph.entry);
+  on_stack.insert(graph.entry);
+  stack.emplace_back(graph.entry, 0);
+  while (!stack.empty()) {
+    auto &[bb, next_succ] = stack.back();
+    const auto succs = successors(*bb);
+    if (next_succ == succs.size()) {
+      on_stack.erase(bb);
+      stack.pop_back();
+      continue;
+    }
+
+    const basicblock *succ = succs[next_succ++];
+    preds[succ].push_back(bb);
+    if (on_stack.count(succ) != 0) {
+      latches[succ].push_back(bb);
+    } else if (visited.insert(succ).second) {
+      on_stack.insert(succ);
+      stack.emplace_back(succ, 0);
+    }
+  }
+
+  // Collect the body of each loop walking backwards from the latches.
+  for (const auto &[header, header_latches] : latches) {
+    auto l = std::make_unique<loop>(loop{header, nullptr, 0, {header}});
+    std::vector<const basicblock *> worklist = header_latches;
+    while (!worklist.empty()) {
+      const basicblock *bb = worklist.back();
+      worklist.pop_back();
+      if (!l->blocks.insert(bb).second)
+        continue;
+      const auto &bb_preds = preds[bb];
+      worklist.insert(worklist.end(), bb_preds.begin(), bb_preds.end());
+    }
+    all_loops.push_back(std::move(l));
+  }
+
+  // Natural loops are either disjoint or nested, so the larger loop encloses
+  // the smaller one.
+  std::stable_sort(all_loops.begin(), all_loops.end(),
+                   [](const auto &lhs, const auto &rhs) {
+                     return lhs->blocks.size() > rhs->blocks.size();
+                   });
+  for (auto &l : all_loops) {
+    for (const auto &outer : all_loops) {
+      if (outer.get() == l.get())
+        break;
+      if (outer->blocks.count(l->header) != 0)
+        l->parent = outer.get();
+    }
+    l->depth = l->parent ? l->parent->depth + 1 : 1;
+    for (const basicblock *bb : l->blocks)
+      innermost_loop[bb] = l.get();
+  }
+  std::stable_sort(
+      all_loops.begin(), all_loops.end(),
+      [](const auto &lhs, const auto &rhs) { return lhs->depth < rhs->depth; });
+}
+
+const loop *loop_info::innermost(const basicblock &bb) const {
+  const auto it = innermost_loop.find(&bb);
+  return it == innermost_loop.end() ? nullptr : it->second;
+}
+
+unsigned loop_info::depth(const basicblock &bb) const {
+  const loop *l = innermost(bb);
+  return l ? l->depth : 0;
+}
+
+block_profile read_block_profile(std::istream &is) {
+  block_profile profile;
+  bb_idx id;
+  double count;
+  while (is >> id >> count)
+    profile[id] = count;
+  return profile;
+}
+
+block_frequencies estimate_block_frequencies(const cfg &graph,
+                                             const loop_info &loops,
+                                             const block_profile &profile) {
+  block_frequencies freqs;
+  for (const auto &block : graph.blocks) {
+    if (const auto it = profile.find(block->id); it != profile.end()) {
+      freqs[block.get()] = it->second;
+      continue;
+    }
+    const unsigned depth = std::min(loops.depth(*block), max_estimated_depth);
+    freqs[block.get()] = std::pow(assumed_trip_count, depth);
+  }
+  return freqs;
+}
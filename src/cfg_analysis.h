@@ -0,0 +1,61 @@
+#ifndef CFG_ANALYSIS_H
+#define CFG_ANALYSIS_H
+
+#include "cfg.h"
+
+#include <iosfwd>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+
+/// Returns the blocks the control might flow to after the given block.
+std::vector<basicblock *> successors(const basicblock &bb);
+
+/// Returns the blocks reachable from the entry in depth-first preorder.
+std::vector<basicblock *> reachable_blocks(const cfg &graph);
+
+class loop {
+public:
+  const basicblock *header;
+  const loop *parent;
+  unsigned depth;
+  std::set<const basicblock *> blocks;
+};
+
+/// Natural loops of the control-flow graph.
+/// Every back-edge of a depth-first traversal closes a loop, back-edges
+/// targeting the same header belong to the same loop.
+class loop_info {
+  std::vector<std::unique_ptr<loop>> all_loops;
+  std::map<const basicblock *, const loop *> innermost_loop;
+
+public:
+  /// No loops, until the graph is analyzed.
+  loop_info() = default;
+  explicit loop_info(const cfg &graph);
+
+  /// The loops ordered by their depth, outermost first.
+  const std::vector<std::unique_ptr<loop>> &loops() const { return all_loops; }
+
+  /// Returns nullptr if the block is not part of any loop.
+  const loop *innermost(const basicblock &bb) const;
+  unsigned depth(const basicblock &bb) const;
+};
+
+/// How many times a block is expected to execute during a single run.
+using block_frequencies = std::map<const basicblock *, double>;
+
+/// Measured execution counts keyed by the id of the basic block.
+using block_profile = std::map<bb_idx, double>;
+
+/// Reads a profile consisting of '<block id> <execution count>' lines.
+block_profile read_block_profile(std::istream &is);
+
+/// Estimates the frequencies assuming that every loop iterates the same
+/// number of times. Blocks present in the profile take the measured count.
+block_frequencies estimate_block_frequencies(const cfg &graph,
+                                             const loop_info &loops,
+                                             const block_profile &profile = {});
+
+#endif // CFG_ANALYSIS_H
@@ -1,4 +1,5 @@
 #include "cfg_dumper.h"
+#include "cfg_analysis.h"
 #include "utility.h"
 
 #include <cassert>
@@ -11,34 +12,16 @@ std::ostream &text_cfg_dumper::operator()(const cfg &x) noexcept {
   os << "Exit:  " << x.exit->id << '\n';
 
   // Start dumping from  the entry block.
-  operator()(*x.entry);
+  for (const basicblock *bb : reachable_blocks(x))
+    operator()(*bb);
   return os;
 }
 
 std::ostream &text_cfg_dumper::operator()(const basicblock &x) noexcept {
-  auto [_, succeeded] = processed.insert(x.id);
-  if (!succeeded)
-    return os;
-
   os << "Basic block: " << x.id << '\n';
   text_cfg_dumper sub_dumper{os, indent + 2};
   for (const auto &inst : x.instructions)
     sub_dumper(inst);
-
-  if (x.instructions.empty())
-    return os;
-
-  std::visit(overloaded{[&](const auto &) {},
-                        [&](const selector &x) {
-                          operator()(x.true_branch);
-                          operator()(x.false_branch);
-                        },
-                        [&](const jump &x) { operator()(x.target); },
-                        [&](const switcher &x) {
-                          for (const basicblock *target : x.branches)
-                            operator()(*target);
-                        }},
-             x.instructions.back());
   return os;
 }
 
@@ -104,16 +87,13 @@ std::ostream &dot_cfg_dumper::operator()(const cfg &x) noexcept {
   os << "  node [shape=\"box\",style=filled];\n";
 
   // Start dumping from  the entry block.
-  operator()(*x.entry);
+  for (const basicblock *bb : reachable_blocks(x))
+    operator()(*bb);
   os << "}\n";
   return os;
 }
 
 std::ostream &dot_cfg_dumper::operator()(const basicblock &x) noexcept {
-  auto [_, succeeded] = processed.insert(x.id);
-  if (!succeeded)
-    return os;
-
   os << "  bb_" << x.id << " [label=\"";
   os << "---  bb_" << x.id << "  ---\\n\\n";
   dot_cfg_dumper sub_dumper{os};
@@ -129,23 +109,18 @@ std::ostream &dot_cfg_dumper::operator()(const basicblock &x) noexcept {
                           os << "  bb_" << x.id << " -> "
                              << "bb_" << y.true_branch.id
                              << "[label=\"true\",color=darkgreen]\n";
-                          operator()(y.true_branch);
                           os << "  bb_" << x.id << " -> "
                              << "bb_" << y.false_branch.id
                              << "[label=\"false\",color=red]\n";
-                          operator()(y.false_branch);
                         },
                         [&](const jump &y) {
                           os << "  bb_" << x.id << " -> "
                              << "bb_" << y.target.id << "\n";
-                          operator()(y.target);
                         },
                         [&](const switcher &y) {
                           for (const basicblock *target : y.branches)
                             os << "  bb_" << x.id << " -> "
                                << "bb_" << target->id << "\n";
-                          for (const basicblock *target : y.branches)
-                            operator()(*target);
                         }},
              x.instructions.back());
   return os;
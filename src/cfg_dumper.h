@@ -12,7 +12,6 @@
 /// Dump the basicblocks in preorder.
 class text_cfg_dumper : private expression_dumper {
   std::ostream &os;
-  std::set<bb_idx> processed;
   const unsigned indent;
 
 public:
@@ -22,6 +21,7 @@ public:
   using expression_dumper::operator();
 
   std::ostream &operator()(const cfg &x) noexcept;
+  /// Dumps only the block, not its successors.
   std::ostream &operator()(const basicblock &x) noexcept;
 
   std::ostream &operator()(const ir_instruction &x) const noexcept;
@@ -36,7 +36,6 @@ public:
 
 class dot_cfg_dumper : private expression_dumper {
   std::ostream &os;
-  std::set<bb_idx> processed;
 
 public:
   explicit dot_cfg_dumper(std::ostream &os) : expression_dumper{os}, os{os} {}
@@ -44,6 +43,7 @@ public:
   using expression_dumper::operator();
 
   std::ostream &operator()(const cfg &x) noexcept;
+  /// Dumps only the block, not its successors.
   std::ostream &operator()(const basicblock &x) noexcept;
 
   std::ostream &operator()(const ir_instruction &x) const noexcept;
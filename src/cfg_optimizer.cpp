@@ -0,0 +1,404 @@
+#include "cfg_optimizer.h"
+#include "cfg_analysis.h"
+#include "cfg_transformer.h"
+#include "typecheck.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <tuple>
+#include <variant>
+#include <vector>
+
+namespace {
+// Keeping a value in a temporary costs a store and a load for each use, so
+// only the expressions more expensive than that are worth it.
+constexpr unsigned min_cost_of_temporary = 3;
+
+/// Rough cycles of evaluating the expression, apart from the loads.
+unsigned evaluation_cost(const expression &x) {
+  return std::visit(
+      overloaded{[](const binop_expression &x) {
+                   const unsigned op_cost = x.op == "/" || x.op == "%" ? 26
+                                            : x.op == "*"              ? 4
+                                                                       : 1;
+                   return op_cost + evaluation_cost(*x.left) +
+                          evaluation_cost(*x.right);
+                 },
+                 [](const not_expression &x) {
+                   return 1 + evaluation_cost(*x.operand);
+                 },
+                 [](const auto &x) { return 0u; }},
+      x);
+}
+
+bool is_leaf(const expression &x) {
+  return !std::holds_alternative<binop_expression>(x) &&
+         !std::holds_alternative<not_expression>(x);
+}
+
+/// The expressions evaluated by the instruction, in evaluation order.
+std::vector<std::unique_ptr<expression> *> operands(ir_instruction &inst) {
+  return std::visit(
+      overloaded{[](assign_statement &x) {
+                   return std::vector<std::unique_ptr<expression> *>{&x.right};
+                 },
+                 [](write_statement &x) {
+                   return std::vector<std::unique_ptr<expression> *>{&x.value};
+                 },
+                 [](selector &x) {
+                   return std::vector<std::unique_ptr<expression> *>{
+                       &x.condition};
+                 },
+                 [](cassign &x) {
+                   return std::vector<std::unique_ptr<expression> *>{
+                       &x.condition};
+                 },
+                 [](auto &x) {
+                   return std::vector<std::unique_ptr<expression> *>{};
+                 }},
+      inst);
+}
+
+/// The variable the instruction overwrites with an unknown value.
+const std::string *killed_variable(const ir_instruction &inst) {
+  if (const auto *x = std::get_if<read_statement>(&inst))
+    return &x->id;
+  if (const auto *x = std::get_if<cassign>(&inst))
+    return &x->var.name;
+  return nullptr;
+}
+
+/// The compiler temporaries, shared by the blocks since no value lives
+/// across blocks.
+class temporaries {
+  symbols &syms;
+  std::map<type, std::vector<std::string>> names;
+
+public:
+  explicit temporaries(symbols &syms) : syms{syms} {}
+
+  const std::string &get(type ty, std::size_t index) {
+    std::vector<std::string> &of_type = names[ty];
+    while (of_type.size() <= index) {
+      const std::string prefix = std::string("__cse_") +
+                                 (ty == boolean ? "boolean_" : "natural_") +
+                                 std::to_string(of_type.size());
+      symbol temp{/*line=*/-1, generate_unique_identifier(syms, prefix), ty};
+      syms.insert(std::make_pair(temp.name, temp));
+      of_type.push_back(temp.name);
+    }
+    return of_type[index];
+  }
+};
+
+class local_value_numbering {
+  const symbols &syms;
+  basicblock &bb;
+
+  // Equal numbers denote equal values.
+  std::map<std::tuple<int, std::string, unsigned, unsigned>, unsigned> table;
+  std::map<std::string, unsigned> variable_numbers;
+  std::map<const expression *, unsigned> numbers;
+  unsigned next_number = 0;
+
+  // The variables known to hold a value.
+  std::map<unsigned, std::string> holders;
+  std::map<std::string, unsigned> contents;
+
+  // The values computed more than once, to keep in a temporary.
+  std::set<unsigned> kept;
+
+  // Whether an expression was replaced by a variable.
+  bool reused = false;
+
+public:
+  local_value_numbering(const symbols &syms, basicblock &bb)
+      : syms{syms}, bb{bb} {
+    for (ir_instruction &inst : bb.instructions) {
+      for (std::unique_ptr<expression> *x : operands(inst))
+        number(**x);
+      if (const auto *x = std::get_if<assign_statement>(&inst))
+        variable_numbers[x->left] = numbers.at(x->right.get());
+      else if (const std::string *var = killed_variable(inst))
+        variable_numbers[*var] = next_number++;
+    }
+  }
+
+  void plan() {
+    std::set<unsigned> computed;
+    for (ir_instruction &inst : bb.instructions) {
+      for (std::unique_ptr<expression> *x : operands(inst))
+        plan(**x, computed);
+      apply_effects(inst);
+    }
+    holders.clear();
+    contents.clear();
+  }
+
+  /// Returns whether any expression was reused.
+  bool rewrite(temporaries &temps) {
+    std::map<type, std::size_t> used_temps;
+    std::vector<ir_instruction> rewritten;
+    rewritten.reserve(bb.instructions.size());
+    for (ir_instruction &inst : bb.instructions) {
+      for (std::unique_ptr<expression> *x : operands(inst))
+        rewrite(**x, temps, used_temps, rewritten);
+      apply_effects(inst);
+      rewritten.push_back(std::move(inst));
+    }
+    bb.instructions = std::move(rewritten);
+    return reused;
+  }
+
+private:
+  unsigned lookup(std::tuple<int, std::string, unsigned, unsigned> key) {
+    const auto [it, inserted] = table.emplace(std::move(key), next_number);
+    if (inserted)
+      ++next_number;
+    return it->second;
+  }
+
+  unsigned number(const expression &x) {
+    const unsigned res = std::visit(
+        overloaded{
+            [&](const number_expression &x) {
+              return lookup({0, "", x.value, 0});
+            },
+            [&](const boolean_expression &x) {
+              return lookup({1, "", x.value, 0});
+            },
+            [&](const id_expression &x) {
+              const auto [it, inserted] =
+                  variable_numbers.emplace(x.name, next_number);
+              if (inserted)
+                ++next_number;
+              return it->second;
+            },
+            [&](const binop_expression &x) {
+              unsigned left = number(*x.left);
+              unsigned right = number(*x.right);
+              const bool commutative = x.op == "+" || x.op == "*" ||
+                                       x.op == "=" || x.op == "and" ||
+                                       x.op == "or";
+              if (commutative && right < left)
+                std::swap(left, right);
+              return lookup({2, x.op, left, right});
+            },
+            [&](const not_expression &x) {
+              return lookup({3, x.op, number(*x.operand), 0});
+            }},
+        x);
+    numbers.emplace(&x, res);
+    return res;
+  }
+
+  std::optional<std::string> holder(unsigned value) const {
+    const auto it = holders.find(value);
+    if (it == holders.end())
+      return std::nullopt;
+    const auto held = contents.find(it->second);
+    if (held == contents.end() || held->second != value)
+      return std::nullopt;
+    return it->second;
+  }
+
+  void hold(const std::string &var, unsigned value) {
+    contents[var] = value;
+    // Prefer the earlier holder, it might be a temporary living longer.
+    if (!holder(value).has_value())
+      holders[value] = var;
+  }
+
+  void apply_effects(const ir_instruction &inst) {
+    if (const auto *x = std::get_if<assign_statement>(&inst))
+      hold(x->left, numbers.at(x->right.get()));
+    else if (const std::string *var = killed_variable(inst))
+      contents.erase(*var);
+  }
+
+  void plan(const expression &x, std::set<unsigned> &computed) {
+    if (is_leaf(x))
+      return;
+    const unsigned value = numbers.at(&x);
+    if (holder(value).has_value() || kept.count(value) != 0)
+      return;
+    if (!computed.insert(value).second &&
+        evaluation_cost(x) >= min_cost_of_temporary) {
+      kept.insert(value);
+      return;
+    }
+    std::visit(overloaded{[&](const binop_expression &x) {
+                            plan(*x.left, computed);
+                            plan(*x.right, computed);
+                          },
+                          [&](const not_expression &x) {
+                            plan(*x.operand, computed);
+                          },
+                          [](const auto &x) {}},
+               x);
+  }
+
+  void rewrite(expression &x, temporaries &temps,
+               std::map<type, std::size_t> &used_temps,
+               std::vector<ir_instruction> &rewritten) {
+    if (is_leaf(x))
+      return;
+    const unsigned value = numbers.at(&x);
+    if (const auto var = holder(value)) {
+      x = id_expression{/*line=*/-1, *var};
+      reused = true;
+      return;
+    }
+
+    std::visit(overloaded{[&](binop_expression &x) {
+                            rewrite(*x.left, temps, used_temps, rewritten);
+                            rewrite(*x.right, temps, used_temps, rewritten);
+                          },
+                          [&](not_expression &x) {
+                            rewrite(*x.operand, temps, used_temps, rewritten);
+                          },
+                          [](auto &x) {}},
+               x);
+
+    if (kept.count(value) != 0) {
+      const type ty = infer_expression_type(syms, x);
+      const std::string &temp = temps.get(ty, used_temps[ty]++);
+      auto computation = std::make_unique<expression>(std::move(x));
+      x = id_expression{/*line=*/-1, temp};
+      rewritten.push_back(
+          assign_statement{/*line=*/-1, temp, std::move(computation)});
+      hold(temp, value);
+    }
+  }
+};
+
+/// Follows the chain of blocks containing only a jump.
+basicblock &forward_target(basicblock &bb,
+                           const std::set<const basicblock *> &pinned) {
+  basicblock *target = &bb;
+  std::set<const basicblock *> visited;
+  while (pinned.count(target) == 0 && target->instructions.size() == 1 &&
+         visited.insert(target).second) {
+    const auto *x = std::get_if<jump>(&target->instructions.back());
+    if (x == nullptr)
+      break;
+    target = &x->target;
+  }
+  return *target;
+}
+
+/// Retargets the terminator of the block, returns whether it changed.
+bool thread_jumps(basicblock &bb, const std::set<const basicblock *> &pinned) {
+  if (bb.instructions.empty())
+    return false;
+  ir_instruction &last = bb.instructions.back();
+
+  if (auto *x = std::get_if<jump>(&last)) {
+    basicblock &target = forward_target(x->target, pinned);
+    if (&target == &x->target)
+      return false;
+    bb.pop_last_ir_instruction();
+    bb.add_ir_instruction(jump{target});
+    return true;
+  }
+
+  if (auto *x = std::get_if<selector>(&last)) {
+    basicblock &true_branch = forward_target(x->true_branch, pinned);
+    basicblock &false_branch = forward_target(x->false_branch, pinned);
+    if (&true_branch == &false_branch) {
+      // The condition has no side effects.
+      bb.pop_last_ir_instruction();
+      bb.add_ir_instruction(jump{true_branch});
+      return true;
+    }
+    if (&true_branch == &x->true_branch && &false_branch == &x->false_branch)
+      return false;
+    auto condition = std::move(x->condition);
+    bb.pop_last_ir_instruction();
+    bb.add_ir_instruction(
+        selector{std::move(condition), true_branch, false_branch});
+    return true;
+  }
+  return false;
+}
+} // namespace
+
+bool simplify_cfg(cfg &graph) {
+  std::set<const basicblock *> pinned{graph.entry, graph.exit};
+  for (const auto &bb : graph.blocks) {
+    if (!bb->instructions.empty()) {
+      if (const auto *x = std::get_if<switcher>(&bb->instructions.back()))
+        pinned.insert(x->branches.begin(), x->branches.end());
+    }
+  }
+
+  bool any_change = false;
+  for (bool changed = true; changed; any_change |= changed) {
+    changed = false;
+    for (const auto &bb : graph.blocks)
+      changed |= thread_jumps(*bb, pinned);
+
+    const std::vector<basicblock *> reachable = reachable_blocks(graph);
+    std::map<const basicblock *, unsigned> predecessors;
+    for (const basicblock *bb : reachable)
+      for (const basicblock *succ : successors(*bb))
+        ++predecessors[succ];
+
+    // Append the single successor, if this is its single predecessor.
+    for (basicblock *bb : reachable) {
+      while (!bb->instructions.empty()) {
+        const auto *x = std::get_if<jump>(&bb->instructions.back());
+        if (x == nullptr)
+          break;
+        basicblock &succ = x->target;
+        if (&succ == bb || &succ == graph.entry || predecessors[&succ] != 1 ||
+            (pinned.count(&succ) != 0 && &succ != graph.exit))
+          break;
+
+        bb->instructions.pop_back();
+        std::move(succ.instructions.begin(), succ.instructions.end(),
+                  std::back_inserter(bb->instructions));
+        succ.instructions.clear();
+        predecessors[&succ] = 0;
+        if (graph.exit == &succ) {
+          pinned.erase(&succ);
+          pinned.insert(bb);
+          graph.exit = bb;
+        }
+        changed = true;
+      }
+    }
+
+    // Keep the exit even if it became unreachable.
+    std::set<const basicblock *> live{graph.exit};
+    for (const basicblock *bb : reachable_blocks(graph))
+      live.insert(bb);
+    const auto it = std::remove_if(
+        graph.blocks.begin(), graph.blocks.end(),
+        [&](const auto &bb) { return live.count(bb.get()) == 0; });
+    if (it != graph.blocks.end()) {
+      for (auto dead = it; dead != graph.blocks.end(); ++dead)
+        pinned.erase(dead->get());
+      graph.blocks.erase(it, graph.blocks.end());
+      changed = true;
+    }
+  }
+  return any_change;
+}
+
+bool eliminate_common_subexpressions(symbols &syms, cfg &graph) {
+  temporaries temps{syms};
+  bool changed = false;
+  for (const auto &bb : graph.blocks) {
+    local_value_numbering lvn{syms, *bb};
+    lvn.plan();
+    changed |= lvn.rewrite(temps);
+  }
+  return changed;
+}
@@ -0,0 +1,21 @@
+#ifndef CFG_OPTIMIZER_H
+#define CFG_OPTIMIZER_H
+
+#include "cfg.h"
+#include "expressions.h"
+
+/// Local value numbering. Within each basic block, an expression computed
+/// earlier is reused from a variable still holding its value, or from a
+/// compiler temporary if it is expensive enough to be worth keeping, instead
+/// of being evaluated again. Reads and assignments kill the values of the
+/// variables they write. Returns whether any expression was reused.
+bool eliminate_common_subexpressions(symbols &syms, cfg &graph);
+
+/// Threads the jumps through the blocks containing nothing but a jump, turns
+/// the selectors with identical branches into jumps, merges the blocks with
+/// their single successor if they are its single predecessor, and removes
+/// the unreachable blocks. The targets of the switchers are left intact,
+/// since their ids are stored in variables. Returns whether the graph changed.
+bool simplify_cfg(cfg &graph);
+
+#endif // CFG_OPTIMIZER_H
@@ -0,0 +1,532 @@
+#include "cfg_serialization.h"
+#include "utility.h"
+
+#include <bit>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <string_view>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+// The layout of the file, every field is a little endian 32 bit integer:
+//   magic            "WCFG"
+//   header
+//   string offsets   [string_count + 1]
+//   string bytes     [string_bytes], padded to a multiple of 4
+//   symbols          [symbol_count]
+//   blocks           [block_count]
+//   instructions     [instruction_count], grouped by their block
+//   expressions      [expression_count], the operands preceding their users
+//   switcher targets [branch_count]
+constexpr char cfg_magic[4] = {'W', 'C', 'F', 'G'};
+
+struct file_header {
+  std::uint32_t version;
+  std::uint32_t string_count;
+  std::uint32_t string_bytes;
+  std::uint32_t symbol_count;
+  std::uint32_t block_count;
+  std::uint32_t instruction_count;
+  std::uint32_t expression_count;
+  std::uint32_t branch_count;
+  std::uint32_t entry;
+  std::uint32_t exit;
+  std::uint32_t next_bb_idx;
+};
+
+struct symbol_record {
+  std::uint32_t name;
+  std::int32_t line;
+  std::uint32_t type;
+};
+
+struct block_record {
+  std::uint32_t id;
+  std::uint32_t first_instruction;
+  std::uint32_t instruction_count;
+};
+
+/// The kind is the index of the alternative in ir_instruction. The
+/// expressions refer to an expression record by its index.
+///   expression: the expression
+///   assign:     left name, right expression
+///   read:       name
+///   write:      value expression
+///   selector:   condition expression, true block, false block
+///   jump:       target block
+///   switcher:   variable name, first target, number of targets
+///   cassign:    variable name, condition expression, true and false values
+struct instruction_record {
+  std::uint32_t kind;
+  std::int32_t line;
+  std::uint32_t operands[4];
+};
+
+/// The kind is the index of the alternative in expression.
+///   number, boolean: value
+///   id:              name
+///   binop:           operator, left expression, right expression
+///   not:             operator, operand expression
+struct expression_record {
+  std::uint32_t kind;
+  std::int32_t line;
+  std::uint32_t operands[3];
+};
+
+static_assert(sizeof(file_header) == 44);
+static_assert(sizeof(symbol_record) == 12);
+static_assert(sizeof(block_record) == 12);
+static_assert(sizeof(instruction_record) == 24);
+static_assert(sizeof(expression_record) == 20);
+
+template <typename Variant, typename T, std::size_t I = 0>
+constexpr std::uint32_t alternative_index() {
+  if constexpr (std::is_same_v<std::variant_alternative_t<I, Variant>, T>)
+    return I;
+  else
+    return alternative_index<Variant, T, I + 1>();
+}
+
+template <typename T>
+constexpr std::uint32_t instruction_kind =
+    alternative_index<ir_instruction, T>();
+template <typename T>
+constexpr std::uint32_t expression_kind = alternative_index<expression, T>();
+
+/// Converts each 32 bit field of the record between the byte order of the
+/// host and the little endian order of the file.
+template <typename T> T swap_to_little_endian(T record) {
+  static_assert(sizeof(T) % sizeof(std::uint32_t) == 0);
+  if constexpr (std::endian::native == std::endian::big) {
+    std::uint32_t fields[sizeof(T) / sizeof(std::uint32_t)];
+    std::memcpy(fields, &record, sizeof(T));
+    for (std::uint32_t &x : fields)
+      x = (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
+    std::memcpy(&record, fields, sizeof(T));
+  }
+  return record;
+}
+
+[[noreturn]] void fail(std::string_view msg) {
+  throw compile_error{-1, std::string{msg} + '.'};
+}
+
+[[noreturn]] void malformed(std::string_view reason) {
+  fail("Malformed cfg: " + std::string(reason));
+}
+
+std::uint32_t narrow(std::size_t x) {
+  if (x > std::numeric_limits<std::uint32_t>::max())
+    fail("The cfg is too large to serialize");
+  return static_cast<std::uint32_t>(x);
+}
+
+class cfg_writer {
+  std::vector<std::string_view> strings;
+  std::map<std::string_view, std::uint32_t> string_indices;
+  std::map<const basicblock *, std::uint32_t> block_indices;
+  std::vector<symbol_record> symbol_records;
+  std::vector<block_record> block_records;
+  std::vector<instruction_record> instruction_records;
+  std::vector<expression_record> expression_records;
+  std::vector<std::uint32_t> branches;
+
+public:
+  cfg_writer(const symbols &syms, const cfg &graph) {
+    for (const auto &[name, sym] : syms)
+      symbol_records.push_back(
+          symbol_record{intern(sym.name), sym.line,
+                        static_cast<std::uint32_t>(sym.symbol_type)});
+
+    for (const auto &bb : graph.blocks)
+      block_indices.emplace(bb.get(), narrow(block_indices.size()));
+    for (const auto &bb : graph.blocks) {
+      const auto first = narrow(instruction_records.size());
+      for (const ir_instruction &inst : bb->instructions)
+        add_instruction(inst);
+      block_records.push_back(block_record{
+          narrow(bb->id), first,
+          narrow(instruction_records.size() - first)});
+    }
+  }
+
+  void write(std::ostream &os, const cfg &graph) const {
+    std::vector<std::uint32_t> offsets{0};
+    std::string bytes;
+    for (std::string_view str : strings) {
+      bytes += str;
+      offsets.push_back(narrow(bytes.size()));
+    }
+    const std::uint32_t string_bytes = narrow(bytes.size());
+    bytes.resize((bytes.size() + 3) / 4 * 4, '\0');
+
+    file_header header{};
+    header.version = cfg_format_version;
+    header.string_count = narrow(strings.size());
+    header.string_bytes = string_bytes;
+    header.symbol_count = narrow(symbol_records.size());
+    header.block_count = narrow(block_records.size());
+    header.instruction_count = narrow(instruction_records.size());
+    header.expression_count = narrow(expression_records.size());
+    header.branch_count = narrow(branches.size());
+    header.entry = block_indices.at(graph.entry);
+    header.exit = block_indices.at(graph.exit);
+    header.next_bb_idx = narrow(graph.next_bb_idx);
+
+    const auto write_record = [&os](auto record) {
+      record = swap_to_little_endian(record);
+      os.write(reinterpret_cast<const char *>(&record), sizeof(record));
+    };
+    const auto write_array = [&](const auto &records) {
+      if constexpr (std::endian::native == std::endian::little)
+        os.write(reinterpret_cast<const char *>(records.data()),
+                 records.size() * sizeof(records[0]));
+      else
+        for (const auto &record : records)
+          write_record(record);
+    };
+    os.write(cfg_magic, sizeof(cfg_magic));
+    write_record(header);
+    write_array(offsets);
+    os.write(bytes.data(), bytes.size());
+    write_array(symbol_records);
+    write_array(block_records);
+    write_array(instruction_records);
+    write_array(expression_records);
+    write_array(branches);
+  }
+
+private:
+  std::uint32_t intern(std::string_view str) {
+    const auto [it, inserted] =
+        string_indices.emplace(str, narrow(strings.size()));
+    if (inserted)
+      strings.push_back(str);
+    return it->second;
+  }
+
+  std::uint32_t add_expression(const expression &x) {
+    return std::visit([&](const auto &x) { return add_expression(x); }, x);
+  }
+
+  std::uint32_t add_expression(expression_record record) {
+    expression_records.push_back(record);
+    return narrow(expression_records.size() - 1);
+  }
+  std::uint32_t add_expression(const number_expression &x) {
+    return add_expression(
+        expression_record{expression_kind<number_expression>, 0, {x.value}});
+  }
+  std::uint32_t add_expression(const boolean_expression &x) {
+    return add_expression(
+        expression_record{expression_kind<boolean_expression>, 0, {x.value}});
+  }
+  std::uint32_t add_expression(const id_expression &x) {
+    return add_expression(expression_record{
+        expression_kind<id_expression>, x.line, {intern(x.name)}});
+  }
+  std::uint32_t add_expression(const binop_expression &x) {
+    const std::uint32_t left = add_expression(*x.left);
+    const std::uint32_t right = add_expression(*x.right);
+    return add_expression(expression_record{expression_kind<binop_expression>,
+                                            x.line,
+                                            {intern(x.op), left, right}});
+  }
+  std::uint32_t add_expression(const not_expression &x) {
+    const std::uint32_t operand = add_expression(*x.operand);
+    return add_expression(expression_record{
+        expression_kind<not_expression>, x.line, {intern(x.op), operand}});
+  }
+
+  void add_instruction(const ir_instruction &inst) {
+    const auto kind = static_cast<std::uint32_t>(inst.index());
+    instruction_record record = std::visit(
+        overloaded{
+            [&](const auto &x) {
+              // One of the expressions.
+              return instruction_record{kind, 0, {add_expression(x)}};
+            },
+            [&](const assign_statement &x) {
+              return instruction_record{
+                  kind,
+                  x.get_line(),
+                  {intern(x.left), add_expression(*x.right)}};
+            },
+            [&](const read_statement &x) {
+              return instruction_record{kind, x.get_line(), {intern(x.id)}};
+            },
+            [&](const write_statement &x) {
+              return instruction_record{
+                  kind, x.get_line(), {add_expression(*x.value)}};
+            },
+            [&](const selector &x) {
+              return instruction_record{
+                  kind,
+                  0,
+                  {add_expression(*x.condition),
+                   block_indices.at(&x.true_branch),
+                   block_indices.at(&x.false_branch)}};
+            },
+            [&](const jump &x) {
+              return instruction_record{
+                  kind, 0, {block_indices.at(&x.target)}};
+            },
+            [&](const switcher &x) {
+              const auto first = narrow(branches.size());
+              for (const basicblock *branch : x.branches)
+                branches.push_back(block_indices.at(branch));
+              return instruction_record{
+                  kind,
+                  x.var.line,
+                  {intern(x.var.name), first, narrow(x.branches.size())}};
+            },
+            [&](const cassign &x) {
+              return instruction_record{kind,
+                                        x.var.line,
+                                        {intern(x.var.name),
+                                         add_expression(*x.condition),
+                                         narrow(x.true_value),
+                                         narrow(x.false_value)}};
+            }},
+        inst);
+    instruction_records.push_back(record);
+  }
+};
+
+/// A view of consecutive records, copied out one by one to stay independent
+/// of the alignment of the mapping and converted to the byte order of the
+/// host.
+template <typename T> class record_array {
+  const std::byte *first = nullptr;
+  std::size_t count = 0;
+
+public:
+  record_array() = default;
+  record_array(const std::byte *first, std::size_t count)
+      : first{first}, count{count} {}
+
+  std::size_t size() const { return count; }
+  T operator[](std::size_t i) const {
+    if (i >= count)
+      malformed("index out of range");
+    T res;
+    std::memcpy(&res, first + i * sizeof(T), sizeof(T));
+    return swap_to_little_endian(res);
+  }
+};
+
+class cfg_reader {
+  std::span<const std::byte> data;
+  std::size_t offset = 0;
+  file_header header;
+  record_array<std::uint32_t> string_offsets;
+  const std::byte *string_bytes;
+  record_array<symbol_record> symbol_records;
+  record_array<block_record> block_records;
+  record_array<instruction_record> instruction_records;
+  record_array<expression_record> expression_records;
+  record_array<std::uint32_t> branches;
+  std::vector<std::unique_ptr<expression>> expressions;
+  std::vector<basicblock *> blocks;
+
+public:
+  explicit cfg_reader(std::span<const std::byte> data) : data{data} {
+    if (data.size() < sizeof(cfg_magic) ||
+        std::memcmp(data.data(), cfg_magic, sizeof(cfg_magic)) != 0)
+      malformed("not a cfg file");
+    offset = sizeof(cfg_magic);
+    header = take<file_header>(1)[0];
+    if (header.version != cfg_format_version)
+      malformed("unsupported version " + std::to_string(header.version));
+
+    string_offsets = take<std::uint32_t>(header.string_count + 1ull);
+    string_bytes = data.data() + offset;
+    take<std::byte>((header.string_bytes + 3ull) / 4 * 4);
+    symbol_records = take<symbol_record>(header.symbol_count);
+    block_records = take<block_record>(header.block_count);
+    instruction_records = take<instruction_record>(header.instruction_count);
+    expression_records = take<expression_record>(header.expression_count);
+    branches = take<std::uint32_t>(header.branch_count);
+  }
+
+  deserialized_cfg read() {
+    deserialized_cfg res;
+    for (std::size_t i = 0; i < symbol_records.size(); ++i) {
+      const symbol_record record = symbol_records[i];
+      if (record.type != boolean && record.type != natural)
+        malformed("invalid symbol type");
+      std::string name = string_at(record.name);
+      res.syms.emplace(name, symbol{record.line, name,
+                                    static_cast<type>(record.type)});
+    }
+
+    expressions.reserve(expression_records.size());
+    for (std::size_t i = 0; i < expression_records.size(); ++i)
+      expressions.push_back(read_expression(expression_records[i]));
+
+    cfg &graph = res.graph;
+    graph.blocks.clear();
+    graph.blocks.reserve(block_records.size());
+    for (std::size_t i = 0; i < block_records.size(); ++i) {
+      graph.blocks.push_back(
+          std::make_unique<basicblock>(block_records[i].id));
+      blocks.push_back(graph.blocks.back().get());
+    }
+    graph.entry = block_at(header.entry);
+    graph.exit = block_at(header.exit);
+    graph.next_bb_idx = header.next_bb_idx;
+
+    for (std::size_t i = 0; i < block_records.size(); ++i) {
+      const block_record record = block_records[i];
+      if (record.first_instruction + std::uint64_t{record.instruction_count} >
+          instruction_records.size())
+        malformed("instructions out of range");
+      blocks[i]->instructions.reserve(record.instruction_count);
+      for (std::uint32_t j = 0; j < record.instruction_count; ++j)
+        blocks[i]->instructions.push_back(read_instruction(
+            instruction_records[record.first_instruction + j]));
+    }
+    return res;
+  }
+
+private:
+  template <typename T> record_array<T> take(std::uint64_t count) {
+    if (count > (data.size() - offset) / sizeof(T))
+      malformed("truncated");
+    record_array<T> res{data.data() + offset, count};
+    offset += count * sizeof(T);
+    return res;
+  }
+
+  std::string string_at(std::uint32_t index) const {
+    const std::uint32_t begin = string_offsets[index];
+    const std::uint32_t end = string_offsets[index + std::uint64_t{1}];
+    if (begin > end || end > header.string_bytes)
+      malformed("invalid string table");
+    return std::string(reinterpret_cast<const char *>(string_bytes) + begin,
+                       end - begin);
+  }
+
+  basicblock *block_at(std::uint32_t index) const {
+    if (index >= blocks.size())
+      malformed("block index out of range");
+    return blocks[index];
+  }
+
+  std::unique_ptr<expression> expression_at(std::uint32_t index) {
+    // Every expression has a single user, which follows it.
+    if (index >= expressions.size() || !expressions[index])
+      malformed("invalid expression reference");
+    return std::move(expressions[index]);
+  }
+
+  std::unique_ptr<expression> read_expression(const expression_record &x) {
+    switch (x.kind) {
+    case expression_kind<number_expression>:
+      return std::make_unique<expression>(number_expression{x.operands[0]});
+    case expression_kind<boolean_expression>:
+      return std::make_unique<expression>(
+          boolean_expression{x.operands[0] != 0});
+    case expression_kind<id_expression>:
+      return std::make_unique<expression>(
+          id_expression{x.line, string_at(x.operands[0])});
+    case expression_kind<binop_expression>: {
+      auto left = expression_at(x.operands[1]);
+      auto right = expression_at(x.operands[2]);
+      return std::make_unique<expression>(binop_expression{
+          x.line, string_at(x.operands[0]), std::move(left), std::move(right)});
+    }
+    case expression_kind<not_expression>:
+      return std::make_unique<expression>(not_expression{
+          x.line, string_at(x.operands[0]), expression_at(x.operands[1])});
+    }
+    malformed("invalid expression kind");
+  }
+
+  ir_instruction read_instruction(const instruction_record &x) {
+    switch (x.kind) {
+    case instruction_kind<number_expression>:
+    case instruction_kind<boolean_expression>:
+    case instruction_kind<id_expression>:
+    case instruction_kind<binop_expression>:
+    case instruction_kind<not_expression>: {
+      std::unique_ptr<expression> expr = expression_at(x.operands[0]);
+      if (expr->index() != x.kind)
+        malformed("mismatching expression kind");
+      return std::visit(
+          [](auto &&e) -> ir_instruction { return std::move(e); },
+          std::move(*expr));
+    }
+    case instruction_kind<assign_statement>:
+      return assign_statement{x.line, string_at(x.operands[0]),
+                              expression_at(x.operands[1])};
+    case instruction_kind<read_statement>:
+      return read_statement{x.line, string_at(x.operands[0])};
+    case instruction_kind<write_statement>:
+      return write_statement{x.line, expression_at(x.operands[0])};
+    case instruction_kind<selector>:
+      return selector{expression_at(x.operands[0]), *block_at(x.operands[1]),
+                      *block_at(x.operands[2])};
+    case instruction_kind<jump>:
+      return jump{*block_at(x.operands[0])};
+    case instruction_kind<switcher>: {
+      switcher res{id_expression{x.line, string_at(x.operands[0])}, {}};
+      res.branches.reserve(x.operands[2]);
+      for (std::uint32_t i = 0; i < x.operands[2]; ++i)
+        res.branches.push_back(
+            block_at(branches[x.operands[1] + std::uint64_t{i}]));
+      return res;
+    }
+    case instruction_kind<cassign>:
+      return cassign{id_expression{x.line, string_at(x.operands[0])},
+                     expression_at(x.operands[1]), x.operands[2],
+                     x.operands[3]};
+    }
+    malformed("invalid instruction kind");
+  }
+};
+} // namespace
+
+void write_cfg(std::ostream &os, const symbols &syms, const cfg &graph) {
+  cfg_writer{syms, graph}.write(os, graph);
+}
+
+deserialized_cfg read_cfg(std::span<const std::byte> data) {
+  return cfg_reader{data}.read();
+}
+
+deserialized_cfg load_cfg(const std::string &path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    fail("Failed to open " + path);
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    close(fd);
+    fail("Failed to read " + path);
+  }
+
+  const auto size = static_cast<std::size_t>(info.st_size);
+  void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    fail("Failed to map " + path);
+
+  try {
+    deserialized_cfg res =
+        read_cfg({static_cast<const std::byte *>(mapping), size});
+    munmap(mapping, size);
+    return res;
+  } catch (...) {
+    munmap(mapping, size);
+    throw;
+  }
+}
@@ -0,0 +1,34 @@
+#ifndef CFG_SERIALIZATION_H
+#define CFG_SERIALIZATION_H
+
+#include "cfg.h"
+#include "expressions.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <span>
+#include <string>
+
+/// Bumped on every incompatible change of the binary format.
+constexpr std::uint32_t cfg_format_version = 1;
+
+/// Writes the graph and its symbols in a compact binary format. Every record
+/// has a fixed size, the names live in a single string table, and the edges
+/// refer to the blocks by their index, so reading needs no parsing.
+void write_cfg(std::ostream &os, const symbols &syms, const cfg &graph);
+
+struct deserialized_cfg {
+  symbols syms;
+  cfg graph;
+};
+
+/// Rebuilds the graph from the bytes produced by write_cfg. Throws a
+/// compile_error if the data is truncated, malformed or of a different
+/// version.
+deserialized_cfg read_cfg(std::span<const std::byte> data);
+
+/// Maps the file into memory and reads the graph from it.
+deserialized_cfg load_cfg(const std::string &path);
+
+#endif // CFG_SERIALIZATION_H
@@ -1,15 +1,16 @@
 #include "cfg_transformer.h"
 #include "utility.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
+#include <initializer_list>
 #include <memory>
 #include <random>
 #include <set>
 #include <string_view>
 #include <variant>
 
-namespace {
-
 std::string generate_unique_identifier(const symbols &syms,
                                        std::string_view prefix) {
   std::string unique_name{prefix};
@@ -18,6 +19,8 @@ std::string generate_unique_identifier(const symbols &syms,
   return unique_name;
 }
 
+namespace {
+
 template <typename T, typename... Ts>
 std::unique_ptr<expression> create_expr(Ts &&... args) {
   return std::make_unique<expression>(std::in_place_type<T>,
@@ -26,7 +29,54 @@ std::unique_ptr<expression> create_expr(Ts &&... args) {
 
 } // namespace
 
+std::optional<flatten_policy> parse_flatten_policy(std::string_view spec) {
+  constexpr std::string_view budget_prefix = "budget:";
+  flatten_policy policy;
+
+  while (!spec.empty()) {
+    const auto comma = spec.find(',');
+    const std::string_view item = spec.substr(0, comma);
+    spec = comma == std::string_view::npos ? "" : spec.substr(comma + 1);
+
+    if (item == "all") {
+      policy.budget_percent = 100;
+    } else if (item == "hierarchical") {
+      policy.hierarchical = true;
+    } else if (item == "replicated") {
+      policy.replicated = true;
+    } else if (item.substr(0, budget_prefix.size()) == budget_prefix) {
+      const std::string_view digits = item.substr(budget_prefix.size());
+      unsigned percent = 0;
+      const auto [end, ec] = std::from_chars(
+          digits.data(), digits.data() + digits.size(), percent);
+      if (ec != std::errc{} || end != digits.data() + digits.size() ||
+          digits.empty() || percent > 100)
+        return std::nullopt;
+      policy.budget_percent = percent;
+    } else {
+      return std::nullopt;
+    }
+  }
+  return policy;
+}
+
+std::string format_flatten_policy(const flatten_policy &policy) {
+  std::string res = "budget:" + std::to_string(policy.budget_percent);
+  if (policy.hierarchical)
+    res += ",hierarchical";
+  if (policy.replicated)
+    res += ",replicated";
+  return res;
+}
+
 void flatten(symbols &syms, cfg &graph) {
+  const loop_info loops{graph};
+  block_frequencies freqs = estimate_block_frequencies(graph, loops);
+  flatten(syms, graph, flatten_policy{}, loops, freqs);
+}
+
+void flatten(symbols &syms, cfg &graph, const flatten_policy &policy,
+             const loop_info &loops, block_frequencies &freqs) {
   std::vector targets = [&graph] {
     std::vector<basicblock *> res;
     res.reserve(graph.blocks.size());
@@ -35,12 +85,42 @@ void flatten(symbols &syms, cfg &graph) {
     return res;
   }();
 
+  // Only the blocks ending with a control-flow instruction are worth
+  // flattening. Pick the coldest ones until the budget is exhausted.
+  std::set<const basicblock *> flattened = [&] {
+    std::vector<const basicblock *> candidates;
+    double total_frequency = 0;
+    for (const basicblock *target : targets) {
+      if (successors(*target).empty())
+        continue;
+      candidates.push_back(target);
+      total_frequency += freqs.at(target);
+    }
+    if (policy.budget_percent >= 100)
+      return std::set<const basicblock *>(candidates.begin(), candidates.end());
+
+    std::stable_sort(candidates.begin(), candidates.end(),
+                     [&freqs](const basicblock *lhs, const basicblock *rhs) {
+                       return freqs.at(lhs) < freqs.at(rhs);
+                     });
+
+    const double budget = total_frequency * policy.budget_percent / 100;
+    std::set<const basicblock *> res;
+    double spent = 0;
+    for (const basicblock *candidate : candidates) {
+      spent += freqs.at(candidate);
+      if (spent > budget)
+        break;
+      res.insert(candidate);
+    }
+    return res;
+  }();
+
   constexpr int invalid_lineno = -1;
 
   basicblock *new_entry = graph.create_bb();
-  basicblock *switch_dispatcher = graph.create_bb();
   const bb_idx original_entry = graph.entry->id;
-  const bb_idx original_exit = graph.exit->id;
+  freqs[new_entry] = freqs.at(graph.entry);
 
   // Create a unique identifier and declare it.
   symbol bb_selector{
@@ -49,6 +129,31 @@ void flatten(symbols &syms, cfg &graph) {
   syms.insert(std::make_pair(bb_selector.name, bb_selector));
   id_expression selector_var{invalid_lineno, /*name=*/bb_selector.name};
 
+  // Each region has its own dispatcher, which is responsible for the
+  // transitions originating from the region. The nullptr denotes the region
+  // outside of every loop. A replicated dispatcher has no block of its own,
+  // its switch is copied to the end of each site dispatching through it.
+  struct region_dispatcher {
+    basicblock *block = nullptr;
+    std::set<const basicblock *> targets;
+    std::vector<basicblock *> sites;
+  };
+  std::map<const loop *, region_dispatcher> dispatchers;
+  const auto dispatch = [&](basicblock &site, const basicblock &from,
+                            std::initializer_list<const basicblock *> to) {
+    const loop *region = policy.hierarchical ? loops.innermost(from) : nullptr;
+    region_dispatcher &dispatcher = dispatchers[region];
+    dispatcher.targets.insert(to);
+    if (policy.replicated) {
+      dispatcher.sites.push_back(&site);
+      return;
+    }
+    if (dispatcher.block == nullptr)
+      dispatcher.block = graph.create_bb();
+    freqs[dispatcher.block] += freqs.at(&from);
+    site.add_ir_instruction(jump{*dispatcher.block});
+  };
+
   // NewEntry:
   // selector := original_entry
   // dispatch!
@@ -56,14 +161,14 @@ void flatten(symbols &syms, cfg &graph) {
       invalid_lineno,
       /*left=*/bb_selector.name,
       /*right=*/create_expr<number_expression>(original_entry)});
-  new_entry->add_ir_instruction(jump{*switch_dispatcher});
+  dispatch(*new_entry, *graph.entry, {graph.entry});
 
   // The CFG should start from the new entry.
   graph.entry = new_entry;
 
   // Replace the (last) cfg-instruction in each basic block.
   for (basicblock *target : targets) {
-    if (target->instructions.empty())
+    if (flattened.count(target) == 0)
       continue;
 
     ir_instruction last = target->pop_last_ir_instruction();
@@ -75,7 +180,7 @@ void flatten(symbols &syms, cfg &graph) {
                                          /*condition=*/std::move(x->condition),
                                          /*true_value=*/x->true_branch.id,
                                          /*false_value=*/x->false_branch.id});
-      target->add_ir_instruction(jump{*switch_dispatcher});
+      dispatch(*target, *target, {&x->true_branch, &x->false_branch});
     } else if (auto *x = std::get_if<jump>(&last)) {
       // selector := target.id
       // dispatch!
@@ -84,13 +189,53 @@ void flatten(symbols &syms, cfg &graph) {
           /*left=*/selector_var.name,
           /*right=*/
           create_expr<number_expression>(/*value=*/x->target.id)});
-      target->add_ir_instruction(jump{*switch_dispatcher});
+      dispatch(*target, *target, {&x->target});
     } else {
       target->add_ir_instruction(std::move(last));
     }
   }
 
-  // Add the IR instruction for the switch to the dispatcher basic block.
-  switch_dispatcher->add_ir_instruction(
-      switcher{selector_var, std::move(targets)});
+  // Add the IR instruction for the switch to the dispatcher basic blocks,
+  // or to each of their sites if replicated.
+  // The branches follow the order of the blocks in the graph.
+  for (auto &[region, dispatcher] : dispatchers) {
+    std::vector<basicblock *> branches;
+    for (basicblock *target : targets)
+      if (dispatcher.targets.count(target) != 0)
+        branches.push_back(target);
+    for (basicblock *site : dispatcher.sites)
+      site->add_ir_instruction(switcher{selector_var, branches});
+    if (dispatcher.block != nullptr)
+      dispatcher.block->add_ir_instruction(
+          switcher{selector_var, std::move(branches)});
+  }
+}
+
+void remap_dispatch_ids(cfg &graph, const std::map<bb_idx, bb_idx> &new_ids) {
+  const auto remapped = [&new_ids](bb_idx id) {
+    const auto it = new_ids.find(id);
+    return it == new_ids.end() ? id : it->second;
+  };
+
+  std::set<std::string> selectors;
+  for (const auto &bb : graph.blocks)
+    for (const ir_instruction &inst : bb->instructions)
+      if (const auto *x = std::get_if<switcher>(&inst))
+        selectors.insert(x->var.name);
+
+  for (const auto &bb : graph.blocks) {
+    for (ir_instruction &inst : bb->instructions) {
+      if (auto *x = std::get_if<cassign>(&inst)) {
+        x->true_value = remapped(x->true_value);
+        x->false_value = remapped(x->false_value);
+      } else if (auto *x = std::get_if<assign_statement>(&inst);
+                 x != nullptr && selectors.count(x->left) != 0) {
+        auto *value = std::get_if<number_expression>(x->right.get());
+        if (value == nullptr)
+          error(-1, "The remap pass cannot rewrite the dispatch of the "
+                    "flatten pass, a block is selected by a computed id.");
+        value->value = remapped(value->value);
+      }
+    }
+  }
 }
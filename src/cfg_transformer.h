@@ -2,10 +2,50 @@
 #define CFG_TRANSFORMER_H
 
 #include "cfg.h"
+#include "cfg_analysis.h"
 
+#include <map>
+#include <optional>
+#include <random>
+#include <set>
+#include <string>
+#include <string_view>
+#include <tuple>
+
+/// Returns the prefix, extended if necessary to be distinct from every symbol.
+std::string generate_unique_identifier(const symbols &syms,
+                                       std::string_view prefix);
+
+struct flatten_policy {
+  /// Share of the estimated block executions that may end in a dispatch,
+  /// in percent. The coldest blocks are flattened first.
+  unsigned budget_percent = 100;
+  /// Give each loop its own local dispatcher instead of a single global one.
+  bool hierarchical = false;
+  /// End each flattened block with its own copy of the dispatch, so that the
+  /// branch predictor sees a separate indirect transition for each block.
+  bool replicated = false;
+};
+
+/// Parses a comma separated list of 'all', 'hierarchical', 'replicated' and
+/// 'budget:<percent>'.
+std::optional<flatten_policy> parse_flatten_policy(std::string_view spec);
+
+/// The spec parse_flatten_policy reads back into the policy.
+std::string format_flatten_policy(const flatten_policy &policy);
+
+/// Routes every transition of the graph through a single dispatcher.
 void flatten(symbols &syms, cfg &graph);
 
-template <typename Generator> void remap_block_ids(cfg &graph, Generator &gen) {
+/// Routes only the transitions of the blocks selected by the policy through
+/// the dispatchers, the rest of the blocks keep their direct jumps.
+/// The frequencies of the created blocks are added to the freqs.
+void flatten(symbols &syms, cfg &graph, const flatten_policy &policy,
+             const loop_info &loops, block_frequencies &freqs);
+
+/// Gives every block a distinct random id. Returns the new id of each old one.
+template <typename Generator>
+std::map<bb_idx, bb_idx> remap_block_ids(cfg &graph, Generator &gen) {
   constexpr auto largest_random = 1 << 30;
   std::uniform_int_distribution<bb_idx> distr(0, largest_random);
 
@@ -30,6 +70,13 @@ template <typename Generator> void remap_block_ids(cfg &graph, Generator &gen) {
     block->id = new_id;
   }
   graph.next_bb_idx = largest_random + 1;
+  return remap;
 }
 
+/// Rewrites the ids the dispatchers of the flattening select the blocks by,
+/// after the blocks got the given new ids: the values of the conditional
+/// assignments and the constants assigned to the variables switched on.
+/// Throws a compile_error if such a variable is assigned anything else.
+void remap_dispatch_ids(cfg &graph, const std::map<bb_idx, bb_idx> &new_ids);
+
 #endif // CFG_TRANSFORMER_H
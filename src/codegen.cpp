@@ -1,85 +1,263 @@
+#include "codegen.h"
 #include "cfg.h"
+#include "cfg_analysis.h"
+#include "constant_encoding.h"
 #include "expressions.h"
 #include "statements.h"
 #include "typecheck.h"
 #include "utility.h"
 
 #include <algorithm>
+#include <array>
 #include <cassert>
+#include <cctype>
+#include <cstdint>
 #include <iostream>
+#include <map>
 #include <optional>
 #include <random>
 #include <set>
 #include <sstream>
+#include <string>
 #include <string_view>
+#include <type_traits>
+#include <vector>
 
 namespace {
+constexpr unsigned cache_line_size = 64;
+
+unsigned width_of(type ty) { return ty == boolean ? 1 : 4; }
+
 class symbols_to_asm {
   std::ostream &ss;
 
 public:
   explicit symbols_to_asm(std::ostream &ss) : ss{ss} {}
 
-  void operator()(const symbols &syms) const {
-    for (const auto &pair : syms) {
-      const auto &name = pair.first;
-      const symbol &sym = pair.second;
-      const int width = sym.symbol_type == boolean ? 1 : 4;
-      ss << "var_" << sym.name << ": resb " << width << '\n';
+  /// Every variable is aligned to its width, so none of them straddles a
+  /// cache line.
+  void operator()(const std::vector<const symbol *> &layout) const {
+    ss << "alignb " << cache_line_size << '\n';
+    unsigned offset = 0;
+    for (const symbol *sym : layout) {
+      const unsigned width = width_of(sym->symbol_type);
+      if (offset % width != 0) {
+        ss << "alignb " << width << '\n';
+        offset += width - offset % width;
+      }
+      ss << "var_" << sym->name << ": resb " << width << '\n';
+      offset += width;
     }
   }
 };
 
+void count_variable_uses(const expression &x,
+                         std::map<std::string_view, unsigned> &counts) {
+  std::visit(overloaded{[&](const id_expression &x) { ++counts[x.name]; },
+                        [&](const binop_expression &x) {
+                          count_variable_uses(*x.left, counts);
+                          count_variable_uses(*x.right, counts);
+                        },
+                        [&](const not_expression &x) {
+                          count_variable_uses(*x.operand, counts);
+                        },
+                        [&](const auto &x) {}},
+             x);
+}
+
+std::map<std::string_view, unsigned>
+count_variable_uses(const basicblock &bb) {
+  std::map<std::string_view, unsigned> counts;
+  for (const ir_instruction &inst : bb.instructions) {
+    std::visit(overloaded{[&](const auto &x) {},
+                          [&](const assign_statement &x) {
+                            ++counts[x.left];
+                            count_variable_uses(*x.right, counts);
+                          },
+                          [&](const read_statement &x) { ++counts[x.id]; },
+                          [&](const write_statement &x) {
+                            count_variable_uses(*x.value, counts);
+                          },
+                          [&](const selector &x) {
+                            count_variable_uses(*x.condition, counts);
+                          },
+                          [&](const switcher &x) { ++counts[x.var.name]; },
+                          [&](const cassign &x) {
+                            ++counts[x.var.name];
+                            count_variable_uses(*x.condition, counts);
+                          }},
+               inst);
+  }
+  return counts;
+}
+
+/// Orders the variables of the data section. Visiting the blocks from the
+/// hottest one, the variables are placed as they first show up, the heavier
+/// ones first, so the variables of the hot loops are packed together in the
+/// first few cache lines. The naturals of a block precede its booleans to
+/// save on padding. The unused variables come last.
+std::vector<const symbol *> layout_variables(const cfg &graph,
+                                             const symbols &syms,
+                                             const block_frequencies &freqs) {
+  const auto frequency_of = [&](const basicblock *bb) {
+    const auto it = freqs.find(bb);
+    return it == freqs.end() ? 1 : it->second;
+  };
+
+  using block_uses =
+      std::pair<const basicblock *, std::map<std::string_view, unsigned>>;
+  std::vector<block_uses> uses;
+  std::map<std::string_view, double> weights;
+  for (const auto &bb : graph.blocks) {
+    uses.emplace_back(bb.get(), count_variable_uses(*bb));
+    for (const auto &[name, count] : uses.back().second)
+      weights[name] += frequency_of(bb.get()) * count;
+  }
+  std::stable_sort(uses.begin(), uses.end(),
+                   [&](const auto &lhs, const auto &rhs) {
+                     return frequency_of(lhs.first) > frequency_of(rhs.first);
+                   });
+
+  std::vector<const symbol *> layout;
+  std::set<std::string_view> placed;
+  const auto place = [&](std::vector<const symbol *> group) {
+    std::stable_sort(group.begin(), group.end(),
+                     [&](const symbol *lhs, const symbol *rhs) {
+                       if (lhs->symbol_type != rhs->symbol_type)
+                         return lhs->symbol_type == natural;
+                       return weights[lhs->name] > weights[rhs->name];
+                     });
+    layout.insert(layout.end(), group.begin(), group.end());
+  };
+
+  for (const auto &[bb, counts] : uses) {
+    std::vector<const symbol *> group;
+    for (const auto &[name, count] : counts) {
+      const auto it = syms.find(std::string(name));
+      if (it != syms.end() && placed.insert(it->second.name).second)
+        group.push_back(&it->second);
+    }
+    place(std::move(group));
+  }
+
+  std::vector<const symbol *> unused;
+  for (const auto &[name, sym] : syms)
+    if (placed.count(sym.name) == 0)
+      unused.push_back(&sym);
+  place(std::move(unused));
+  return layout;
+}
+
 std::string_view get_register(type ty) { return ty == boolean ? "al" : "eax"; }
 
-void emit_eq_code(std::ostream &ss, type ty) {
-  ss << (ty == natural ? "cmp eax,ecx\n" : "cmp al,cl\n");
-  ss << "mov al,0\n";
-  ss << "mov cx,1\n";
-  ss << "cmove ax,cx\n";
+/// The memory operand of the variable, sized by its declared type.
+std::string variable_operand(const symbol &sym) {
+  return (sym.symbol_type == boolean ? "byte [var_" : "dword [var_") +
+         sym.name + ']';
 }
 
-void emit_operator_code(std::ostream &ss, std::string_view op) {
+// The registers holding the intermediate results of the expressions, besides
+// eax. The multiplication and the division clobber edx.
+constexpr std::array<std::string_view, 5> scratch_registers{"ecx", "ebx", "esi",
+                                                            "edi", "edx"};
+
+// The scratch registers main has to preserve for its caller.
+constexpr std::array<std::string_view, 3> callee_saved_registers{"ebx", "esi",
+                                                                 "edi"};
+
+std::string_view low_byte(std::string_view reg) {
+  if (reg == "eax")
+    return "al";
+  if (reg == "ecx")
+    return "cl";
+  if (reg == "edx")
+    return "dl";
+  if (reg == "ebx")
+    return "bl";
+  return {};
+}
+
+bool is_commutative(std::string_view op) {
+  return op == "+" || op == "*" || op == "=" || op == "and" || op == "or";
+}
+
+bool clobbers_edx(std::string_view op) {
+  return op == "*" || op == "/" || op == "%";
+}
+
+bool clobbers_edx(const expression &x) {
+  return std::visit(overloaded{[](const binop_expression &x) {
+                                 return clobbers_edx(x.op) ||
+                                        clobbers_edx(*x.left) ||
+                                        clobbers_edx(*x.right);
+                               },
+                               [](const not_expression &x) {
+                                 return clobbers_edx(*x.operand);
+                               },
+                               [](const auto &x) { return false; }},
+                    x);
+}
+
+/// Combines the left operand in eax (or al) with the right operand, which is
+/// a register, a memory reference or an immediate of the operand type.
+void emit_operator_code(std::ostream &ss, cycle_counter &cost,
+                        std::string_view op, type ty, std::string_view rhs) {
+  const bool is_immediate =
+      !rhs.empty() && std::isdigit(static_cast<unsigned char>(rhs.front()));
+  const memory_access access = rhs.find('[') != std::string_view::npos
+                                   ? memory_access::load
+                                   : memory_access::none;
+  const std::string_view lhs = ty == boolean ? "al" : "eax";
+
+  const auto emit_comparison = [&](std::string_view condition) {
+    ss << "cmp " << lhs << ',' << rhs << '\n';
+    ss << "set" << condition << " al\n";
+    cost.charge("cmp", access);
+    cost.charge("set" + std::string(condition));
+  };
+
   if (op == "+") {
-    ss << "add eax,ecx\n";
+    ss << "add eax," << rhs << '\n';
+    cost.charge("add", access);
   } else if (op == "-") {
-    ss << "sub eax,ecx\n";
+    ss << "sub eax," << rhs << '\n';
+    cost.charge("sub", access);
   } else if (op == "*") {
-    ss << "xor edx,edx\n";
-    ss << "mul ecx\n";
+    if (is_immediate) {
+      ss << "imul eax,eax," << rhs << '\n';
+      cost.charge("imul");
+    } else {
+      ss << "mul " << rhs << '\n';
+      cost.charge("mul", access);
+    }
   } else if (op == "/") {
     ss << "xor edx,edx\n";
-    ss << "div ecx\n";
+    ss << "div " << rhs << '\n';
+    cost.charge("xor");
+    cost.charge("div", access);
   } else if (op == "%") {
     ss << "xor edx,edx\n";
-    ss << "div ecx\n";
+    ss << "div " << rhs << '\n';
     ss << "mov eax,edx\n";
+    cost.charge("xor");
+    cost.charge("div", access);
+    cost.charge("mov");
+  } else if (op == "=") {
+    emit_comparison("e");
   } else if (op == "<") {
-    ss << "cmp eax,ecx\n";
-    ss << "mov al,0\n";
-    ss << "mov cx,1\n";
-    ss << "cmovb ax,cx\n";
+    emit_comparison("b");
   } else if (op == "<=") {
-    ss << "cmp eax,ecx\n";
-    ss << "mov al,0\n";
-    ss << "mov cx,1\n";
-    ss << "cmovbe ax,cx\n";
+    emit_comparison("be");
   } else if (op == ">") {
-    ss << "cmp eax,ecx\n";
-    ss << "mov al,0\n";
-    ss << "mov cx,1\n";
-    ss << "cmova ax,cx\n";
+    emit_comparison("a");
   } else if (op == ">=") {
-    ss << "cmp eax,ecx\n";
-    ss << "mov al,0\n";
-    ss << "mov cx,1\n";
-    ss << "cmovae ax,cx\n";
+    emit_comparison("ae");
   } else if (op == "and") {
-    ss << "cmp al,1\n";
-    ss << "cmove ax,cx\n";
+    ss << "and al," << rhs << '\n';
+    cost.charge("and", access);
   } else if (op == "or") {
-    ss << "cmp al,0\n";
-    ss << "cmove ax,cx\n";
+    ss << "or al," << rhs << '\n';
+    cost.charge("or", access);
   } else {
     error(-1,
           std::string("Bug: Unsupported binary operator: ") + std::string(op));
@@ -90,70 +268,223 @@ std::string_view get_type_name(type ty) {
   return ty == boolean ? "boolean" : "natural";
 }
 
+// These scratch registers hold the constants recurring in a block.
+constexpr std::array<std::string_view, 2> constant_cache_registers{"esi",
+                                                                   "edi"};
+
+/// The constants of the basic block being emitted.
+struct block_constants {
+  /// Emit the constants in plain if null.
+  constant_encoder *encoder;
+  /// The constants decoded at the beginning of the block.
+  std::map<std::uint32_t, std::string_view> cached;
+  unsigned occurrences = 0;
+};
+
+void count_constants(const expression &x,
+                     std::map<std::uint32_t, unsigned> &counts) {
+  std::visit(overloaded{[&](const number_expression &x) { ++counts[x.value]; },
+                        [&](const boolean_expression &x) { ++counts[x.value]; },
+                        [&](const id_expression &x) {},
+                        [&](const binop_expression &x) {
+                          count_constants(*x.left, counts);
+                          count_constants(*x.right, counts);
+                        },
+                        [&](const not_expression &x) {
+                          count_constants(*x.operand, counts);
+                        }},
+             x);
+}
+
+std::map<std::uint32_t, unsigned> count_constants(const basicblock &bb) {
+  std::map<std::uint32_t, unsigned> counts;
+  for (const ir_instruction &inst : bb.instructions) {
+    std::visit(overloaded{[&](const auto &x) {},
+                          [&](const assign_statement &x) {
+                            count_constants(*x.right, counts);
+                          },
+                          [&](const write_statement &x) {
+                            count_constants(*x.value, counts);
+                          },
+                          [&](const selector &x) {
+                            count_constants(*x.condition, counts);
+                          },
+                          [&](const cassign &x) {
+                            count_constants(*x.condition, counts);
+                          }},
+               inst);
+  }
+  return counts;
+}
+
 class expr_to_asm {
 protected:
   const symbols &syms;
   std::ostream &ss;
+  cycle_counter &cost;
   const basicblock &current_block;
-  const bool encode_constants;
+  block_constants &constants;
+  /// The scratch registers not holding an intermediate result.
+  mutable std::vector<std::string_view> free_registers{
+      scratch_registers.begin(), scratch_registers.end()};
 
 public:
-  expr_to_asm(const symbols &syms, std::ostream &ss, bool encode_constants,
-              const basicblock &current_block)
-      : syms{syms}, ss{ss}, current_block{current_block},
-        encode_constants{encode_constants} {}
-
-  void operator()(const number_expression &x) const {
-    if (encode_constants) {
-      const auto half_id = current_block.id / 2;
-      const bb_idx encoded = current_block.id ^ (x.value + half_id);
-      ss << "mov eax, " << encoded << '\n';
-      ss << "mov ebx, " << current_block.id << '\n';
-      ss << "xor eax, ebx\n";
-      ss << "sub eax, " << half_id << "; encoded " << x.value << "\n";
+  expr_to_asm(const symbols &syms, std::ostream &ss, cycle_counter &cost,
+              block_constants &constants, const basicblock &current_block)
+      : syms{syms}, ss{ss}, cost{cost}, current_block{current_block},
+        constants{constants} {}
+
+  void emit_constant(std::uint32_t value) const {
+    if (constants.encoder == nullptr) {
+      ss << "mov eax," << value << '\n';
+      cost.charge("mov");
+    } else if (const auto it = constants.cached.find(value);
+               it != constants.cached.end()) {
+      ss << "mov eax," << it->second << '\n';
+      cost.charge("mov");
     } else {
-      ss << "mov eax," << x.value << '\n';
+      constants.encoder->emit_decode(ss, cost, current_block, value,
+                                     constants.occurrences++, "eax");
     }
   }
+
+  /// The right operand of the operator as a register, memory reference or
+  /// immediate, if it can be used without evaluating it first.
+  std::optional<std::string> direct_operand(const expression &x,
+                                            std::string_view op,
+                                            type ty) const {
+    const auto constant =
+        [&](std::uint32_t value) -> std::optional<std::string> {
+      if (constants.encoder == nullptr) {
+        // The division takes no immediate.
+        if (op == "/" || op == "%")
+          return std::nullopt;
+        return std::to_string(value);
+      }
+      const auto it = constants.cached.find(value);
+      if (it == constants.cached.end() || ty == boolean)
+        return std::nullopt;
+      return std::string(it->second);
+    };
+
+    return std::visit(
+        overloaded{
+            [&](const number_expression &x) { return constant(x.value); },
+            [&](const boolean_expression &x) { return constant(x.value); },
+            [&](const id_expression &x) -> std::optional<std::string> {
+              const auto it = syms.find(x.name);
+              assert(it != syms.end());
+              return variable_operand(it->second);
+            },
+            [&](const auto &x) -> std::optional<std::string> {
+              return std::nullopt;
+            }},
+        x);
+  }
+
+  /// The number of registers needed to evaluate the expression without
+  /// spilling, following Sethi and Ullman.
+  unsigned register_need(const expression &x) const {
+    return std::visit(
+        overloaded{[&](const binop_expression &x) {
+                     const unsigned left = register_need(*x.left);
+                     const type ty = infer_expression_type(syms, *x.left);
+                     if (direct_operand(*x.right, x.op, ty).has_value())
+                       return left;
+                     const unsigned right = register_need(*x.right);
+                     return left == right ? left + 1 : std::max(left, right);
+                   },
+                   [&](const not_expression &x) {
+                     return register_need(*x.operand);
+                   },
+                   [&](const auto &x) { return 1u; }},
+        x);
+  }
+
+  void operator()(const number_expression &x) const { emit_constant(x.value); }
   void operator()(const boolean_expression &x) const {
-    if (encode_constants) {
-      const auto half_id = current_block.id / 2;
-      const bb_idx encoded = current_block.id ^ (x.value + half_id);
-      ss << "mov eax, " << encoded << '\n';
-      ss << "mov ebx, " << current_block.id << '\n';
-      ss << "xor eax, ebx\n";
-      ss << "sub eax, " << half_id << "; encoded " << x.value << "\n";
-    } else {
-      ss << "mov eax," << x.value << '\n';
-    }
+    emit_constant(x.value);
   }
   void operator()(const id_expression &x) const {
     const auto it = syms.find(x.name);
     assert(it != syms.end());
-    ss << "mov eax,[var_" << it->second.name + "]\n";
+    if (it->second.symbol_type == boolean) {
+      ss << "movzx eax," << variable_operand(it->second) << '\n';
+      cost.charge("movzx", memory_access::load);
+    } else {
+      ss << "mov eax," << variable_operand(it->second) << '\n';
+      cost.charge("mov", memory_access::load);
+    }
   }
   void operator()(const binop_expression &x) const {
-    std::visit(*this, *x.left);
-    ss << "push eax\n";
-    std::visit(*this, *x.right);
-    ss << "mov ecx,eax\n";
-    ss << "pop eax\n";
-    if (x.op == "=")
-      emit_eq_code(ss, infer_expression_type(syms, *x.left));
-    else
-      emit_operator_code(ss, x.op);
+    const type ty = infer_expression_type(syms, *x.left);
+    if (const auto rhs = direct_operand(*x.right, x.op, ty)) {
+      std::visit(*this, *x.left);
+      emit_operator_code(ss, cost, x.op, ty, *rhs);
+      return;
+    }
+
+    // Hold one of the operands in a scratch register while evaluating the
+    // other one, unless that would clobber it.
+    const bool edx_clobbered = clobbers_edx(x.op) || clobbers_edx(*x.left) ||
+                               clobbers_edx(*x.right);
+    const auto it = std::find_if(
+        free_registers.begin(), free_registers.end(),
+        [&](std::string_view reg) {
+          const bool holds_constant =
+              std::any_of(constants.cached.begin(), constants.cached.end(),
+                          [&](const auto &x) { return x.second == reg; });
+          return !holds_constant && (!edx_clobbered || reg != "edx") &&
+                 (ty != boolean || !low_byte(reg).empty());
+        });
+    if (it == free_registers.end()) {
+      // Out of registers, spill the right operand to the stack.
+      std::visit(*this, *x.right);
+      ss << "push eax\n";
+      cost.charge("push");
+      std::visit(*this, *x.left);
+      emit_operator_code(ss, cost, x.op, ty,
+                         ty == boolean ? "byte [esp]" : "dword [esp]");
+      ss << "add esp,4\n";
+      cost.charge("add");
+      return;
+    }
+
+    const std::string_view reg = *it;
+    const std::vector<std::string_view> saved = free_registers;
+    free_registers.erase(it);
+    // Evaluate the operand needing more registers first.
+    if (register_need(*x.left) > register_need(*x.right)) {
+      std::visit(*this, *x.left);
+      ss << "mov " << reg << ",eax\n";
+      cost.charge("mov");
+      std::visit(*this, *x.right);
+      if (!is_commutative(x.op)) {
+        ss << "xchg eax," << reg << '\n';
+        cost.charge("xchg");
+      }
+    } else {
+      std::visit(*this, *x.right);
+      ss << "mov " << reg << ",eax\n";
+      cost.charge("mov");
+      std::visit(*this, *x.left);
+    }
+    free_registers = saved;
+    emit_operator_code(ss, cost, x.op, ty,
+                       ty == boolean ? low_byte(reg) : reg);
   }
   void operator()(const not_expression &x) const {
     std::visit(*this, *x.operand);
     ss << "xor al,1\n";
+    cost.charge("xor");
   }
 };
 
 class ir_to_asm : private expr_to_asm {
 public:
-  ir_to_asm(const symbols &syms, std::ostream &ss, bool encode_constants,
-            const basicblock &current_block)
-      : expr_to_asm{syms, ss, encode_constants, current_block} {}
+  ir_to_asm(const symbols &syms, std::ostream &ss, cycle_counter &cost,
+            block_constants &constants, const basicblock &current_block)
+      : expr_to_asm{syms, ss, cost, constants, current_block} {}
 
   using expr_to_asm::operator();
 
@@ -162,34 +493,49 @@ public:
     std::visit(*this, *x.right);
     const auto it = syms.find(x.left);
     assert(it != syms.end());
-    ss << "mov [var_" + it->second.name + "],"
+    ss << "mov " << variable_operand(it->second) << ','
        << get_register(it->second.symbol_type) << '\n';
+    cost.charge("mov", memory_access::store);
   }
   void operator()(const read_statement &x) const {
     const auto it = syms.find(x.id);
     assert(it != syms.end());
     const type ty = it->second.symbol_type;
     ss << "call read_" << get_type_name(ty) << '\n';
-    ss << "mov [var_" << it->second.name << "]," << get_register(ty) << '\n';
+    ss << "mov " << variable_operand(it->second) << ',' << get_register(ty)
+       << '\n';
+    cost.charge("call");
+    cost.charge("mov", memory_access::store);
   }
   void operator()(const write_statement &x) const {
     const type ty = infer_expression_type(syms, *x.value);
     std::visit(*this, *x.value);
     if (ty == boolean) {
       ss << "and eax,1\n";
+      cost.charge("and");
     }
     ss << "push eax\n";
     ss << "call write_" << get_type_name(ty) << '\n';
     ss << "add esp,4\n";
+    cost.charge("push");
+    cost.charge("call");
+    cost.charge("add");
   }
 
   void operator()(const cassign &x) const {
     std::visit(*this, *x.condition);
     ss << "cmp al,1\n";
     ss << "mov eax," << x.false_value << '\n';
-    ss << "mov ebx, " << x.true_value << '\n';
-    ss << "cmove eax, ebx\n";
-    ss << "mov [var_" << x.var.name << "], eax\n";
+    ss << "mov ecx, " << x.true_value << '\n';
+    ss << "cmove eax, ecx\n";
+    const auto it = syms.find(x.var.name);
+    assert(it != syms.end());
+    ss << "mov " << variable_operand(it->second) << ",eax\n";
+    cost.charge("cmp");
+    cost.charge("mov");
+    cost.charge("mov");
+    cost.charge("cmove");
+    cost.charge("mov", memory_access::store);
   }
 
   // Control-flow:
@@ -198,9 +544,13 @@ public:
     ss << "cmp al,1\n";
     ss << "je bb_" << x.true_branch.id << '\n';
     ss << "jmp bb_" << x.false_branch.id << '\n';
+    cost.charge("cmp");
+    cost.charge("je");
+    cost.charge("jmp");
   }
   void operator()(const jump &x) const {
     ss << "jmp bb_" << x.target.id << '\n';
+    cost.charge("jmp");
   }
   void operator()(const switcher &x) const {
     // Load var to eax.
@@ -211,97 +561,421 @@ public:
       ss << "mov ecx, " << target->id << '\n';
       ss << "cmp eax,ecx\n";
       ss << "je bb_" << target->id << '\n';
+      cost.charge("mov");
+      cost.charge("cmp");
+      cost.charge("je");
     }
   }
 };
 
-void emit_basicblock(std::ostream &ss, const cfg &cfg, const symbols &syms,
-                     const basicblock &bb, bool encode_constants) {
-  ir_to_asm emitter{syms, ss, encode_constants, bb};
+/// The line of the source the instruction comes from, if any.
+std::optional<int> source_line(const ir_instruction &inst) {
+  const auto line_of = [](const auto &x) -> std::optional<int> {
+    using T = std::decay_t<decltype(x)>;
+    if constexpr (std::is_same_v<T, id_expression> ||
+                  std::is_same_v<T, binop_expression> ||
+                  std::is_same_v<T, not_expression>)
+      return x.line;
+    else
+      return std::nullopt;
+  };
+  const std::optional<int> line = std::visit(
+      overloaded{[&](const selector &x) {
+                   return std::visit(line_of, *x.condition);
+                 },
+                 [&](const cassign &x) {
+                   return std::visit(line_of, *x.condition);
+                 },
+                 [](const assign_statement &x) -> std::optional<int> {
+                   return x.get_line();
+                 },
+                 [](const read_statement &x) -> std::optional<int> {
+                   return x.get_line();
+                 },
+                 [](const write_statement &x) -> std::optional<int> {
+                   return x.get_line();
+                 },
+                 [&](const auto &x) { return line_of(x); }},
+      inst);
+  // The instructions made up by the transformations are on line -1.
+  if (line.has_value() && *line <= 0)
+    return std::nullopt;
+  return line;
+}
+
+void emit_basicblock(std::ostream &ss, cycle_counter &cost,
+                     const symbols &syms, const basicblock &bb, bool entry,
+                     bool exit, constant_encoder *encoder,
+                     const std::optional<std::string> &source_name) {
+  block_constants constants{encoder};
+  ir_to_asm emitter{syms, ss, cost, constants, bb};
 
-  if (&bb == cfg.entry)
+  // The instructions following a %line directive are attributed to that
+  // line of the source, or to none if it is 0. The block might be placed
+  // anywhere, so it starts with its own.
+  int current_line = -1;
+  const auto attribute = [&](int line) {
+    if (!source_name.has_value() || line == current_line)
+      return;
+    ss << "%line " << line << "+0 " << *source_name << '\n';
+    current_line = line;
+  };
+  const auto first_line = std::find_if(
+      bb.instructions.begin(), bb.instructions.end(),
+      [](const ir_instruction &inst) { return source_line(inst).has_value(); });
+  attribute(first_line == bb.instructions.end() ? 0
+                                                : *source_line(*first_line));
+
+  if (entry) {
     ss << "; entry\nmain:\n";
-  else if (&bb == cfg.exit)
+    for (std::string_view reg : callee_saved_registers) {
+      ss << "push " << reg << '\n';
+      cost.charge("push");
+    }
+  } else if (exit) {
     ss << "; exit\n";
+  }
 
   ss << "bb_" << bb.id << ":\n";
 
-  for (const ir_instruction &inst : bb.instructions)
+  // Decode the recurring constants only once.
+  if (encoder != nullptr) {
+    std::vector<std::pair<unsigned, std::uint32_t>> recurring;
+    for (const auto &[value, count] : count_constants(bb))
+      if (count > 1)
+        recurring.emplace_back(count, value);
+    std::stable_sort(recurring.begin(), recurring.end(),
+                     [](const auto &lhs, const auto &rhs) {
+                       return lhs.first > rhs.first;
+                     });
+    for (std::size_t i = 0;
+         i < std::min(recurring.size(), constant_cache_registers.size()); ++i) {
+      const std::uint32_t value = recurring[i].second;
+      encoder->emit_decode(ss, cost, bb, value, constants.occurrences++,
+                           constant_cache_registers[i]);
+      constants.cached.emplace(value, constant_cache_registers[i]);
+    }
+  }
+
+  for (const ir_instruction &inst : bb.instructions) {
+    if (const std::optional<int> line = source_line(inst))
+      attribute(*line);
     std::visit(emitter, inst);
+  }
 
-  if (&bb == cfg.exit) {
+  if (exit) {
     ss << "xor eax,eax\n";
+    cost.charge("xor");
+    for (auto it = callee_saved_registers.rbegin();
+         it != callee_saved_registers.rend(); ++it) {
+      ss << "pop " << *it << '\n';
+      cost.charge("pop");
+    }
     ss << "ret\n";
+    cost.charge("ret");
+  }
+}
+
+/// The lines of an emitted block: its labels along with the prologue of the
+/// entry, then the instructions.
+struct block_lines {
+  std::vector<std::string> header;
+  std::vector<std::string> body;
+};
+
+block_lines split_lines(const emitted_block &emitted) {
+  std::stringstream label;
+  label << "bb_" << emitted.block->id << ':';
+  block_lines res;
+  std::vector<std::string> *current = &res.header;
+  std::istringstream is{emitted.code};
+  for (std::string line; std::getline(is, line);) {
+    current->push_back(line);
+    if (line == label.str())
+      current = &res.body;
   }
+  return res;
 }
 
-void recursively_emit_basicblock(std::vector<std::string> &out, const cfg &cfg,
-                                 const symbols &syms, const basicblock &bb,
-                                 std::set<bb_idx> &processed,
-                                 bool encode_constants) {
-  auto [_, succeeded] = processed.insert(bb.id);
-  if (!succeeded)
-    return;
+/// Only the plain blocks ending with an unconditional jump can share their
+/// code, since nothing may depend on what follows them in the text section.
+bool is_mergeable(const block_lines &lines) {
+  return lines.header.size() == 1 && !lines.body.empty() &&
+         lines.body.back().rfind("jmp ", 0) == 0;
+}
 
-  std::stringstream ss;
-  emit_basicblock(ss, cfg, syms, bb, encode_constants);
-  out.push_back(std::move(ss).str());
-
-  if (bb.instructions.empty())
-    return;
-
-  std::visit(
-      overloaded{[&](const auto &x) {},
-                 [&](const selector &x) {
-                   recursively_emit_basicblock(out, cfg, syms, x.true_branch,
-                                               processed, encode_constants);
-                   recursively_emit_basicblock(out, cfg, syms, x.false_branch,
-                                               processed, encode_constants);
-                 },
-                 [&](const jump &x) {
-                   recursively_emit_basicblock(out, cfg, syms, x.target,
-                                               processed, encode_constants);
-                 },
-                 [&](const switcher &x) {
-                   for (const basicblock *target : x.branches)
-                     recursively_emit_basicblock(out, cfg, syms, *target,
-                                                 processed, encode_constants);
-                 }},
-      bb.instructions.back());
+std::size_t common_suffix_length(const std::vector<std::string> &lhs,
+                                 const std::vector<std::string> &rhs) {
+  const auto [lhs_it, rhs_it] =
+      std::mismatch(lhs.rbegin(), lhs.rend(), rhs.rbegin(), rhs.rend());
+  return static_cast<std::size_t>(lhs_it - lhs.rbegin());
 }
 
+/// Folds each block into the first one with the same instructions by
+/// moving its label there, leaving it without code. Then replaces the longest
+/// instruction suffixes shared by the rest of the blocks with a jump into one
+/// of them. The shared code stays within the blocks, so they can still be
+/// placed in any order.
+void merge_tails(std::vector<emitted_block> &blocks, unsigned min_length) {
+  std::vector<block_lines> lines;
+  lines.reserve(blocks.size());
+  for (const emitted_block &emitted : blocks)
+    lines.push_back(split_lines(emitted));
+
+  // The block each one is folded into, or itself.
+  std::vector<std::size_t> folded_into(blocks.size());
+  std::map<std::vector<std::string>, std::size_t> first_with_body;
+  for (std::size_t i = 0; i < blocks.size(); ++i) {
+    folded_into[i] = i;
+    if (!is_mergeable(lines[i]))
+      continue;
+    const auto [it, inserted] = first_with_body.try_emplace(lines[i].body, i);
+    if (inserted)
+      continue;
+    lines[it->second].header.push_back(lines[i].header.back());
+    folded_into[i] = it->second;
+  }
+  const auto folded = [&](std::size_t i) { return folded_into[i] != i; };
+
+  // Sorting by the reversed instructions puts the blocks with the longest
+  // common suffixes next to each other.
+  std::vector<std::size_t> candidates;
+  for (std::size_t i = 0; i < blocks.size(); ++i)
+    if (!folded(i) && is_mergeable(lines[i]))
+      candidates.push_back(i);
+  std::sort(candidates.begin(), candidates.end(),
+            [&lines](std::size_t lhs, std::size_t rhs) {
+              const auto &l = lines[lhs].body;
+              const auto &r = lines[rhs].body;
+              return std::lexicographical_compare(l.rbegin(), l.rend(),
+                                                  r.rbegin(), r.rend());
+            });
+  std::vector<std::size_t> adjacent_suffixes;
+  for (std::size_t i = 1; i < candidates.size(); ++i)
+    adjacent_suffixes.push_back(common_suffix_length(
+        lines[candidates[i - 1]].body, lines[candidates[i]].body));
+
+  // The labels of the shared tails by their position in the block.
+  std::vector<std::map<std::size_t, std::string>> tails(blocks.size());
+  std::size_t tail_count = 0;
+  for (std::size_t run = 0; run < candidates.size();) {
+    const std::size_t keeper = candidates[run];
+    std::size_t shared = lines[keeper].body.size();
+    std::size_t next = run + 1;
+    for (; next < candidates.size(); ++next) {
+      shared = std::min(shared, adjacent_suffixes[next - 1]);
+      if (shared < min_length)
+        break;
+      const std::size_t position = lines[keeper].body.size() - shared;
+      const auto [it, inserted] = tails[keeper].try_emplace(position);
+      if (inserted)
+        it->second =
+            std::string{tail_label_prefix} + std::to_string(tail_count++);
+      std::vector<std::string> &body = lines[candidates[next]].body;
+      body.resize(body.size() - shared);
+      body.push_back("jmp " + it->second);
+      blocks[candidates[next]].cost.charge("jmp");
+    }
+    run = next;
+  }
+
+  for (std::size_t i = 0; i < blocks.size(); ++i) {
+    std::string code;
+    for (const std::string &line : lines[i].header)
+      code.append(line).push_back('\n');
+    for (std::size_t j = 0; j < lines[i].body.size(); ++j) {
+      if (const auto it = tails[i].find(j); it != tails[i].end())
+        code.append(it->second).append(":\n");
+      code.append(lines[i].body[j]).push_back('\n');
+    }
+    blocks[i].code = folded(i) ? std::string{} : std::move(code);
+  }
+  for (std::size_t i = 0; i < blocks.size(); ++i)
+    if (folded(i))
+      blocks[i].cost = blocks[folded_into[i]].cost;
+}
+
+/// Whether the line of an emitted block is an instruction, rather than a
+/// label, a comment or a directive.
+bool is_instruction(std::string_view line) {
+  return !line.empty() && line.back() != ':' && line.front() != ';' &&
+         line.front() != '%';
+}
+
+/// The labels a block starts with, before its first instruction.
+std::vector<std::string_view> leading_labels(std::string_view code) {
+  std::vector<std::string_view> res;
+  while (!code.empty()) {
+    const auto eol = code.find('\n');
+    const std::string_view line = code.substr(0, eol);
+    if (is_instruction(line))
+      break;
+    if (!line.empty() && line.back() == ':')
+      res.push_back(line.substr(0, line.size() - 1));
+    code = eol == std::string_view::npos ? "" : code.substr(eol + 1);
+  }
+  return res;
+}
+
+/// Drops the jump ending a block if its target is placed right after it, so
+/// that it falls through instead. The blocks folded into it save the jump as
+/// well.
+void elide_fallthrough_jumps(std::vector<emitted_block> &blocks) {
+  std::map<std::string, std::size_t, std::less<>> index_of_label;
+  for (std::size_t i = 0; i < blocks.size(); ++i)
+    index_of_label.emplace("bb_" + std::to_string(blocks[i].block->id), i);
+
+  emitted_block *previous = nullptr;
+  for (emitted_block &emitted : blocks) {
+    if (emitted.code.empty())
+      continue;
+    const std::vector<std::string_view> labels = leading_labels(emitted.code);
+    if (previous != nullptr) {
+      std::string &code = previous->code;
+      const auto last_line = code.rfind('\n', code.size() - 2) + 1;
+      const std::string_view jump =
+          std::string_view{code}.substr(last_line, code.size() - last_line - 1);
+      if (jump.starts_with("jmp ") &&
+          std::find(labels.begin(), labels.end(), jump.substr(4)) !=
+              labels.end()) {
+        for (std::string_view label : leading_labels(code))
+          if (const auto it = index_of_label.find(label);
+              it != index_of_label.end())
+            blocks[it->second].cost.refund("jmp");
+        code.resize(last_line);
+      }
+    }
+    previous = &emitted;
+  }
+}
+
+/// Without the graph the variables are only grouped by their width.
+std::vector<const symbol *> layout_by_width(const symbols &syms) {
+  std::vector<const symbol *> layout;
+  for (type ty : {natural, boolean})
+    for (const auto &[name, sym] : syms)
+      if (sym.symbol_type == ty)
+        layout.push_back(&sym);
+  return layout;
+}
+
+constexpr std::string_view asm_header = "global main\n"
+                                        "extern write_natural\n"
+                                        "extern read_natural\n"
+                                        "extern write_boolean\n"
+                                        "extern read_boolean\n\n";
 } // namespace
 
-std::string codegen(const cfg &cfg, const symbols &syms,
-                    std::optional<std::size_t> serialization_seed,
-                    bool encode_constants) {
-  std::stringstream ss;
-  ss << "global main\n"
-        "extern write_natural\n"
-        "extern read_natural\n"
-        "extern write_boolean\n"
-        "extern read_boolean\n\n"
-        "section .bss\n";
-  symbols_to_asm{ss}(syms);
+emitted_program emit_basicblocks(const cfg &cfg, const symbols &syms,
+                                 const block_frequencies &freqs,
+                                 const codegen_options &opts) {
+  std::optional<constant_encoder> encoder;
+  if (opts.constant_encoding.has_value())
+    encoder.emplace(opts.constant_encoding.value(), freqs);
 
-  ss << "\nsection .text\n";
-  std::set<bb_idx> processed;
-  std::vector<std::string> code_of_basicblocks;
-  recursively_emit_basicblock(code_of_basicblocks, cfg, syms, *cfg.entry,
-                              processed, encode_constants);
+  // The entry and the exit get the prologue and the epilogue of the program,
+  // unless it is a fragment.
+  std::vector<emitted_block> code_of_basicblocks;
+  for (const basicblock *bb : reachable_blocks(cfg)) {
+    std::stringstream ss;
+    cycle_counter cost;
+    emit_basicblock(ss, cost, syms, *bb, !opts.fragment && bb == cfg.entry,
+                    !opts.fragment && bb == cfg.exit,
+                    encoder ? &*encoder : nullptr, opts.source_name);
+    code_of_basicblocks.push_back(
+        emitted_block{bb, std::move(ss).str(), std::move(cost)});
+  }
+  if (opts.tail_merging.has_value())
+    merge_tails(code_of_basicblocks, opts.tail_merging.value());
 
-  if (serialization_seed.has_value()) {
-    if (serialization_seed.value() == -1) {
+  if (opts.serialization_seed.has_value()) {
+    if (opts.serialization_seed.value() == -1) {
       std::random_device rd;
       std::mt19937 gen(rd());
       std::shuffle(code_of_basicblocks.begin(), code_of_basicblocks.end(), gen);
     } else {
-      std::mt19937 gen(serialization_seed.value());
+      std::mt19937 gen(opts.serialization_seed.value());
       std::shuffle(code_of_basicblocks.begin(), code_of_basicblocks.end(), gen);
     }
   }
+  elide_fallthrough_jumps(code_of_basicblocks);
+  return emitted_program{std::move(code_of_basicblocks),
+                         encoder ? encoder->constant_pool()
+                                 : std::vector<std::uint32_t>{}};
+}
+
+std::string codegen(const cfg &cfg, const symbols &syms,
+                    const block_frequencies &freqs,
+                    const codegen_options &opts) {
+  emitted_program program = emit_basicblocks(cfg, syms, freqs, opts);
+
+  std::stringstream ss;
+  ss << asm_header << "section .bss\n";
+  symbols_to_asm{ss}(layout_variables(cfg, syms, freqs));
+
+  if (!program.constant_pool.empty()) {
+    ss << "\nsection .rodata\n";
+    ss << "const_pool:\n";
+    for (std::uint32_t encoded : program.constant_pool)
+      ss << "dd " << encoded << '\n';
+  }
+
+  ss << "\nsection .text\n";
+  for (emitted_block &emitted : program.blocks)
+    ss << std::move(emitted.code);
+  return ss.str();
+}
 
-  for (std::string &code : code_of_basicblocks)
-    ss << std::move(code);
+std::string program_prologue() {
+  std::stringstream ss;
+  ss << asm_header << "section .text\n; entry\nmain:\n";
+  for (std::string_view reg : callee_saved_registers)
+    ss << "push " << reg << '\n';
   return ss.str();
 }
+
+std::string program_epilogue(const symbols &syms) {
+  std::stringstream ss;
+  ss << "; exit\nxor eax,eax\n";
+  for (auto it = callee_saved_registers.rbegin();
+       it != callee_saved_registers.rend(); ++it)
+    ss << "pop " << *it << '\n';
+  ss << "ret\n\nsection .bss\n";
+  symbols_to_asm{ss}(layout_by_width(syms));
+  return ss.str();
+}
+
+streaming_codegen::streaming_codegen(std::ostream &os, const symbols &syms)
+    : os{os}, syms{syms} {
+  os << asm_header << "section .bss\n";
+  symbols_to_asm{os}(layout_by_width(syms));
+  os << "\nsection .text\n";
+}
+
+void write_symbol_map(
+    std::ostream &os, const cfg &graph,
+    const std::map<const basicblock *, bb_idx> &original_ids) {
+  os << "# label original-id source-lines\n";
+  for (const basicblock *bb : reachable_blocks(graph)) {
+    os << "bb_" << bb->id << ' ';
+    if (const auto it = original_ids.find(bb); it != original_ids.end())
+      os << it->second;
+    else
+      os << '-';
+    std::set<int> lines;
+    for (const ir_instruction &inst : bb->instructions)
+      if (const std::optional<int> line = source_line(inst))
+        lines.insert(*line);
+    const char *separator = " ";
+    for (int line : lines) {
+      os << separator << line;
+      separator = ",";
+    }
+    os << '\n';
+  }
+}
+
+void streaming_codegen::emit(const basicblock &bb, bool entry, bool exit) {
+  cycle_counter cost;
+  emit_basicblock(os, cost, syms, bb, entry, exit, nullptr, std::nullopt);
+}
@@ -2,14 +2,91 @@
 #define CODEGEN_H
 
 #include "cfg.h"
+#include "cfg_analysis.h"
+#include "constant_encoding.h"
+#include "cost_model.h"
 #include "expressions.h"
 #include "statements.h"
 
+#include <cstdint>
+#include <iosfwd>
+#include <map>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <vector>
+
+struct codegen_options {
+  /// Shuffle the basic blocks using this seed, -1 means random seed.
+  std::optional<std::size_t> serialization_seed;
+  /// Encode the constants following this policy, if set.
+  std::optional<constant_encoding_policy> constant_encoding;
+  /// Share the identical instruction sequences of at least this many
+  /// instructions ending the blocks, if set.
+  std::optional<unsigned> tail_merging;
+  /// Attribute the instructions to the lines of this source file with %line
+  /// directives, if set.
+  std::optional<std::string> source_name;
+  /// Emit the graph as a piece of a program, without the prologue in the
+  /// entry and the epilogue in the exit.
+  bool fragment = false;
+};
+
+/// Labels the instruction sequences shared by --merge-tails. They are defined
+/// within the code of a block, followed by the rest of it.
+constexpr std::string_view tail_label_prefix = "tail_";
+
+/// The assembly of a single basic block.
+struct emitted_block {
+  const basicblock *block;
+  std::string code;
+  /// The cycles of the instructions, charged as they were emitted. A block
+  /// folded into an identical one keeps the cycles of the code it runs.
+  cycle_counter cost;
+};
+
+struct emitted_program {
+  /// The blocks reachable from the entry in the order they should appear in
+  /// the text section. A block folded into an identical one has no code of
+  /// its own. A block jumping to the one placed right after it falls through
+  /// instead.
+  std::vector<emitted_block> blocks;
+  /// The encoded constants looked up from the read-only data.
+  std::vector<std::uint32_t> constant_pool;
+};
+
+emitted_program emit_basicblocks(const cfg &cfg, const symbols &syms,
+                                 const block_frequencies &freqs,
+                                 const codegen_options &opts);
 
 std::string codegen(const cfg &cfg, const symbols &syms,
-                    std::optional<std::size_t> serialization_seed,
-                    bool encode_constants);
+                    const block_frequencies &freqs,
+                    const codegen_options &opts);
+
+/// The code entering the program, followed by the pieces emitted with
+/// codegen_options::fragment, then by the code leaving the program along with
+/// the variables.
+std::string program_prologue();
+std::string program_epilogue(const symbols &syms);
+
+/// Writes a line for each block reachable in the graph: its label, its id
+/// before the remapping ('-' for the blocks created afterwards) and the lines
+/// of the source its instructions come from.
+void write_symbol_map(std::ostream &os, const cfg &graph,
+                      const std::map<const basicblock *, bb_idx> &original_ids);
+
+/// Writes the assembly of the blocks right as they are handed over, so the
+/// program never has to be held in memory as a whole. The variables are laid
+/// out without regard to their accesses and the constants are not encoded.
+class streaming_codegen {
+  std::ostream &os;
+  const symbols &syms;
+
+public:
+  /// Writes the declarations and the data section.
+  streaming_codegen(std::ostream &os, const symbols &syms);
+
+  void emit(const basicblock &bb, bool entry, bool exit);
+};
 
 #endif // CODEGEN_H
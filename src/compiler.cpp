@@ -0,0 +1,665 @@
+#include "compiler.h"
+#include "grammar.hpp"
+
+#include "ast_dumper.h"
+#include "ast_to_cfg.h"
+#include "batch_interpreter.h"
+#include "cfg_dumper.h"
+#include "cfg_optimizer.h"
+#include "cfg_serialization.h"
+#include "cost_model.h"
+#include "incremental.h"
+#include "jit.h"
+#include "lexer.h"
+#include "llvm_codegen.h"
+#include "partial_evaluator.h"
+#include "utility.h"
+#include "variants.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <utility>
+#include <variant>
+
+int yylex(yy::parser::semantic_type *yylval, yy::parser::location_type *yylloc,
+          lexer &lexer) {
+  const int token = lexer.next();
+  yylloc->begin.line = lexer.line();
+  yylloc->end.line = lexer.line();
+  if (token == yy::parser::token::ID)
+    yylval->build(lexer.text());
+  else if (token == yy::parser::token::NUM)
+    yylval->build(lexer.value());
+  return token;
+}
+
+void yy::parser::error(const location_type &loc, const std::string &msg) {
+  ::error(loc.begin.line, msg);
+}
+
+ast build_ast_from(std::string_view source) {
+  ast ast;
+  lexer lexer{source};
+  yy::parser parser{lexer, ast};
+  parser.parse();
+  return ast;
+}
+
+ast build_fragment_ast_from(std::string_view source, int first_line,
+                            symbols syms) {
+  ast ast;
+  ast.syms = std::move(syms);
+  lexer lexer{source, first_line, yy::parser::token::FRAGMENT};
+  yy::parser parser{lexer, ast};
+  parser.parse();
+  return ast;
+}
+
+ast build_ast_from_file(const std::string &path) {
+  const source_file file{path};
+  return build_ast_from(file.text());
+}
+
+void forget_removed_blocks(const cfg &graph, block_frequencies &freqs) {
+  block_frequencies kept;
+  for (const auto &bb : graph.blocks) {
+    const auto it = freqs.find(bb.get());
+    if (it != freqs.end())
+      kept.emplace(bb.get(), it->second);
+  }
+  freqs = std::move(kept);
+}
+
+namespace {
+/// Runs the passes on a program, keeping track of the analyses which still
+/// reflect its graph.
+class pass_manager {
+  lowered_program &program;
+  std::vector<pass_timing> timings;
+
+public:
+  explicit pass_manager(lowered_program &program) : program{program} {}
+
+  const loop_info &loops() {
+    if (program.loops_version != program.version) {
+      timed("loop analysis",
+            [&] { program.loops = loop_info{program.graph}; });
+      program.loops_version = program.version;
+    }
+    return program.loops;
+  }
+
+  block_frequencies &frequencies() {
+    if (program.freqs_version != program.version) {
+      const loop_info &l = loops();
+      timed("frequency estimation", [&] {
+        program.freqs =
+            estimate_block_frequencies(program.graph, l, current_profile());
+      });
+      program.freqs_version = program.version;
+    }
+    return program.freqs;
+  }
+
+  void run(pass_kind pass, const transformations &t) {
+    if (pass == pass_kind::simplify &&
+        program.simplified_version == program.version) {
+      timings.push_back(pass_timing{std::string{pass_name(pass)}, 0,
+                                    std::nullopt, /*skipped=*/true});
+      return;
+    }
+    // The analyses are timed on their own.
+    if (pass == pass_kind::unroll || pass == pass_kind::flatten) {
+      loops();
+      frequencies();
+    }
+
+    bool changed = false;
+    timed(std::string{pass_name(pass)}, [&] { changed = apply(pass, t); });
+    timings.back().changed = changed;
+    if (t.verify)
+      verify_cfg(program.syms, program.graph, pass_name(pass));
+  }
+
+  std::vector<pass_timing> finish() && { return std::move(timings); }
+
+private:
+  template <typename F> void timed(std::string name, F f) {
+    const auto start = std::chrono::steady_clock::now();
+    f();
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    timings.push_back(pass_timing{std::move(name), elapsed.count()});
+  }
+
+  /// The profile keyed by the current ids of the blocks.
+  block_profile current_profile() const {
+    if (program.original_ids.empty())
+      return program.profile;
+    block_profile res;
+    for (const auto &bb : program.graph.blocks) {
+      const auto original = program.original_ids.find(bb.get());
+      if (original == program.original_ids.end())
+        continue;
+      if (const auto it = program.profile.find(original->second);
+          it != program.profile.end())
+        res.emplace(bb->id, it->second);
+    }
+    return res;
+  }
+
+  /// Marks the control flow changed. The frequencies are kept if the pass
+  /// updated them.
+  void changed_control_flow(bool updated_freqs) {
+    const bool freqs_current = program.freqs_version == program.version;
+    ++program.version;
+    if (updated_freqs && freqs_current)
+      program.freqs_version = program.version;
+  }
+
+  bool apply(pass_kind pass, const transformations &t) {
+    switch (pass) {
+    case pass_kind::simplify: {
+      const bool changed = ::simplify_cfg(program.graph);
+      if (changed) {
+        // The merged blocks keep the frequency of the first one.
+        if (program.freqs_version == program.version)
+          forget_removed_blocks(program.graph, program.freqs);
+        changed_control_flow(/*updated_freqs=*/true);
+      }
+      program.simplified_version = program.version;
+      return changed;
+    }
+    case pass_kind::partial_eval: {
+      const bool changed = partially_evaluate(program.syms, program.graph,
+                                              t.partial_eval_fuel);
+      if (changed)
+        changed_control_flow(/*updated_freqs=*/false);
+      return changed;
+    }
+    case pass_kind::unroll: {
+      const bool changed =
+          unroll_loops(program.syms, program.graph, t.unrolling.value(),
+                       loops(), program.freqs);
+      if (changed)
+        changed_control_flow(/*updated_freqs=*/true);
+      return changed;
+    }
+    case pass_kind::remap: {
+      // Only the ids change, the analyses refer to the blocks themselves.
+      for (const auto &bb : program.graph.blocks)
+        program.original_ids.emplace(bb.get(), bb->id);
+      std::map<bb_idx, bb_idx> new_ids;
+      if (t.remap_bb_ids_seed.value() == -1) {
+        std::random_device rd;
+        std::mt19937 gen(rd());
+        new_ids = remap_block_ids(program.graph, gen);
+      } else {
+        std::mt19937 gen(t.remap_bb_ids_seed.value());
+        new_ids = remap_block_ids(program.graph, gen);
+      }
+      // The dispatchers of a preceding flattening select the blocks by their
+      // ids.
+      remap_dispatch_ids(program.graph, new_ids);
+      return true;
+    }
+    case pass_kind::flatten:
+      flatten(program.syms, program.graph, t.flattening.value(), loops(),
+              program.freqs);
+      changed_control_flow(/*updated_freqs=*/true);
+      return true;
+    case pass_kind::cse:
+      // Rewrites the instructions within the blocks only.
+      return ::eliminate_common_subexpressions(program.syms, program.graph);
+    }
+    unreachable();
+  }
+};
+} // namespace
+
+const std::vector<pass_kind> default_pass_order = {
+    pass_kind::simplify, pass_kind::partial_eval, pass_kind::simplify,
+    pass_kind::unroll,   pass_kind::simplify,     pass_kind::remap,
+    pass_kind::flatten,  pass_kind::cse};
+
+void set_optimization_level(transformations &t, unsigned level) {
+  t.simplify_cfg = level >= 1;
+  t.eliminate_common_subexpressions = level >= 1;
+  t.partial_eval_fuel = level >= 2 ? transformations{}.partial_eval_fuel : 0;
+}
+
+std::vector<pass_kind> pipeline(const transformations &t) {
+  const auto enabled = [&t](pass_kind pass) {
+    switch (pass) {
+    case pass_kind::simplify:
+      return t.simplify_cfg;
+    case pass_kind::partial_eval:
+      return t.partial_eval_fuel != 0;
+    case pass_kind::unroll:
+      return t.unrolling.has_value();
+    case pass_kind::remap:
+      return t.remap_bb_ids_seed.has_value();
+    case pass_kind::flatten:
+      return t.flattening.has_value();
+    case pass_kind::cse:
+      return t.eliminate_common_subexpressions;
+    }
+    unreachable();
+  };
+  std::vector<pass_kind> res;
+  for (pass_kind pass : t.passes.value_or(default_pass_order))
+    if (enabled(pass))
+      res.push_back(pass);
+  return res;
+}
+
+lowered_program lower(ast code, const block_profile &profile) {
+  return lowered_program{std::move(code.syms),
+                         ast_to_cfg(std::move(code.stmts)), profile};
+}
+
+lowered_program clone(const lowered_program &program) {
+  lowered_program res{program.syms, clone(program.graph), program.profile};
+  // The blocks of the copy are in the same order.
+  std::map<const basicblock *, const basicblock *> copies;
+  for (std::size_t i = 0; i < program.graph.blocks.size(); ++i)
+    copies.emplace(program.graph.blocks[i].get(), res.graph.blocks[i].get());
+  for (const auto &[bb, freq] : program.freqs)
+    if (const auto it = copies.find(bb); it != copies.end())
+      res.freqs.emplace(it->second, freq);
+  for (const auto &[bb, id] : program.original_ids)
+    if (const auto it = copies.find(bb); it != copies.end())
+      res.original_ids.emplace(it->second, id);
+  res.version = program.version;
+  res.freqs_version = program.freqs_version;
+  res.simplified_version = program.simplified_version;
+  return res;
+}
+
+std::vector<pass_timing> run_passes(lowered_program &program,
+                                    const std::vector<pass_kind> &passes,
+                                    const transformations &t) {
+  pass_manager manager{program};
+  for (pass_kind pass : passes)
+    manager.run(pass, t);
+  return std::move(manager).finish();
+}
+
+std::vector<pass_timing> finish_passes(lowered_program &program) {
+  pass_manager manager{program};
+  manager.frequencies();
+  if (!program.loops_version.has_value())
+    manager.loops();
+  if (program.original_ids.empty())
+    for (const auto &bb : program.graph.blocks)
+      program.original_ids.emplace(bb.get(), bb->id);
+  return std::move(manager).finish();
+}
+
+std::vector<pass_timing> transform(lowered_program &program,
+                                   const transformations &t) {
+  std::vector<pass_timing> timings = run_passes(program, pipeline(t), t);
+  for (pass_timing &timing : finish_passes(program))
+    timings.push_back(std::move(timing));
+  return timings;
+}
+
+emitted_program emit(const lowered_program &program,
+                     const transformations &t) {
+  return emit_basicblocks(program.graph, program.syms, program.freqs,
+                          t.codegen);
+}
+
+namespace {
+/// Compiles the source to assembly one top-level statement at a time, never
+/// holding more than one of them in memory. The file the source is mapped
+/// from, if any, is released up to the statements already compiled.
+void compile_streaming(std::string_view source, source_file *file,
+                       std::ostream &os) {
+  lexer lexer{source};
+  ast ast;
+  std::optional<streaming_codegen> codegen;
+  std::optional<streaming_ast_to_cfg> lowering;
+  // Every symbol is declared before the first statement.
+  const auto start = [&] {
+    if (lowering.has_value())
+      return;
+    codegen.emplace(os, ast.syms);
+    lowering.emplace([&](const basicblock &bb, bool entry, bool exit) {
+      codegen->emit(bb, entry, exit);
+    });
+  };
+  ast.statement_sink = [&](statement x) {
+    start();
+    lowering->lower(std::move(x));
+    // The lookahead token might still refer to the source.
+    if (file != nullptr)
+      file->release_before(lexer.position());
+  };
+
+  yy::parser parser{lexer, ast};
+  parser.parse();
+  start();
+  lowering->finish();
+}
+
+/// Compiles the source into the file, then polls the source and compiles the
+/// statements affected by each change, rewriting the file from the first
+/// changed byte on. A broken version is reported to the log and the file is
+/// left as it was. Throws a compile_error once the file can not be written.
+[[noreturn]] void watch(const std::string &src, const std::string &out,
+                        const transformations &t, std::ostream &log) {
+  incremental_compiler compiler{t};
+  std::filesystem::file_time_type compiled_version;
+  for (;; std::this_thread::sleep_for(std::chrono::milliseconds{50})) {
+    std::error_code ec;
+    const auto version = std::filesystem::last_write_time(src, ec);
+    if (ec || version == compiled_version)
+      continue;
+    compiled_version = version;
+
+    const auto start = std::chrono::steady_clock::now();
+    std::ifstream is(src, std::ios::binary);
+    std::string text{std::istreambuf_iterator<char>{is}, {}};
+    incremental_update res;
+    try {
+      res = compiler.update(std::move(text));
+    } catch (const compile_error &e) {
+      print_diagnostics(log, {diagnostic{e.line, e.what()}});
+      continue;
+    }
+
+    // The file holds the previous assembly, unless it was removed since.
+    const std::uintmax_t previous_size = std::filesystem::file_size(out, ec);
+    bool written;
+    if (res.rebuilt || ec) {
+      std::ofstream os(out, std::ios::binary | std::ios::trunc);
+      compiler.write(os);
+      written = static_cast<bool>(os);
+    } else {
+      // The rest of the file only has to move if the size changed.
+      const std::size_t end = previous_size == compiler.size()
+                                  ? res.changed_end
+                                  : compiler.size();
+      std::fstream os(out, std::ios::binary | std::ios::in | std::ios::out);
+      os.seekp(static_cast<std::streamoff>(res.first_changed_byte));
+      compiler.write(os, res.first_changed_byte, end);
+      os.close();
+      std::filesystem::resize_file(out, compiler.size(), ec);
+      written = os && !ec;
+    }
+    if (!written)
+      error(-1, "Failed to write " + out + ".");
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    log << (res.rebuilt ? "Compiled " : "Recompiled ")
+        << res.recompiled_groups << " statement group(s) in "
+        << elapsed.count() << " ms.\n";
+  }
+}
+
+/// Enables the passes, and only those, in their order. The unrolling and the
+/// flattening run with the default policies unless the transformations set
+/// them. Throws a compile_error if the transformations set a pass not
+/// selected.
+void select_passes(const std::vector<pass_kind> &passes, transformations &t) {
+  const auto uses = [&passes](pass_kind pass) {
+    return std::find(passes.begin(), passes.end(), pass) != passes.end();
+  };
+  if (uses(pass_kind::remap) != t.remap_bb_ids_seed.has_value())
+    error(-1, "The remap pass needs a seed from --remap-basic-block-ids, and "
+              "the seed needs the remap pass.");
+  if (!uses(pass_kind::unroll) && t.unrolling.has_value())
+    error(-1, "--unroll-loops needs the unroll pass.");
+  if (!uses(pass_kind::flatten) && t.flattening.has_value())
+    error(-1, "--flatten-cfg needs the flatten pass.");
+
+  t.passes = passes;
+  t.simplify_cfg = uses(pass_kind::simplify);
+  t.eliminate_common_subexpressions = uses(pass_kind::cse);
+  if (!uses(pass_kind::partial_eval))
+    t.partial_eval_fuel = 0;
+  if (uses(pass_kind::unroll) && !t.unrolling.has_value())
+    t.unrolling = unroll_policy{};
+  if (uses(pass_kind::flatten) && !t.flattening.has_value())
+    t.flattening = flatten_policy{};
+}
+
+/// The transformations of the options, with the selected passes.
+transformations enabled_transformations(const compile_options &opts) {
+  transformations t = opts.transforms;
+  if (opts.selected_passes.has_value())
+    select_passes(*opts.selected_passes, t);
+  return t;
+}
+
+lowered_program lower_source(ast code, const compile_options &opts,
+                             std::ostream &log) {
+  if (opts.dump_ast)
+    ast_dumper{log}(code);
+  return lower(std::move(code), opts.profile);
+}
+
+/// Reports the estimated cost of the program, then the cost of enabling the
+/// transformations one by one on copies of the pristine program, which only
+/// went through the shared passes. Throws a compile_error if the overhead
+/// exceeds the budget.
+void report_cost(const lowered_program &program,
+                 const lowered_program &pristine, std::size_t shared,
+                 const transformations &enabled,
+                 std::optional<double> max_overhead, std::ostream &log) {
+  print_cost_report(log,
+                    estimate_cost(emit(program, enabled).blocks,
+                                  program.freqs),
+                    program.freqs, program.loops);
+
+  std::vector<std::pair<std::string, double>> steps;
+  transformations step;
+  step.simplify_cfg = enabled.simplify_cfg;
+  step.partial_eval_fuel = enabled.partial_eval_fuel;
+  step.eliminate_common_subexpressions =
+      enabled.eliminate_common_subexpressions;
+  step.passes = enabled.passes;
+  const auto measure = [&](std::string name) {
+    const lowered_program copy = transform_copy(pristine, step, shared);
+    steps.emplace_back(
+        std::move(name),
+        estimate_cost(emit(copy, step).blocks, copy.freqs).total_cycles);
+  };
+  measure("plain");
+  if (enabled.unrolling.has_value()) {
+    step.unrolling = enabled.unrolling;
+    measure("+ unroll loops");
+  }
+  if (enabled.remap_bb_ids_seed.has_value()) {
+    step.remap_bb_ids_seed = enabled.remap_bb_ids_seed;
+    measure("+ remap basic block ids");
+  }
+  if (enabled.flattening.has_value()) {
+    step.flattening = enabled.flattening;
+    measure("+ flatten cfg");
+  }
+  if (enabled.codegen.constant_encoding.has_value()) {
+    step.codegen.constant_encoding = enabled.codegen.constant_encoding;
+    measure("+ encode constants");
+  }
+  if (enabled.codegen.serialization_seed.has_value()) {
+    step.codegen.serialization_seed = enabled.codegen.serialization_seed;
+    measure("+ shuffle serialization");
+  }
+  if (enabled.codegen.tail_merging.has_value()) {
+    step.codegen.tail_merging = enabled.codegen.tail_merging;
+    measure("+ merge tails");
+  }
+  print_cost_deltas(log, steps);
+
+  const double overhead =
+      (steps.back().second - steps.front().second) / steps.front().second;
+  if (max_overhead.has_value() && overhead * 100 > *max_overhead) {
+    std::stringstream ss;
+    ss << "The estimated overhead exceeds the " << *max_overhead
+       << "% budget.";
+    error(-1, ss.str());
+  }
+}
+
+/// Runs the action of the options on the program, apart from the streaming
+/// and the watching, which do not lower the whole program at once. The
+/// variants are named after the stem.
+void run_action(lowered_program program, const compile_options &opts,
+                const transformations &enabled, const std::string &stem,
+                std::ostream &out, std::ostream &log, std::istream &in,
+                compile_result &res) {
+  switch (opts.action) {
+  case compile_action::variants:
+    res.diagnostics = emit_variants(std::move(program), enabled, opts.count,
+                                    opts.seed_base, opts.output_dir, stem);
+    return;
+  case compile_action::autotune:
+    autotune(std::move(program), enabled, opts.count, opts.seed_base,
+             opts.tuning_input, out, log);
+    return;
+  case compile_action::batch: {
+    // Only the optimizations apply.
+    transformations optimizations;
+    optimizations.simplify_cfg = enabled.simplify_cfg;
+    optimizations.partial_eval_fuel = enabled.partial_eval_fuel;
+    optimizations.eliminate_common_subexpressions = false;
+    optimizations.passes = enabled.passes;
+    optimizations.verify = enabled.verify;
+    const std::vector<pass_timing> timings =
+        run_passes(program, pipeline(optimizations), optimizations);
+    if (opts.time_passes)
+      print_pass_timings(log, timings);
+    run_batch(program.syms, program.graph, in, out);
+    return;
+  }
+  default:
+    break;
+  }
+
+  // Keep the optimized but untransformed graph around to measure the
+  // transformations.
+  const std::vector<pass_kind> passes = pipeline(enabled);
+  std::vector<pass_timing> timings;
+  std::optional<lowered_program> pristine;
+  std::size_t shared = 0;
+  if (opts.estimate_cost) {
+    shared = shared_passes(enabled);
+    timings =
+        run_passes(program, {passes.begin(), passes.begin() + shared}, enabled);
+    pristine = clone(program);
+  }
+  for (pass_timing &timing :
+       run_passes(program, {passes.begin() + shared, passes.end()}, enabled))
+    timings.push_back(std::move(timing));
+  for (pass_timing &timing : finish_passes(program))
+    timings.push_back(std::move(timing));
+  if (opts.time_passes)
+    print_pass_timings(log, timings);
+
+  if (opts.dump_cfg_dot)
+    dot_cfg_dumper{log}(program.graph);
+  if (opts.dump_cfg_text)
+    text_cfg_dumper{log}(program.graph);
+
+  if (opts.cfg_file.has_value()) {
+    std::ofstream os(*opts.cfg_file, std::ios::binary);
+    write_cfg(os, program.syms, program.graph);
+    if (!os)
+      error(-1, "Failed to write " + *opts.cfg_file + ".");
+  }
+  if (opts.symbol_map_file.has_value()) {
+    std::ofstream os(*opts.symbol_map_file);
+    write_symbol_map(os, program.graph, program.original_ids);
+    if (!os)
+      error(-1, "Failed to write " + *opts.symbol_map_file + ".");
+  }
+
+  if (opts.action == compile_action::emit) {
+    if (opts.format == output_format::llvm)
+      out << llvm_codegen(program.graph, program.syms);
+    else
+      out << codegen(program.graph, program.syms, program.freqs,
+                     enabled.codegen);
+  } else if (opts.action == compile_action::jit) {
+    const jit_program jitted{codegen(program.graph, program.syms,
+                                     program.freqs, enabled.codegen)};
+    out.flush();
+    // A trap of the program must not end the caller.
+    res.exit_code = jitted.run_in_child();
+  }
+
+  if (opts.estimate_cost)
+    report_cost(program, *pristine, shared, enabled, opts.max_overhead, log);
+}
+
+/// Runs the compilation, turning the error ending it into a diagnostic.
+template <typename F> compile_result diagnose(F f) {
+  compile_result res;
+  try {
+    f(res);
+  } catch (const compile_error &e) {
+    res.diagnostics.push_back(diagnostic{e.line, e.what()});
+  }
+  return res;
+}
+} // namespace
+
+compile_result compile(std::string_view source, const compile_options &opts) {
+  std::ostringstream out;
+  std::ostringstream log;
+  std::istringstream in;
+  compile_result res = diagnose([&](compile_result &result) {
+    if (opts.from_cfg || opts.action == compile_action::watch)
+      error(-1, "Reading a graph and watching the source need a file.");
+    const transformations enabled = enabled_transformations(opts);
+    if (opts.action == compile_action::stream)
+      compile_streaming(source, nullptr, out);
+    else
+      run_action(lower_source(build_ast_from(source), opts, log), opts,
+                 enabled, "program", out, log, in, result);
+  });
+  if (res.succeeded())
+    res.output = std::move(out).str();
+  res.log = std::move(log).str();
+  return res;
+}
+
+compile_result compile_file(const std::string &path,
+                            const compile_options &opts, std::ostream &out,
+                            std::ostream &log, std::istream &in) {
+  return diagnose([&](compile_result &res) {
+    const transformations enabled = enabled_transformations(opts);
+    const std::string stem = std::filesystem::path(path).stem().string();
+    if (opts.action == compile_action::watch) {
+      watch(path, opts.watch_output, enabled, log);
+    } else if (opts.action == compile_action::stream) {
+      source_file file{path};
+      compile_streaming(file.text(), &file, out);
+    } else if (opts.from_cfg) {
+      deserialized_cfg loaded = load_cfg(path);
+      run_action(lowered_program{std::move(loaded.syms),
+                                 std::move(loaded.graph), opts.profile},
+                 opts, enabled, stem, out, log, in, res);
+    } else {
+      run_action(lower_source(build_ast_from_file(path), opts, log), opts,
+                 enabled, stem, out, log, in, res);
+    }
+  });
+}
+
+void print_diagnostics(std::ostream &os,
+                       const std::vector<diagnostic> &diagnostics) {
+  for (const diagnostic &d : diagnostics) {
+    if (d.line >= 0)
+      os << "Line " << d.line << ": ";
+    os << "Error: " << d.message << '\n';
+  }
+}
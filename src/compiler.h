@@ -0,0 +1,220 @@
+#ifndef COMPILER_H
+#define COMPILER_H
+
+#include "cfg.h"
+#include "cfg_analysis.h"
+#include "cfg_transformer.h"
+#include "codegen.h"
+#include "expressions.h"
+#include "loop_unrolling.h"
+#include "passes.h"
+#include "statements.h"
+
+#include <cstddef>
+#include <iosfwd>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// The transformations applied on top of the plain translation.
+struct transformations {
+  std::optional<std::size_t> remap_bb_ids_seed;
+  std::optional<unroll_policy> unrolling;
+  std::optional<flatten_policy> flattening;
+  bool simplify_cfg = true;
+  bool eliminate_common_subexpressions = true;
+  /// Instructions executed at compile time to evaluate the input-independent
+  /// prefix of the program, 0 disables it.
+  std::size_t partial_eval_fuel = 10000;
+  /// The order of the passes, instead of default_pass_order. Each of them
+  /// runs only if the options above enable it.
+  std::optional<std::vector<pass_kind>> passes;
+  /// Checks the graph after each pass.
+  bool verify = false;
+  codegen_options codegen;
+};
+
+/// simplify, peval, simplify, unroll, simplify, remap, flatten, cse
+extern const std::vector<pass_kind> default_pass_order;
+
+/// Sets the options of the -O presets: 0 disables the simplification, the
+/// partial evaluation and the common subexpression elimination, 1 only the
+/// partial evaluation, and 2 enables all of them.
+void set_optimization_level(transformations &t, unsigned level);
+
+/// The passes the transformations enable, in order.
+std::vector<pass_kind> pipeline(const transformations &t);
+
+/// The control-flow graph of a program along with its analyses. The passes
+/// compute the analyses when they need them, and keep them as long as they
+/// reflect the graph.
+struct lowered_program {
+  symbols syms;
+  cfg graph;
+  /// Execution counts of the blocks, keyed by their ids before remapping.
+  block_profile profile;
+  /// The loops as of their last analysis. The passes run since then, like
+  /// the flattening, may have dissolved some of them.
+  loop_info loops;
+  block_frequencies freqs;
+  /// The ids of the blocks before they were remapped.
+  std::map<const basicblock *, bb_idx> original_ids;
+  /// Counts the changes of the control flow. Each analysis records the
+  /// version it reflects, if it was computed at all.
+  std::size_t version = 0;
+  std::optional<std::size_t> loops_version;
+  std::optional<std::size_t> freqs_version;
+  /// The version simplify_cfg left the graph at.
+  std::optional<std::size_t> simplified_version;
+};
+
+/// Parses and type checks the source text.
+ast build_ast_from(std::string_view source);
+
+/// Parses and type checks the source in the file at the path.
+ast build_ast_from_file(const std::string &path);
+
+/// Parses and type checks a sequence of statements beginning on the given
+/// line of a source declaring the symbols.
+ast build_fragment_ast_from(std::string_view source, int first_line,
+                            symbols syms);
+
+/// Drops the frequencies of the blocks no longer in the graph.
+void forget_removed_blocks(const cfg &graph, block_frequencies &freqs);
+
+/// Translates the syntax tree into a control-flow graph, without running any
+/// pass on it.
+lowered_program lower(ast code, const block_profile &profile);
+
+/// Deep copies the program along with its frequencies. The loops are
+/// analyzed again when needed.
+lowered_program clone(const lowered_program &program);
+
+/// Runs the passes in order. The analyses are computed when a pass needs
+/// them, and kept until a pass changes the control flow without updating
+/// them. The simplification is skipped if the graph did not change since it
+/// last ran. Returns the time spent in each pass and analysis.
+std::vector<pass_timing> run_passes(lowered_program &program,
+                                    const std::vector<pass_kind> &passes,
+                                    const transformations &t);
+
+/// Brings the analyses used by the code generation and the cost model up to
+/// date, and records the ids of the blocks if they were not remapped.
+std::vector<pass_timing> finish_passes(lowered_program &program);
+
+/// Runs the pipeline of the transformations, then finishes the analyses.
+std::vector<pass_timing> transform(lowered_program &program,
+                                   const transformations &t);
+
+emitted_program emit(const lowered_program &program,
+                     const transformations &t);
+
+enum class output_format { assembly, llvm };
+
+/// What the compilation does with the program.
+enum class compile_action {
+  /// Writes the assembly or the LLVM IR to the output.
+  emit,
+  /// Assembles the code in memory and runs it in a child process, on the
+  /// standard streams of this one. A signal ending it is a diagnostic.
+  jit,
+  /// Runs the program for every line of the input as a separate record. Only
+  /// the optimizations apply.
+  batch,
+  /// Writes a variant for each seed of [seed_base, seed_base + count) into
+  /// the output directory.
+  variants,
+  /// Writes the assembly of the fastest of count candidate settings.
+  autotune,
+  /// Writes the assembly one top-level statement at a time, without any
+  /// transformation, holding a single statement in memory.
+  stream,
+  /// Writes the assembly into the watch output, then keeps recompiling the
+  /// statements touched by each change of the source file, until the file can
+  /// not be written. The partial evaluation is not applied.
+  watch,
+  /// Only the dumps, the reports and the files requested by the options.
+  none
+};
+
+struct compile_options {
+  transformations transforms;
+  /// Enables these passes, and only these, in this order, instead of the
+  /// switches of the transforms. The unrolling and the flattening take the
+  /// default policies unless the transforms set them, and the remapping needs
+  /// the seed of the transforms.
+  std::optional<std::vector<pass_kind>> selected_passes;
+  /// Execution counts of the blocks, used instead of the estimation.
+  block_profile profile;
+  output_format format = output_format::assembly;
+  compile_action action = compile_action::emit;
+  /// Reads a control-flow graph written by write_cfg instead of a source.
+  bool from_cfg = false;
+
+  /// Written to the log.
+  bool dump_ast = false;
+  bool dump_cfg_text = false;
+  bool dump_cfg_dot = false;
+  bool time_passes = false;
+  /// Reports the estimated cycles of the program and the overhead of each
+  /// enabled transformation to the log.
+  bool estimate_cost = false;
+  /// Fails if the estimated overhead exceeds this percentage.
+  std::optional<double> max_overhead;
+
+  /// Receives the transformed graph in the format of write_cfg.
+  std::optional<std::string> cfg_file;
+  /// Receives the label, the original id and the source lines of each block.
+  std::optional<std::string> symbol_map_file;
+
+  /// The number of variants or autotuning candidates, and the seed of the
+  /// first one.
+  std::size_t count = 1;
+  std::size_t seed_base = 0;
+  /// The directory receiving the variants.
+  std::string output_dir;
+  /// The file the autotuning candidates run on to time them, instead of being
+  /// scored by the cost model.
+  std::optional<std::string> tuning_input;
+  /// The file the watch action keeps the assembly in.
+  std::string watch_output;
+};
+
+struct diagnostic {
+  /// The line of the source, or -1 if the problem is not tied to one.
+  int line;
+  std::string message;
+};
+
+struct compile_result {
+  /// The output of compile, empty if the compilation failed.
+  std::string output;
+  /// The dumps and the reports written by compile.
+  std::string log;
+  std::vector<diagnostic> diagnostics;
+  /// The exit code of the jitted program.
+  int exit_code = 0;
+
+  bool succeeded() const noexcept { return diagnostics.empty(); }
+};
+
+/// Compiles the source of a program. The errors are returned as diagnostics
+/// instead of ending the process, and the batch reads an empty input. The
+/// watch action and reading a graph need compile_file. Nothing is shared
+/// between the calls, so any number of them may run concurrently.
+compile_result compile(std::string_view source, const compile_options &opts);
+
+/// Compiles the source, or the graph, in the file, writing the output to
+/// out, the dumps and the reports to log, and reading the records of the
+/// batch from in. The output of the result is left empty.
+compile_result compile_file(const std::string &path,
+                            const compile_options &opts, std::ostream &out,
+                            std::ostream &log, std::istream &in);
+
+/// Writes each diagnostic on a line of its own, preceded by its line.
+void print_diagnostics(std::ostream &os,
+                       const std::vector<diagnostic> &diagnostics);
+
+#endif // COMPILER_H
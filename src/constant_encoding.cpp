@@ -0,0 +1,113 @@
+#include "constant_encoding.h"
+#include "cost_model.h"
+#include "utility.h"
+
+#include <array>
+#include <iostream>
+#include <utility>
+
+namespace {
+// Estimated decoding cycles of the schemes, the strongest first.
+constexpr std::array<std::pair<constant_encoding_scheme, double>, 3>
+    scheme_costs{{{constant_encoding_scheme::table_lookup, 6},
+                  {constant_encoding_scheme::mul_inverse, 4},
+                  {constant_encoding_scheme::xor_key, 2}}};
+
+std::uint32_t derive_key(bb_idx block, std::uint32_t value,
+                         unsigned occurrence) {
+  // The finalizer of splitmix64.
+  std::uint64_t x = block * 0x9e3779b97f4a7c15ull + value;
+  x ^= static_cast<std::uint64_t>(occurrence) << 32;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return static_cast<std::uint32_t>(x ^ (x >> 31));
+}
+
+std::uint32_t multiplicative_inverse(std::uint32_t odd) {
+  // Each Newton iteration doubles the number of correct low bits.
+  std::uint32_t inverse = odd;
+  for (int i = 0; i < 5; ++i)
+    inverse *= 2 - odd * inverse;
+  return inverse;
+}
+} // namespace
+
+std::optional<constant_encoding_policy>
+parse_constant_encoding_policy(std::string_view spec) {
+  constant_encoding_policy policy;
+  if (spec == "auto")
+    return policy;
+  if (spec == "xor")
+    policy.fixed_scheme = constant_encoding_scheme::xor_key;
+  else if (spec == "add")
+    policy.fixed_scheme = constant_encoding_scheme::add_key;
+  else if (spec == "mul")
+    policy.fixed_scheme = constant_encoding_scheme::mul_inverse;
+  else if (spec == "table")
+    policy.fixed_scheme = constant_encoding_scheme::table_lookup;
+  else
+    return std::nullopt;
+  return policy;
+}
+
+constant_encoding_scheme
+constant_encoder::select_scheme(const basicblock &bb, std::uint32_t key) const {
+  if (policy.fixed_scheme.has_value())
+    return policy.fixed_scheme.value();
+
+  const auto it = freqs.find(&bb);
+  const double frequency = it == freqs.end() ? 1 : it->second;
+  for (const auto &[scheme, cost] : scheme_costs) {
+    if (cost * frequency <= policy.budget)
+      return scheme;
+  }
+
+  // Alternate the cheapest schemes to keep the hot code diverse.
+  return key & 1 ? constant_encoding_scheme::xor_key
+                 : constant_encoding_scheme::add_key;
+}
+
+void constant_encoder::emit_decode(std::ostream &ss, cycle_counter &cost,
+                                   const basicblock &bb, std::uint32_t value,
+                                   unsigned occurrence, std::string_view reg) {
+  const std::uint32_t key = derive_key(bb.id, value, occurrence);
+
+  switch (select_scheme(bb, key)) {
+  case constant_encoding_scheme::xor_key:
+    ss << "mov " << reg << ", " << (value ^ key) << '\n';
+    ss << "xor " << reg << ", " << key;
+    cost.charge("mov");
+    cost.charge("xor");
+    break;
+  case constant_encoding_scheme::add_key:
+    if (key & 2) {
+      ss << "mov " << reg << ", " << std::uint32_t(value - key) << '\n';
+      ss << "add " << reg << ", " << key;
+      cost.charge("mov");
+      cost.charge("add");
+    } else {
+      ss << "mov " << reg << ", " << std::uint32_t(value + key) << '\n';
+      ss << "sub " << reg << ", " << key;
+      cost.charge("mov");
+      cost.charge("sub");
+    }
+    break;
+  case constant_encoding_scheme::mul_inverse: {
+    const std::uint32_t odd_key = key | 1;
+    ss << "mov " << reg << ", " << std::uint32_t(value * odd_key) << '\n';
+    ss << "imul " << reg << ", " << reg << ", "
+       << multiplicative_inverse(odd_key);
+    cost.charge("mov");
+    cost.charge("imul");
+    break;
+  }
+  case constant_encoding_scheme::table_lookup:
+    ss << "mov " << reg << ", [const_pool+" << 4 * pool.size() << "]\n";
+    ss << "xor " << reg << ", " << key;
+    cost.charge("mov", memory_access::load);
+    cost.charge("xor");
+    pool.push_back(value ^ key);
+    break;
+  }
+  ss << "; encoded " << value << '\n';
+}
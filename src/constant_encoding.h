@@ -0,0 +1,65 @@
+#ifndef CONSTANT_ENCODING_H
+#define CONSTANT_ENCODING_H
+
+#include "cfg.h"
+#include "cfg_analysis.h"
+
+#include <cstdint>
+#include <iosfwd>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+class cycle_counter;
+
+enum class constant_encoding_scheme {
+  /// mov r,v^k; xor r,k
+  xor_key,
+  /// mov r,v-k; add r,k  or  mov r,v+k; sub r,k
+  add_key,
+  /// mov r,v*k; imul r,r,inverse(k)
+  mul_inverse,
+  /// mov r,[const_pool+4*i]; xor r,k  where the pool holds v^k
+  table_lookup,
+};
+
+struct constant_encoding_policy {
+  /// Encode every constant using this scheme, or select it for each constant
+  /// if empty.
+  std::optional<constant_encoding_scheme> fixed_scheme;
+  /// The decoding cycles a single constant may cost during a single run of
+  /// the program. The more frequent the block, the cheaper the selected scheme.
+  double budget = 60;
+};
+
+/// Parses one of 'auto', 'xor', 'add', 'mul' or 'table'.
+std::optional<constant_encoding_policy>
+parse_constant_encoding_policy(std::string_view spec);
+
+/// Emits the decoding sequences of the constants and collects the encoded
+/// values of the table lookups.
+class constant_encoder {
+  const constant_encoding_policy &policy;
+  const block_frequencies &freqs;
+  std::vector<std::uint32_t> pool;
+
+public:
+  constant_encoder(const constant_encoding_policy &policy,
+                   const block_frequencies &freqs)
+      : policy{policy}, freqs{freqs} {}
+
+  /// Emits a sequence leaving the value in the given 32 bit register and
+  /// charges its cycles. The key is derived from the block, the value and the
+  /// index of the occurrence.
+  void emit_decode(std::ostream &ss, cycle_counter &cost, const basicblock &bb,
+                   std::uint32_t value, unsigned occurrence,
+                   std::string_view reg);
+
+  const std::vector<std::uint32_t> &constant_pool() const { return pool; }
+
+private:
+  constant_encoding_scheme select_scheme(const basicblock &bb,
+                                         std::uint32_t key) const;
+};
+
+#endif // CONSTANT_ENCODING_H
@@ -0,0 +1,174 @@
+#include "cost_model.h"
+#include "codegen.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+struct instruction_cost {
+  double latency;
+  double reciprocal_throughput;
+};
+
+// Rough figures of a recent Intel core, in cycles.
+constexpr double load_latency = 4;
+constexpr double store_throughput = 1;
+constexpr double default_latency = 1;
+
+// Calls into the I/O runtime are dominated by the library, not by the call.
+constexpr double runtime_call_cycles = 150;
+
+const std::map<std::string_view, instruction_cost> &cost_table() {
+  static const std::map<std::string_view, instruction_cost> table{
+      {"mov", {1, 0.25}},   {"movzx", {1, 0.25}}, {"lea", {1, 0.5}},
+      {"add", {1, 0.25}},   {"sub", {1, 0.25}},   {"xor", {1, 0.25}},
+      {"and", {1, 0.25}},   {"or", {1, 0.25}},    {"cmp", {1, 0.25}},
+      {"test", {1, 0.25}},  {"inc", {1, 0.25}},   {"dec", {1, 0.25}},
+      {"neg", {1, 0.25}},   {"not", {1, 0.25}},   {"shl", {1, 0.5}},
+      {"shr", {1, 0.5}},    {"sar", {1, 0.5}},    {"imul", {3, 1}},
+      {"mul", {4, 1}},      {"div", {26, 6}},     {"cmove", {1, 0.5}},
+      {"cmovne", {1, 0.5}}, {"cmovb", {1, 0.5}},  {"cmovbe", {1, 0.5}},
+      {"cmova", {1, 0.5}},  {"cmovae", {1, 0.5}}, {"sete", {1, 0.5}},
+      {"setb", {1, 0.5}},   {"setbe", {1, 0.5}},  {"seta", {1, 0.5}},
+      {"setae", {1, 0.5}},  {"xchg", {2, 1}},     {"push", {3, 1}},
+      {"pop", {4, 0.5}},    {"jmp", {1, 1}},      {"call", {3, 2}},
+      {"ret", {3, 1}},
+  };
+  return table;
+}
+
+bool is_conditional_branch(std::string_view mnemonic) {
+  return mnemonic.size() >= 2 && mnemonic[0] == 'j' && mnemonic != "jmp";
+}
+
+double instruction_cycles(std::string_view mnemonic, memory_access access) {
+  const auto it = cost_table().find(mnemonic);
+  const bool is_branch = mnemonic == "jmp" || is_conditional_branch(mnemonic);
+  const instruction_cost cost =
+      it != cost_table().end()
+          ? it->second
+          : instruction_cost{default_latency, is_branch ? 0.5 : 0.25};
+
+  if (mnemonic == "call")
+    return cost.reciprocal_throughput + runtime_call_cycles;
+
+  // Stores and control-flow do not extend the dependency chain.
+  if (access == memory_access::store)
+    return cost.reciprocal_throughput + store_throughput;
+  if (is_branch || mnemonic == "push" || mnemonic == "ret")
+    return cost.reciprocal_throughput;
+
+  return cost.latency + (access == memory_access::load ? load_latency : 0);
+}
+} // namespace
+
+void cycle_counter::charge(std::string_view mnemonic, memory_access access) {
+  segments.back() += instruction_cycles(mnemonic, access);
+  if (is_conditional_branch(mnemonic))
+    segments.push_back(0);
+}
+
+void cycle_counter::refund(std::string_view mnemonic, memory_access access) {
+  segments.back() -= instruction_cycles(mnemonic, access);
+}
+
+double cycle_counter::cycles() const {
+  const double exits = static_cast<double>(segments.size());
+  double res = 0;
+  for (std::size_t i = 0; i < segments.size(); ++i)
+    res += segments[i] * (exits - static_cast<double>(i)) / exits;
+  return res;
+}
+
+cost_estimate estimate_cost(const std::vector<emitted_block> &code,
+                            const block_frequencies &freqs) {
+  cost_estimate res;
+  for (const emitted_block &emitted : code) {
+    const double block_cycles = emitted.cost.cycles();
+    const auto it = freqs.find(emitted.block);
+    const double weighted =
+        block_cycles * (it == freqs.end() ? 1 : it->second);
+    res.block_cycles[emitted.block] = block_cycles;
+    res.weighted_cycles[emitted.block] = weighted;
+    res.total_cycles += weighted;
+  }
+  return res;
+}
+
+void print_cost_report(std::ostream &os, const cost_estimate &cost,
+                       const block_frequencies &freqs, const loop_info &loops) {
+  const auto original_flags = os.flags();
+  const auto original_precision = os.precision();
+  os << "Estimated cost:\n";
+  os << std::fixed << std::setprecision(1);
+  os << "  " << std::left << std::setw(16) << "block" << std::right
+     << std::setw(14) << "frequency" << std::setw(14) << "cycles/run"
+     << std::setw(16) << "cycles" << '\n';
+  std::vector<const basicblock *> blocks;
+  for (const auto &[block, cycles] : cost.block_cycles)
+    blocks.push_back(block);
+  std::sort(blocks.begin(), blocks.end(), [](const auto *lhs, const auto *rhs) {
+    return *lhs < *rhs;
+  });
+
+  for (const basicblock *block : blocks) {
+    const auto it = freqs.find(block);
+    std::stringstream name;
+    name << "bb_" << block->id;
+    os << "  " << std::left << std::setw(16) << name.str() << std::right
+       << std::setw(14) << (it == freqs.end() ? 1 : it->second)
+       << std::setw(14) << cost.block_cycles.at(block) << std::setw(16)
+       << cost.weighted_cycles.at(block) << '\n';
+  }
+
+  for (const auto &l : loops.loops()) {
+    double loop_cycles = 0;
+    for (const basicblock *block : l->blocks) {
+      if (const auto it = cost.weighted_cycles.find(block);
+          it != cost.weighted_cycles.end())
+        loop_cycles += it->second;
+    }
+    std::stringstream name;
+    name << "loop bb_" << l->header->id << " (depth " << l->depth << ')';
+    os << "  " << std::left << std::setw(44) << name.str() << std::right
+       << std::setw(16) << loop_cycles << '\n';
+  }
+  os << "  " << std::left << std::setw(44) << "total" << std::right
+     << std::setw(16) << cost.total_cycles << '\n';
+  os.flags(original_flags);
+  os.precision(original_precision);
+}
+
+void print_cost_deltas(
+    std::ostream &os,
+    const std::vector<std::pair<std::string, double>> &steps) {
+  if (steps.empty())
+    return;
+
+  const auto original_flags = os.flags();
+  const auto original_precision = os.precision();
+  os << "Estimated cost of the transformations:\n";
+  os << std::fixed << std::setprecision(1);
+  const double baseline = steps.front().second;
+  double previous = baseline;
+  for (const auto &[name, cycles] : steps) {
+    os << "  " << std::left << std::setw(28) << name << std::right
+       << std::setw(16) << cycles << std::showpos << std::setw(16)
+       << cycles - previous << " (" << (cycles - previous) / baseline * 100
+       << "%)" << std::noshowpos << '\n';
+    previous = cycles;
+  }
+  os << "  " << std::left << std::setw(28) << "overhead" << std::right
+     << std::showpos << std::setw(32) << previous - baseline << " ("
+     << (previous - baseline) / baseline * 100 << "%)" << std::noshowpos
+     << '\n';
+  os.flags(original_flags);
+  os.precision(original_precision);
+}
@@ -0,0 +1,63 @@
+#ifndef COST_MODEL_H
+#define COST_MODEL_H
+
+#include "cfg.h"
+#include "cfg_analysis.h"
+
+#include <iosfwd>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+struct emitted_block;
+
+/// What an instruction does with its memory operand, if it has one.
+enum class memory_access { none, load, store };
+
+/// Estimates how many cycles a single execution of a straight-line sequence
+/// of instructions takes on a typical out-of-order x86 core. The code
+/// generator charges each instruction as it emits it.
+/// The generated code is mostly a single dependency chain through eax, so the
+/// latencies of the value producing instructions add up, while stores and
+/// branches are charged by their reciprocal throughput. The code following
+/// the n-th of c conditional branches is weighted by (c + 1 - n) / (c + 1),
+/// as if the exits were taken uniformly.
+class cycle_counter {
+  /// The cycles of the instructions before, between and after the
+  /// conditional branches.
+  std::vector<double> segments{0};
+
+public:
+  void charge(std::string_view mnemonic,
+              memory_access access = memory_access::none);
+  /// Takes back the last instruction, which turned out to be left out.
+  void refund(std::string_view mnemonic,
+              memory_access access = memory_access::none);
+
+  double cycles() const;
+};
+
+struct cost_estimate {
+  /// Cycles of a single execution of each emitted block.
+  std::map<const basicblock *, double> block_cycles;
+  /// Cycles of each block weighted by its frequency.
+  std::map<const basicblock *, double> weighted_cycles;
+  double total_cycles = 0;
+};
+
+cost_estimate estimate_cost(const std::vector<emitted_block> &code,
+                            const block_frequencies &freqs);
+
+/// Dumps the cycles per block, per loop and in total.
+void print_cost_report(std::ostream &os, const cost_estimate &cost,
+                       const block_frequencies &freqs, const loop_info &loops);
+
+/// Dumps the total cycles after enabling each transformation one by one,
+/// relative to the first entry.
+void print_cost_deltas(
+    std::ostream &os,
+    const std::vector<std::pair<std::string, double>> &steps);
+
+#endif // COST_MODEL_H
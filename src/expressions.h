@@ -14,6 +14,14 @@ using expression = std::variant<class number_expression,
                                 class boolean_expression, class id_expression,
                                 class binop_expression, class not_expression>;
 
+/// The deepest expression accepted from a source. The passes walk the
+/// expressions recursively, so deeper ones could overflow the stack.
+constexpr int max_expression_depth = 1000;
+
+/// The number of the nested operators in the expression, plus one, as it was
+/// built. Constant time, as every operator records its own depth.
+int depth_of(const expression &expr) noexcept;
+
 class number_expression {
 public:
   explicit number_expression(unsigned value) : value(value) {}
@@ -43,9 +51,7 @@ static_assert(std::is_copy_constructible_v<id_expression>);
 class binop_expression {
 public:
   binop_expression(int line, std::string op, std::unique_ptr<expression> left,
-                   std::unique_ptr<expression> right)
-      : line(line), op(std::move(op)), left(std::move(left)),
-        right(std::move(right)) {}
+                   std::unique_ptr<expression> right);
   binop_expression(const binop_expression &other);
   binop_expression(binop_expression &&other) = default;
   binop_expression &operator=(const binop_expression &other);
@@ -55,13 +61,13 @@ public:
   std::string op;
   std::unique_ptr<expression> left;
   std::unique_ptr<expression> right;
+  int depth = 1;
 };
 static_assert(std::is_copy_constructible_v<binop_expression>);
 
 class not_expression {
 public:
-  not_expression(int line, std::string op, std::unique_ptr<expression> operand)
-      : line(line), op(std::move(op)), operand(std::move(operand)) {}
+  not_expression(int line, std::string op, std::unique_ptr<expression> operand);
   not_expression(const not_expression &other);
   not_expression(not_expression &&other) = default;
   not_expression &operator=(const not_expression &other);
@@ -70,6 +76,7 @@ public:
   int line;
   std::string op;
   std::unique_ptr<expression> operand;
+  int depth = 1;
 };
 static_assert(std::is_copy_constructible_v<not_expression>);
 
@@ -14,15 +14,36 @@
   #include <cstdlib>
   #include <sstream>
   #include <map>
+  #include <string>
+  #include <string_view>
+
+  class lexer;
 }
 
 %code provides {
-  int yylex(yy::parser::semantic_type* yylval, yy::parser::location_type* yylloc);
+  int yylex(yy::parser::semantic_type* yylval, yy::parser::location_type* yylloc,
+            ::lexer &lexer);
+}
+
+%code {
+  namespace {
+  void check_depth(const expression &expr, int line) {
+    if (depth_of(expr) > max_expression_depth) {
+      std::stringstream ss;
+      ss << "The expression is nested deeper than " << max_expression_depth
+         << " operators.";
+      ::error(line, ss.str());
+    }
+  }
+  } // namespace
 }
 
+%param {::lexer &lexer}
 %parse-param {::ast &ast}
 
 %token PROGRAM BEGIN_ END
+/* Never scanned, starts the statements parsed without the rest of a program. */
+%token FRAGMENT
 %token BOOLEAN NATURAL
 %token READ WRITE
 %token IF THEN ELSE ENDIF
@@ -30,8 +51,8 @@
 %token TRUE FALSE
 %token COMMA ASSIGN
 %token LPAREN RPAREN
-%token <std::string> ID
-%token <std::string> NUM
+%token <std::string_view> ID
+%token <unsigned> NUM
 
 %left OR
 %left AND
@@ -50,11 +71,18 @@
 %%
 
 start:
-  PROGRAM ID declarations BEGIN_ commands END {
-    type_check($3, $5);
-    ast.prog_name = std::move($2);
+  PROGRAM ID declarations BEGIN_ {
+    ast.prog_name = std::string($2);
     ast.syms = std::move($3);
-    ast.stmts = std::move($5);
+    ast.begin_line = @4.begin.line;
+  } program_commands END {
+    ast.end_line = @7.begin.line;
+    if (!ast.statement_sink)
+      type_check(ast.syms, ast.stmts);
+  }
+| FRAGMENT program_commands {
+    if (!ast.statement_sink)
+      type_check(ast.syms, ast.stmts);
   }
 ;
 
@@ -76,10 +104,25 @@ declarations:
 
 declaration:
   BOOLEAN ID {
-    $$ = symbol{@1.begin.line, $2, boolean};
+    $$ = symbol{@1.begin.line, std::string($2), boolean};
   }
 | NATURAL ID {
-    $$ = symbol{@1.begin.line, $2, natural};
+    $$ = symbol{@1.begin.line, std::string($2), natural};
+  }
+;
+
+program_commands:
+  /* empty */
+| program_commands command {
+    ast.statement_lines.emplace_back(@2.begin.line, @2.end.line);
+    if (ast.statement_sink) {
+      statements single;
+      single.push_back(std::move($2));
+      type_check(ast.syms, single);
+      ast.statement_sink(std::move(single.back()));
+    } else {
+      ast.stmts.push_back(std::move($2));
+    }
   }
 ;
 
@@ -95,13 +138,13 @@ commands:
 
 command:
   READ LPAREN ID RPAREN {
-    $$ = read_statement{@1.begin.line, std::move($3)};
+    $$ = read_statement{@1.begin.line, std::string($3)};
   }
 | WRITE LPAREN expression RPAREN {
     $$ =  write_statement{@1.begin.line, std::move($3)};
   }
 | ID ASSIGN expression {
-    $$ = assign_statement{@2.begin.line, std::move($1), std::move($3)};
+    $$ = assign_statement{@2.begin.line, std::string($1), std::move($3)};
   }
 | IF expression THEN commands ENDIF {
     $$ = if_statement{@1.begin.line, std::move($2), std::move($4), statements{}};
@@ -116,7 +159,7 @@ command:
 
 expression:
   NUM {
-    $$ = std::make_unique<expression>(std::in_place_type<number_expression>, std::atoi($1.c_str()));
+    $$ = std::make_unique<expression>(std::in_place_type<number_expression>, $1);
   }
 | TRUE {
     $$ = std::make_unique<expression>(std::in_place_type<boolean_expression>, true);
@@ -125,46 +168,59 @@ expression:
     $$ = std::make_unique<expression>(std::in_place_type<boolean_expression>, false);
   }
 | ID {
-    $$ = std::make_unique<expression>(std::in_place_type<id_expression>, @1.begin.line, std::move($1));
+    $$ = std::make_unique<expression>(std::in_place_type<id_expression>, @1.begin.line, std::string($1));
   }
 | expression ADD expression {
     $$ = std::make_unique<expression>(std::in_place_type<binop_expression>, @2.begin.line, "+", std::move($1), std::move($3));
+    check_depth(*$$, @2.begin.line);
   }
 | expression SUB expression {
     $$ = std::make_unique<expression>(std::in_place_type<binop_expression>, @2.begin.line, "-", std::move($1), std::move($3));
+    check_depth(*$$, @2.begin.line);
   }
 | expression MUL expression {
     $$ = std::make_unique<expression>(std::in_place_type<binop_expression>, @2.begin.line, "*", std::move($1), std::move($3));
+    check_depth(*$$, @2.begin.line);
   }
 | expression DIV expression {
     $$ = std::make_unique<expression>(std::in_place_type<binop_expression>, @2.begin.line, "/", std::move($1), std::move($3));
+    check_depth(*$$, @2.begin.line);
   }
 | expression MOD expression {
     $$ = std::make_unique<expression>(std::in_place_type<binop_expression>, @2.begin.line, "%", std::move($1), std::move($3));
+    check_depth(*$$, @2.begin.line);
   }
 | expression LT expression {
     $$ = std::make_unique<expression>(std::in_place_type<binop_expression>, @2.begin.line, "<", std::move($1), std::move($3));
+    check_depth(*$$, @2.begin.line);
   }
 | expression GT expression {
     $$ = std::make_unique<expression>(std::in_place_type<binop_expression>, @2.begin.line, ">", std::move($1), std::move($3));
+    check_depth(*$$, @2.begin.line);
   }
 | expression LE expression {
     $$ = std::make_unique<expression>(std::in_place_type<binop_expression>, @2.begin.line, "<=", std::move($1), std::move($3));
+    check_depth(*$$, @2.begin.line);
   }
 | expression GE expression {
     $$ = std::make_unique<expression>(std::in_place_type<binop_expression>, @2.begin.line, ">=", std::move($1), std::move($3));
+    check_depth(*$$, @2.begin.line);
   }
 | expression AND expression {
     $$ = std::make_unique<expression>(std::in_place_type<binop_expression>, @2.begin.line, "and", std::move($1), std::move($3));
+    check_depth(*$$, @2.begin.line);
   }
 | expression OR expression {
     $$ = std::make_unique<expression>(std::in_place_type<binop_expression>, @2.begin.line, "or", std::move($1), std::move($3));
+    check_depth(*$$, @2.begin.line);
   }
 | expression EQ expression {
     $$ = std::make_unique<expression>(std::in_place_type<binop_expression>, @2.begin.line, "=", std::move($1), std::move($3));
+    check_depth(*$$, @2.begin.line);
   }
 | NOT expression {
     $$ = std::make_unique<expression>(std::in_place_type<not_expression>, @1.begin.line, "not", std::move($2));
+    check_depth(*$$, @1.begin.line);
   }
 | LPAREN expression RPAREN {
     $$ = std::move($2);
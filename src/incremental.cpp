@@ -0,0 +1,413 @@
+#include "incremental.h"
+
+#include "cfg.h"
+#include "codegen.h"
+#include "compiler.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cctype>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <sstream>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+namespace {
+constexpr unsigned not_compiled = -1;
+
+/// FNV-1a, which only has to tell the texts of the groups apart.
+std::uint64_t hash_text(std::string_view text) {
+  std::uint64_t hash = 0xcbf29ce484222325;
+  for (unsigned char c : text) {
+    hash ^= c;
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+/// A random seed stays random, the others are mixed with the salt.
+std::optional<std::size_t> derive_seed(std::optional<std::size_t> seed,
+                                       std::uint64_t salt) {
+  if (!seed.has_value() || seed.value() == static_cast<std::size_t>(-1))
+    return seed;
+  return seed.value() ^ salt;
+}
+
+bool is_identifier_char(char c) {
+  return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+/// Prefixes the labels defined and referred to in the code, so that they are
+/// unique among the groups.
+std::string relabel(std::string_view code, std::string_view prefix) {
+  constexpr std::string_view labels[] = {"bb_", tail_label_prefix,
+                                         "const_pool"};
+  std::string res;
+  res.reserve(code.size() + code.size() / 8);
+  for (std::size_t i = 0; i < code.size(); ++i) {
+    if (i == 0 || !is_identifier_char(code[i - 1]))
+      for (std::string_view label : labels)
+        if (code.substr(i, label.size()) == label) {
+          res.append(prefix);
+          break;
+        }
+    res.push_back(code[i]);
+  }
+  return res;
+}
+
+bool at_line_start(std::string_view text, std::size_t pos) {
+  return pos == 0 || text[pos - 1] == '\n';
+}
+
+/// The offsets of the lines of the text.
+std::vector<std::size_t> line_starts(std::string_view text) {
+  std::vector<std::size_t> res{0};
+  for (std::size_t pos = text.find('\n'); pos != std::string_view::npos;
+       pos = text.find('\n', pos + 1))
+    res.push_back(pos + 1);
+  return res;
+}
+} // namespace
+
+incremental_compiler::incremental_compiler(transformations t)
+    : t{std::move(t)} {}
+
+incremental_update incremental_compiler::update(std::string new_source) {
+  if (!built)
+    return rebuild(std::move(new_source));
+
+  const std::string_view old_text = source;
+  const std::string_view new_text = new_source;
+  const std::size_t prefix = static_cast<std::size_t>(
+      std::mismatch(old_text.begin(), old_text.end(), new_text.begin(),
+                    new_text.end())
+          .first -
+      old_text.begin());
+  if (prefix == old_text.size() && prefix == new_text.size())
+    return incremental_update{assembly_size, assembly_size, 0, false};
+  const std::size_t max_suffix =
+      std::min(old_text.size(), new_text.size()) - prefix;
+  const std::size_t suffix = std::min<std::size_t>(
+      max_suffix, std::mismatch(old_text.rbegin(), old_text.rend(),
+                                new_text.rbegin(), new_text.rend())
+                          .first -
+                      old_text.rbegin());
+  const std::ptrdiff_t delta = static_cast<std::ptrdiff_t>(new_text.size()) -
+                               static_cast<std::ptrdiff_t>(old_text.size());
+
+  // Widen the edit to whole lines, in both versions.
+  const std::size_t edit_begin =
+      prefix == 0 ? 0 : old_text.rfind('\n', prefix - 1) + 1;
+  std::size_t edit_end = old_text.size() - suffix;
+  if (!at_line_start(old_text, edit_end) ||
+      !at_line_start(new_text, edit_end + delta)) {
+    const std::size_t eol = old_text.find('\n', edit_end);
+    edit_end = eol == std::string_view::npos ? old_text.size() : eol + 1;
+  }
+
+  // The groups overlapping the edited lines are parsed again along with them.
+  const auto first = std::partition_point(
+      groups.begin(), groups.end(),
+      [&](const group &g) { return g.end <= edit_begin; });
+  const auto last = std::partition_point(
+      first, groups.end(), [&](const group &g) { return g.begin < edit_end; });
+  std::size_t begin = edit_begin;
+  std::size_t end = edit_end;
+  if (first != last) {
+    begin = std::min(begin, first->begin);
+    end = std::max(end, std::prev(last)->end);
+  }
+  if (begin < body_begin || end > body_end)
+    return rebuild(std::move(new_source));
+
+  int first_line;
+  if (first != last && begin == first->begin) {
+    first_line = first->first_line;
+  } else {
+    std::size_t known = body_begin;
+    first_line = body_first_line;
+    if (first != groups.begin()) {
+      known = std::prev(first)->end;
+      first_line = std::prev(first)->first_line + std::prev(first)->line_count;
+    }
+    first_line += static_cast<int>(std::count(
+        old_text.begin() + known, old_text.begin() + begin, '\n'));
+  }
+
+  const std::string_view old_fragment = old_text.substr(begin, end - begin);
+  const std::string_view new_fragment =
+      new_text.substr(begin, end + delta - begin);
+  std::vector<group> replacement =
+      find_groups(new_fragment, begin,
+                  first_line,
+                  build_fragment_ast_from(new_fragment, first_line, declared));
+  const int line_delta =
+      static_cast<int>(std::count(new_fragment.begin(), new_fragment.end(),
+                                  '\n') -
+                       std::count(old_fragment.begin(), old_fragment.end(),
+                                  '\n'));
+
+  // Nothing throws from here on, unless something is broken; then the next
+  // update compiles everything again.
+  built = false;
+  const std::size_t index = first - groups.begin();
+  std::vector<group> removed(std::make_move_iterator(first),
+                             std::make_move_iterator(last));
+  for (const group &g : removed)
+    count_temporaries(g, false);
+  groups.erase(first, last);
+  groups.insert(groups.begin() + index,
+                std::make_move_iterator(replacement.begin()),
+                std::make_move_iterator(replacement.end()));
+  for (std::size_t i = index + replacement.size(); i < groups.size(); ++i) {
+    groups[i].begin += delta;
+    groups[i].end += delta;
+    groups[i].first_line += line_delta;
+  }
+  body_end += delta;
+  source = std::move(new_source);
+
+  const std::vector<std::size_t> compiled =
+      compile_groups(removed, index, replacement.size());
+  for (std::size_t i : compiled)
+    count_temporaries(groups[i], true);
+  const std::string previous_epilogue =
+      std::exchange(epilogue, make_epilogue());
+  built = true;
+
+  // The groups before the edit keep their ordinals, so they are unchanged.
+  // The changed groups, as a range of indices.
+  std::optional<std::pair<std::size_t, std::size_t>> changed;
+  const auto mark_changed = [&](std::size_t first, std::size_t last) {
+    if (changed.has_value())
+      changed = {std::min(changed->first, first),
+                 std::max(changed->second, last)};
+    else
+      changed = {first, last};
+  };
+  const std::size_t common = std::min(removed.size(), replacement.size());
+  const auto mismatch = std::mismatch(
+      removed.begin(), removed.begin() + common, groups.begin() + index,
+      [](const group &lhs, const group &rhs) { return lhs.code == rhs.code; });
+  if (mismatch.first != removed.begin() + common ||
+      removed.size() != replacement.size())
+    mark_changed(index + (mismatch.first - removed.begin()),
+                 index + replacement.size());
+  for (std::size_t i : compiled)
+    if (i < index || i >= index + replacement.size())
+      mark_changed(i, i + 1);
+
+  assembly_size = offset_of_group(groups.size()) + epilogue.size();
+
+  incremental_update res;
+  res.recompiled_groups = compiled.size();
+  res.first_changed_byte = assembly_size;
+  res.changed_end = assembly_size;
+  if (changed.has_value()) {
+    res.first_changed_byte = offset_of_group(changed->first);
+    res.changed_end = offset_of_group(changed->second);
+  }
+  if (epilogue != previous_epilogue) {
+    res.first_changed_byte =
+        std::min(res.first_changed_byte, offset_of_group(groups.size()));
+    res.changed_end = assembly_size;
+  }
+  return res;
+}
+
+void incremental_compiler::write(std::ostream &os, std::size_t from,
+                                 std::size_t to) const {
+  std::size_t offset = 0;
+  const auto write_piece = [&](std::string_view piece) {
+    const std::size_t begin = std::max(from, offset);
+    const std::size_t end = std::min(to, offset + piece.size());
+    if (begin < end)
+      os << piece.substr(begin - offset, end - begin);
+    offset += piece.size();
+  };
+  write_piece(prologue);
+  for (const group &g : groups)
+    write_piece(g.code);
+  write_piece(epilogue);
+}
+
+incremental_update incremental_compiler::rebuild(std::string new_source) {
+  ast parsed = build_ast_from(new_source);
+  std::vector<group> found = find_groups(new_source, 0, 1, parsed);
+
+  built = false;
+  const std::vector<std::size_t> starts = line_starts(new_source);
+  const auto line_start = [&](int line) {
+    return static_cast<std::size_t>(line - 1) < starts.size()
+               ? starts[line - 1]
+               : new_source.size();
+  };
+  body_begin = line_start(parsed.begin_line + 1);
+  body_end = line_start(parsed.end_line);
+  body_first_line = parsed.begin_line + 1;
+  source = std::move(new_source);
+  declared = std::move(parsed.syms);
+  groups = std::move(found);
+  temporaries.clear();
+
+  std::vector<group> none;
+  for (std::size_t i : compile_groups(none, 0, groups.size()))
+    count_temporaries(groups[i], true);
+  prologue = program_prologue();
+  epilogue = make_epilogue();
+  assembly_size = offset_of_group(groups.size()) + epilogue.size();
+  built = true;
+  return incremental_update{0, assembly_size, groups.size(), true};
+}
+
+std::vector<incremental_compiler::group>
+incremental_compiler::find_groups(std::string_view text, std::size_t offset,
+                                  int first_line, const ast &parsed) const {
+  const std::vector<std::size_t> starts = line_starts(text);
+  const auto line_start = [&](int line) {
+    const auto index = static_cast<std::size_t>(line - first_line);
+    return offset + (index < starts.size() ? starts[index] : text.size());
+  };
+
+  std::vector<group> res;
+  const auto &lines = parsed.statement_lines;
+  for (auto it = lines.begin(); it != lines.end();) {
+    const int first = it->first;
+    int last = it->second;
+    for (++it; it != lines.end() && it->first <= last; ++it)
+      last = std::max(last, it->second);
+
+    group g;
+    g.begin = line_start(first);
+    g.end = line_start(last + 1);
+    g.first_line = first;
+    g.line_count = last - first + 1;
+    g.key = hash_text(text.substr(g.begin - offset, g.end - g.begin));
+    g.ordinal = not_compiled;
+    res.push_back(std::move(g));
+  }
+  return res;
+}
+
+std::vector<std::size_t>
+incremental_compiler::compile_groups(std::vector<group> &removed,
+                                     std::size_t first, std::size_t count) {
+  // Only the ordinals of the groups sharing the text of an added or removed
+  // one might change.
+  std::unordered_map<std::uint64_t, unsigned> seen;
+  for (const group &g : removed)
+    seen.emplace(g.key, 0);
+  for (std::size_t i = first; i < first + count; ++i)
+    seen.emplace(groups[i].key, 0);
+
+  std::vector<std::size_t> stale;
+  for (std::size_t i = 0; i < groups.size(); ++i) {
+    group &g = groups[i];
+    const auto it = seen.find(g.key);
+    if (it == seen.end())
+      continue;
+    const unsigned ordinal = it->second++;
+    if (ordinal == g.ordinal)
+      continue;
+    count_temporaries(g, false);
+    g.ordinal = ordinal;
+    // The lines next to an edit are parsed again, but mostly stay the same.
+    const auto same = std::find_if(
+        removed.begin(), removed.end(), [&](const group &x) {
+          return x.key == g.key && x.ordinal == ordinal && !x.code.empty();
+        });
+    if (same != removed.end()) {
+      g.code = same->code;
+      g.temporaries = same->temporaries;
+      count_temporaries(g, true);
+      continue;
+    }
+    stale.push_back(i);
+  }
+
+  parallel_for(stale.size(),
+               [&](std::size_t i) { compile(groups[stale[i]]); });
+  return stale;
+}
+
+void incremental_compiler::compile(group &g) const {
+  const std::string_view text =
+      std::string_view{source}.substr(g.begin, g.end - g.begin);
+  ast parsed = build_fragment_ast_from(text, g.first_line, declared);
+
+  // The groups with the same text get different seeds through their
+  // ordinals.
+  const std::uint64_t salt = g.key ^ (g.ordinal * 0x9e3779b97f4a7c15);
+  transformations local = t;
+  local.remap_bb_ids_seed = derive_seed(t.remap_bb_ids_seed, salt);
+  local.codegen.serialization_seed =
+      derive_seed(t.codegen.serialization_seed, salt);
+  local.codegen.fragment = true;
+  local.partial_eval_fuel = 0;
+
+  lowered_program program = lower(std::move(parsed), block_profile{});
+  transform(program, local);
+  const emitted_program emitted = emit(program, local);
+
+  // The code following the group continues where its exit ends.
+  std::stringstream ss;
+  const basicblock *entry = program.graph.entry;
+  if (emitted.blocks.empty() || emitted.blocks.front().block != entry ||
+      emitted.blocks.front().code.empty())
+    ss << "jmp bb_" << entry->id << '\n';
+  for (std::size_t i = 0; i < emitted.blocks.size(); ++i) {
+    ss << emitted.blocks[i].code;
+    if (emitted.blocks[i].block == program.graph.exit &&
+        i + 1 != emitted.blocks.size())
+      ss << "jmp bb_end\n";
+  }
+  ss << "bb_end:\n";
+  if (!emitted.constant_pool.empty()) {
+    ss << "section .rodata\nconst_pool:\n";
+    for (std::uint32_t encoded : emitted.constant_pool)
+      ss << "dd " << encoded << '\n';
+    ss << "section .text\n";
+  }
+
+  std::stringstream prefix;
+  prefix << 'g' << std::hex << std::setw(16) << std::setfill('0') << g.key
+         << std::dec << '_' << g.ordinal << '_';
+  g.code = relabel(ss.str(), prefix.str());
+
+  g.temporaries.clear();
+  std::set_difference(program.syms.begin(), program.syms.end(),
+                      declared.begin(), declared.end(),
+                      std::inserter(g.temporaries, g.temporaries.end()),
+                      [](const auto &lhs, const auto &rhs) {
+                        return lhs.first < rhs.first;
+                      });
+}
+
+void incremental_compiler::count_temporaries(const group &g, bool add) {
+  for (const auto &[name, sym] : g.temporaries) {
+    if (add)
+      ++temporaries.try_emplace(name, sym, 0).first->second.second;
+    else if (const auto it = temporaries.find(name);
+             it != temporaries.end() && --it->second.second == 0)
+      temporaries.erase(it);
+  }
+}
+
+std::string incremental_compiler::make_epilogue() const {
+  symbols all = declared;
+  for (const auto &[name, entry] : temporaries)
+    all.emplace(name, entry.first);
+  return program_epilogue(all);
+}
+
+std::size_t incremental_compiler::offset_of_group(std::size_t index) const {
+  std::size_t offset = prologue.size();
+  for (std::size_t i = 0; i < index; ++i)
+    offset += groups[i].code.size();
+  return offset;
+}
@@ -0,0 +1,104 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include "compiler.h"
+#include "expressions.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/// What an update of the incremental_compiler did.
+struct incremental_update {
+  /// The assembly is the same as before up to this offset, and from the
+  /// other one on, apart from being moved by the change of its size.
+  std::size_t first_changed_byte = 0;
+  std::size_t changed_end = 0;
+  /// The groups of statements lowered and emitted again.
+  std::size_t recompiled_groups = 0;
+  /// Whether the whole source was compiled again.
+  bool rebuilt = false;
+};
+
+/// Compiles a program one group of top-level statements at a time, where the
+/// statements sharing a line belong to the same group, and keeps the assembly
+/// of each group. After an edit only the lines differing from the previous
+/// version of the source are parsed again, and only their groups are lowered
+/// and emitted. An edit of the declarations, or of the lines of 'begin' and
+/// 'end', compiles the whole source again.
+///
+/// Each group is compiled as if it were a program of its own, so every
+/// transformation but the partial evaluation applies within the groups. The
+/// labels and the seeds of a group are derived from its text, so the assembly
+/// depends only on the source, not on the edits leading to it.
+class incremental_compiler {
+public:
+  explicit incremental_compiler(transformations t);
+
+  /// Compiles the new version of the source. If it is broken, throws a
+  /// compile_error and keeps the assembly of the previous version.
+  incremental_update update(std::string source);
+
+  std::size_t size() const noexcept { return assembly_size; }
+  /// Writes the assembly between the given offsets.
+  void write(std::ostream &os, std::size_t from = 0,
+             std::size_t to = -1) const;
+
+private:
+  struct group {
+    /// The lines of the statements in the source, from the beginning of the
+    /// first one to the end of the last one.
+    std::size_t begin;
+    std::size_t end;
+    int first_line;
+    int line_count;
+    /// The hash of the text of the lines.
+    std::uint64_t key;
+    /// The number of groups with the same key before this one.
+    unsigned ordinal;
+    std::string code;
+    /// The symbols declared by the transformations.
+    symbols temporaries;
+  };
+
+  incremental_update rebuild(std::string new_source);
+  /// The groups of the parsed statements, which begin on the first line of
+  /// the text, at the offset of the source.
+  std::vector<group> find_groups(std::string_view text, std::size_t offset,
+                                 int first_line, const ast &parsed) const;
+  /// Assigns the ordinals, and compiles the count groups added at first and
+  /// the ones whose ordinal changed, unless one of the removed groups had the
+  /// same text and ordinal. Returns the indices of the compiled ones.
+  std::vector<std::size_t> compile_groups(std::vector<group> &removed,
+                                          std::size_t first,
+                                          std::size_t count);
+  void compile(group &g) const;
+  void count_temporaries(const group &g, bool add);
+  std::string make_epilogue() const;
+  std::size_t offset_of_group(std::size_t index) const;
+
+  transformations t;
+  /// Whether the groups reflect the source.
+  bool built = false;
+  std::string source;
+  symbols declared;
+  /// The lines between 'begin' and 'end'; the groups may only be parsed again
+  /// if the edit is within them.
+  std::size_t body_begin = 0;
+  std::size_t body_end = 0;
+  int body_first_line = 0;
+  std::vector<group> groups;
+  /// The symbols declared by the transformations, with the number of groups
+  /// using each.
+  std::map<std::string, std::pair<symbol, std::size_t>> temporaries;
+  std::string prologue;
+  std::string epilogue;
+  std::size_t assembly_size = 0;
+};
+
+#endif // INCREMENTAL_H
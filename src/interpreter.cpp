@@ -9,7 +9,6 @@
 
 std::map<std::string, unsigned> value_table;
 
-bool do_constant_propagation = true;
 
 bool number_expression::is_constant_expression() const { return true; }
 
@@ -0,0 +1,676 @@
+#include "jit.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define WCOMP_JIT_SUPPORTED 1
+#endif
+
+namespace {
+// The counterparts of test/io.c, called by the jitted programs.
+void jit_write_natural(unsigned n) { std::printf("%u\n", n); }
+
+// Reads a wider number than "%u" to saturate on overflow like the 32 bit
+// io.c, whose scanf parses with a 32 bit strtoul.
+unsigned jit_read_natural() {
+  long long value = 0;
+  if (std::scanf("%lld", &value) != 1)
+    return 0;
+  constexpr unsigned largest = std::numeric_limits<unsigned>::max();
+  if (value > static_cast<long long>(largest) ||
+      value < -static_cast<long long>(largest))
+    return largest;
+  return static_cast<unsigned>(value);
+}
+
+void jit_write_boolean(char b) { std::printf(b ? "true\n" : "false\n"); }
+
+char jit_read_boolean() {
+  char buf[6] = {0};
+  if (std::scanf("%5s", buf) != 1)
+    return 0;
+  return std::strcmp(buf, "true") == 0 ? 1 : 0;
+}
+
+struct runtime_routine {
+  std::string_view name;
+  void *address;
+  bool takes_argument;
+};
+
+const runtime_routine runtime_routines[] = {
+    {"write_natural", reinterpret_cast<void *>(&jit_write_natural), true},
+    {"read_natural", reinterpret_cast<void *>(&jit_read_natural), false},
+    {"write_boolean", reinterpret_cast<void *>(&jit_write_boolean), true},
+    {"read_boolean", reinterpret_cast<void *>(&jit_read_boolean), false},
+};
+
+std::string_view trim(std::string_view s) {
+  const auto first = s.find_first_not_of(" \t");
+  if (first == std::string_view::npos)
+    return {};
+  const auto last = s.find_last_not_of(" \t");
+  return s.substr(first, last - first + 1);
+}
+
+std::int64_t parse_number(std::string_view s) {
+  std::int64_t value = 0;
+  const auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), value);
+  if (ec != std::errc{} || end != s.data() + s.size())
+    error(-1, "Bug: Invalid number in the assembly: " + std::string(s));
+  return value;
+}
+
+struct operand {
+  enum class kind { reg, imm, mem };
+  kind k;
+  unsigned reg = 0;
+  /// The width in bits, zero if the size of the memory is unspecified.
+  unsigned width = 0;
+  std::int64_t imm = 0;
+  std::string symbol;
+  std::int64_t disp = 0;
+};
+
+operand parse_operand(std::string_view s) {
+  static const std::map<std::string_view, std::pair<unsigned, unsigned>>
+      registers{{"eax", {0, 32}}, {"ecx", {1, 32}}, {"edx", {2, 32}},
+                {"ebx", {3, 32}}, {"esp", {4, 32}}, {"ebp", {5, 32}},
+                {"esi", {6, 32}}, {"edi", {7, 32}}, {"ax", {0, 16}},
+                {"cx", {1, 16}},  {"dx", {2, 16}},  {"bx", {3, 16}},
+                {"al", {0, 8}},   {"cl", {1, 8}},   {"dl", {2, 8}},
+                {"bl", {3, 8}}};
+  static const std::map<std::string_view, unsigned> sizes{
+      {"byte", 8}, {"word", 16}, {"dword", 32}};
+
+  s = trim(s);
+  if (const auto it = registers.find(s); it != registers.end())
+    return operand{operand::kind::reg, it->second.first, it->second.second};
+
+  const auto bracket = s.find('[');
+  if (bracket == std::string_view::npos) {
+    operand res{operand::kind::imm};
+    res.imm = parse_number(s);
+    return res;
+  }
+
+  operand res{operand::kind::mem};
+  if (const std::string_view size = trim(s.substr(0, bracket)); !size.empty())
+    res.width = sizes.at(size);
+  const std::string_view address =
+      trim(s.substr(bracket + 1, s.find(']') - bracket - 1));
+  const auto plus = address.find('+');
+  res.symbol = std::string(trim(address.substr(0, plus)));
+  if (plus != std::string_view::npos)
+    res.disp = parse_number(trim(address.substr(plus + 1)));
+  return res;
+}
+
+/// Encodes the subset of the 32 bit x86 instructions emitted by codegen as
+/// their x86-64 counterparts.
+class assembler {
+  enum class section { none, bss, data, text };
+
+  struct fixup {
+    std::size_t at;
+    std::size_t next_ip;
+    std::string target;
+    std::int64_t addend;
+  };
+
+  section current = section::none;
+  std::map<std::string, std::size_t> code_labels;
+  std::map<std::string, std::size_t> data_labels;
+  std::map<std::string, std::size_t> bss_labels;
+  std::vector<fixup> fixups;
+
+public:
+  std::vector<std::uint8_t> code;
+  std::vector<std::uint8_t> data;
+  std::size_t bss_size = 0;
+
+  assembler() { emit_trampoline(); }
+
+  void assemble_line(std::string_view line);
+
+  /// Resolves the relative addresses, given the offsets of the data and
+  /// of the bss relative to the beginning of the code.
+  void resolve(std::size_t data_offset, std::size_t bss_offset);
+
+private:
+  void define_label(std::string_view name);
+  void assemble_data(std::string_view directive, std::string_view args);
+  void assemble_instruction(std::string_view mnemonic,
+                            const std::vector<operand> &ops);
+
+  void byte(std::uint8_t x) { code.push_back(x); }
+  void bytes(std::initializer_list<std::uint8_t> xs) {
+    code.insert(code.end(), xs);
+  }
+  void immediate(std::int64_t value, unsigned size) {
+    for (unsigned i = 0; i < size; ++i)
+      byte(static_cast<std::uint8_t>(value >> (8 * i)));
+  }
+  void relative(std::string target, std::int64_t addend = 0,
+                unsigned trailing_immediate = 0) {
+    fixups.push_back({code.size(), code.size() + 4 + trailing_immediate,
+                      std::move(target), addend});
+    immediate(0, 4);
+  }
+  void modrm(unsigned reg_field, const operand &rm,
+             unsigned trailing_immediate = 0) {
+    if (rm.k == operand::kind::reg) {
+      byte(0xC0 | reg_field << 3 | rm.reg);
+    } else if (rm.symbol == "esp") {
+      // The spilled values, addressed relative to the stack pointer.
+      byte(0x44 | reg_field << 3);
+      byte(0x24);
+      immediate(rm.disp, 1);
+    } else {
+      // Address the memory relative to the instruction pointer.
+      byte(0x05 | reg_field << 3);
+      relative(rm.symbol, rm.disp, trailing_immediate);
+    }
+  }
+  void operand_size_prefix(unsigned width) {
+    if (width == 16)
+      byte(0x66);
+  }
+
+  void emit_trampoline();
+  void emit_runtime_call(std::string_view name);
+};
+
+void assembler::emit_trampoline() {
+  // Save the registers the program might clobber, but the caller expects
+  // to be preserved.
+  bytes({0x53, 0x55, 0x41, 0x54}); // push rbx; push rbp; push r12
+  byte(0xE8);                      // call main
+  relative("main");
+  bytes({0x41, 0x5C, 0x5D, 0x5B}); // pop r12; pop rbp; pop rbx
+  byte(0xC3);                      // ret
+}
+
+void assembler::emit_runtime_call(std::string_view name) {
+  const runtime_routine *routine = nullptr;
+  for (const runtime_routine &candidate : runtime_routines)
+    if (candidate.name == name)
+      routine = &candidate;
+  if (routine == nullptr)
+    error(-1, "Bug: Call of an unknown routine: " + std::string(name));
+
+  // esi and edi are callee-saved in cdecl, but not in the System V ABI.
+  bytes({0x56, 0x57});             // push rsi; push rdi
+  bytes({0x49, 0x89, 0xE4});       // mov r12,rsp
+  bytes({0x48, 0x83, 0xE4, 0xF0}); // and rsp,-16
+  if (routine->takes_argument) {
+    // The argument was pushed right before the saved registers.
+    bytes({0x41, 0x8B, 0x7C, 0x24, 0x10}); // mov edi,[r12+16]
+  }
+  bytes({0x48, 0xB8}); // mov rax,address
+  immediate(reinterpret_cast<std::int64_t>(routine->address), 8);
+  bytes({0xFF, 0xD0});       // call rax
+  bytes({0x4C, 0x89, 0xE4}); // mov rsp,r12
+  bytes({0x5F, 0x5E});       // pop rdi; pop rsi
+}
+
+void assembler::define_label(std::string_view name) {
+  const std::string label{name};
+  switch (current) {
+  case section::text:
+    code_labels[label] = code.size();
+    break;
+  case section::data:
+    data_labels[label] = data.size();
+    break;
+  case section::bss:
+    bss_labels[label] = bss_size;
+    break;
+  case section::none:
+    error(-1, "Bug: Label outside of any section: " + label);
+  }
+}
+
+void assembler::assemble_data(std::string_view directive,
+                              std::string_view args) {
+  const auto align_to = [](std::size_t offset, std::size_t alignment) {
+    return (offset + alignment - 1) / alignment * alignment;
+  };
+
+  if (current == section::bss) {
+    if (directive == "resb")
+      bss_size += parse_number(args);
+    else if (directive == "resw")
+      bss_size += 2 * parse_number(args);
+    else if (directive == "resd")
+      bss_size += 4 * parse_number(args);
+    else if (directive == "align" || directive == "alignb")
+      bss_size = align_to(bss_size, parse_number(args));
+    else
+      error(-1, "Bug: Unsupported directive: " + std::string(directive));
+    return;
+  }
+
+  if (directive == "align") {
+    data.resize(align_to(data.size(), parse_number(args)));
+    return;
+  }
+  const unsigned size = directive == "db"   ? 1
+                        : directive == "dw" ? 2
+                        : directive == "dd" ? 4
+                                            : 0;
+  if (size == 0)
+    error(-1, "Bug: Unsupported directive: " + std::string(directive));
+  while (!args.empty()) {
+    const auto comma = args.find(',');
+    const std::int64_t value = parse_number(trim(args.substr(0, comma)));
+    for (unsigned i = 0; i < size; ++i)
+      data.push_back(static_cast<std::uint8_t>(value >> (8 * i)));
+    args = comma == std::string_view::npos ? "" : args.substr(comma + 1);
+  }
+}
+
+void assembler::assemble_line(std::string_view line) {
+  line = trim(line.substr(0, line.find(';')));
+  if (line.empty() || line.front() == '%')
+    return;
+
+  const auto space = line.find_first_of(" \t");
+  std::string_view head = line.substr(0, space);
+  std::string_view rest =
+      space == std::string_view::npos ? "" : trim(line.substr(space + 1));
+
+  if (head == "global" || head == "extern")
+    return;
+  if (head == "section") {
+    current = rest == ".bss"    ? section::bss
+              : rest == ".text" ? section::text
+                                : section::data;
+    return;
+  }
+
+  if (head.back() == ':') {
+    define_label(head.substr(0, head.size() - 1));
+    if (rest.empty())
+      return;
+    const auto rest_space = rest.find_first_of(" \t");
+    head = rest.substr(0, rest_space);
+    rest = rest_space == std::string_view::npos
+               ? ""
+               : trim(rest.substr(rest_space + 1));
+  }
+
+  if (current != section::text) {
+    assemble_data(head, rest);
+    return;
+  }
+
+  if (head == "call") {
+    emit_runtime_call(rest);
+    return;
+  }
+
+  std::vector<operand> ops;
+  std::string_view jump_target;
+  if (head.front() == 'j') {
+    jump_target = rest;
+  } else {
+    while (!rest.empty()) {
+      const auto comma = rest.find(',');
+      ops.push_back(parse_operand(rest.substr(0, comma)));
+      rest = comma == std::string_view::npos ? "" : rest.substr(comma + 1);
+    }
+  }
+
+  if (head == "jmp") {
+    byte(0xE9);
+    relative(std::string(jump_target));
+    return;
+  }
+  static const std::map<std::string_view, std::uint8_t> conditions{
+      {"b", 0x2},  {"ae", 0x3}, {"e", 0x4},  {"z", 0x4},  {"ne", 0x5},
+      {"nz", 0x5}, {"be", 0x6}, {"a", 0x7},  {"l", 0xC},  {"ge", 0xD},
+      {"le", 0xE}, {"g", 0xF},  {"c", 0x2},  {"nc", 0x3}};
+  const auto condition_code = [&](std::size_t prefix, std::uint8_t base) {
+    return static_cast<std::uint8_t>(base + conditions.at(head.substr(prefix)));
+  };
+  if (head.front() == 'j') {
+    bytes({0x0F, condition_code(1, 0x80)});
+    relative(std::string(jump_target));
+    return;
+  }
+  if (head.substr(0, 4) == "cmov") {
+    operand_size_prefix(ops[0].width);
+    bytes({0x0F, condition_code(4, 0x40)});
+    modrm(ops[0].reg, ops[1]);
+    return;
+  }
+  if (head.substr(0, 3) == "set") {
+    bytes({0x0F, condition_code(3, 0x90)});
+    modrm(0, ops[0]);
+    return;
+  }
+  assemble_instruction(head, ops);
+}
+
+void assembler::assemble_instruction(std::string_view mnemonic,
+                                     const std::vector<operand> &ops) {
+  using kind = operand::kind;
+  const auto unsupported = [&] {
+    error(-1, "Bug: Unsupported instruction in the jit: " +
+                  std::string(mnemonic));
+  };
+  const auto width_of = [&] {
+    for (const operand &op : ops)
+      if (op.k != kind::imm && op.width != 0)
+        return op.width;
+    return 32u;
+  };
+  const auto fits_in_byte = [](std::int64_t value) {
+    const auto x = static_cast<std::int32_t>(static_cast<std::uint32_t>(value));
+    return -128 <= x && x <= 127;
+  };
+
+  static const std::map<std::string_view, unsigned> alu_digits{
+      {"add", 0}, {"or", 1}, {"and", 4}, {"sub", 5}, {"xor", 6}, {"cmp", 7}};
+  static const std::map<std::string_view, unsigned> unary_digits{
+      {"not", 2}, {"neg", 3}, {"mul", 4}, {"imul", 5}, {"div", 6}, {"idiv", 7}};
+  static const std::map<std::string_view, unsigned> shift_digits{
+      {"shl", 4}, {"shr", 5}, {"sar", 7}};
+
+  if (mnemonic == "mov" && ops.size() == 2) {
+    const unsigned width = width_of();
+    const operand &dst = ops[0];
+    const operand &src = ops[1];
+    if (dst.k == kind::reg && src.k == kind::imm) {
+      operand_size_prefix(width);
+      byte((width == 8 ? 0xB0 : 0xB8) + dst.reg);
+      immediate(src.imm, width / 8);
+    } else if (src.k == kind::imm) {
+      operand_size_prefix(width);
+      byte(width == 8 ? 0xC6 : 0xC7);
+      modrm(0, dst, width / 8);
+      immediate(src.imm, width / 8);
+    } else if (src.k == kind::reg) {
+      operand_size_prefix(width);
+      byte(width == 8 ? 0x88 : 0x89);
+      modrm(src.reg, dst);
+    } else if (dst.k == kind::reg) {
+      operand_size_prefix(width);
+      byte(width == 8 ? 0x8A : 0x8B);
+      modrm(dst.reg, src);
+    } else {
+      unsupported();
+    }
+  } else if (mnemonic == "movzx" && ops.size() == 2) {
+    bytes({0x0F, static_cast<std::uint8_t>(ops[1].width == 16 ? 0xB7 : 0xB6)});
+    modrm(ops[0].reg, ops[1]);
+  } else if (const auto alu = alu_digits.find(mnemonic);
+             alu != alu_digits.end() && ops.size() == 2) {
+    const unsigned digit = alu->second;
+    const unsigned width = width_of();
+    const operand &dst = ops[0];
+    const operand &src = ops[1];
+    if (dst.k == kind::reg && dst.reg == 4 && dst.width == 32) {
+      // The 32 bit pushes became 8 bytes wide, adjust the stack accordingly.
+      bytes({0x48, 0x81, static_cast<std::uint8_t>(0xC4 | digit << 3)});
+      immediate(2 * src.imm, 4);
+    } else if (src.k == kind::imm) {
+      operand_size_prefix(width);
+      if (width == 8) {
+        byte(0x80);
+        modrm(digit, dst, 1);
+        immediate(src.imm, 1);
+      } else if (fits_in_byte(src.imm)) {
+        byte(0x83);
+        modrm(digit, dst, 1);
+        immediate(src.imm, 1);
+      } else {
+        byte(0x81);
+        modrm(digit, dst, width / 8);
+        immediate(src.imm, width / 8);
+      }
+    } else if (src.k == kind::reg) {
+      operand_size_prefix(width);
+      byte(digit * 8 + (width == 8 ? 0 : 1));
+      modrm(src.reg, dst);
+    } else if (dst.k == kind::reg) {
+      operand_size_prefix(width);
+      byte(digit * 8 + (width == 8 ? 2 : 3));
+      modrm(dst.reg, src);
+    } else {
+      unsupported();
+    }
+  } else if (mnemonic == "xchg" && ops.size() == 2 &&
+             ops[1].k == kind::reg) {
+    byte(0x87);
+    modrm(ops[1].reg, ops[0]);
+  } else if (mnemonic == "test" && ops.size() == 2) {
+    const unsigned width = width_of();
+    operand_size_prefix(width);
+    if (ops[1].k == kind::imm) {
+      byte(width == 8 ? 0xF6 : 0xF7);
+      modrm(0, ops[0], width / 8);
+      immediate(ops[1].imm, width / 8);
+    } else {
+      byte(width == 8 ? 0x84 : 0x85);
+      modrm(ops[1].reg, ops[0]);
+    }
+  } else if (mnemonic == "imul" && ops.size() == 3) {
+    if (fits_in_byte(ops[2].imm)) {
+      byte(0x6B);
+      modrm(ops[0].reg, ops[1], 1);
+      immediate(ops[2].imm, 1);
+    } else {
+      byte(0x69);
+      modrm(ops[0].reg, ops[1], 4);
+      immediate(ops[2].imm, 4);
+    }
+  } else if (mnemonic == "imul" && ops.size() == 2) {
+    bytes({0x0F, 0xAF});
+    modrm(ops[0].reg, ops[1]);
+  } else if (const auto unary = unary_digits.find(mnemonic);
+             unary != unary_digits.end() && ops.size() == 1) {
+    const unsigned width = width_of();
+    operand_size_prefix(width);
+    byte(width == 8 ? 0xF6 : 0xF7);
+    modrm(unary->second, ops[0]);
+  } else if ((mnemonic == "inc" || mnemonic == "dec") && ops.size() == 1) {
+    const unsigned width = width_of();
+    operand_size_prefix(width);
+    byte(width == 8 ? 0xFE : 0xFF);
+    modrm(mnemonic == "inc" ? 0 : 1, ops[0]);
+  } else if (const auto shift = shift_digits.find(mnemonic);
+             shift != shift_digits.end() && ops.size() == 2) {
+    const unsigned width = width_of();
+    operand_size_prefix(width);
+    if (ops[1].k == kind::reg) {
+      byte(width == 8 ? 0xD2 : 0xD3);
+      modrm(shift->second, ops[0]);
+    } else {
+      byte(width == 8 ? 0xC0 : 0xC1);
+      modrm(shift->second, ops[0], 1);
+      immediate(ops[1].imm, 1);
+    }
+  } else if (mnemonic == "push" && ops.size() == 1) {
+    if (ops[0].k == kind::reg) {
+      byte(0x50 + ops[0].reg);
+    } else if (ops[0].k == kind::imm) {
+      byte(0x68);
+      immediate(ops[0].imm, 4);
+    } else {
+      unsupported();
+    }
+  } else if (mnemonic == "pop" && ops.size() == 1 && ops[0].k == kind::reg) {
+    byte(0x58 + ops[0].reg);
+  } else if (mnemonic == "ret" && ops.empty()) {
+    byte(0xC3);
+  } else if (mnemonic == "cdq" && ops.empty()) {
+    byte(0x99);
+  } else if (mnemonic == "nop" && ops.empty()) {
+    byte(0x90);
+  } else {
+    unsupported();
+  }
+}
+
+void assembler::resolve(std::size_t data_offset, std::size_t bss_offset) {
+  for (const fixup &f : fixups) {
+    std::size_t target;
+    if (const auto it = code_labels.find(f.target); it != code_labels.end())
+      target = it->second;
+    else if (const auto it = data_labels.find(f.target);
+             it != data_labels.end())
+      target = data_offset + it->second;
+    else if (const auto it = bss_labels.find(f.target); it != bss_labels.end())
+      target = bss_offset + it->second;
+    else
+      error(-1, "Bug: Undefined symbol in the assembly: " + f.target);
+
+    const auto rel = static_cast<std::int32_t>(
+        static_cast<std::int64_t>(target) + f.addend -
+        static_cast<std::int64_t>(f.next_ip));
+    std::memcpy(&code[f.at], &rel, sizeof(rel));
+  }
+}
+} // namespace
+
+#ifdef WCOMP_JIT_SUPPORTED
+jit_program::jit_program(std::string_view assembly) {
+  assembler as;
+  while (!assembly.empty()) {
+    const auto eol = assembly.find('\n');
+    as.assemble_line(assembly.substr(0, eol));
+    assembly = eol == std::string_view::npos ? "" : assembly.substr(eol + 1);
+  }
+
+  // The code and the data occupy distinct pages, so that the code can be
+  // executable and the data writable, but never both.
+  const std::size_t page = sysconf(_SC_PAGESIZE);
+  const auto round_up = [](std::size_t x, std::size_t alignment) {
+    return (x + alignment - 1) / alignment * alignment;
+  };
+  data_offset = round_up(as.code.size(), page);
+  // The variables are laid out relative to a cache line aligned bss.
+  bss_offset = round_up(data_offset + as.data.size(), 64);
+  bss_size = as.bss_size;
+  memory_size = round_up(bss_offset + bss_size, page);
+  as.resolve(data_offset, bss_offset);
+
+  void *mapping = mmap(nullptr, memory_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED)
+    error(-1, "Failed to allocate memory for the jit.");
+  memory = static_cast<std::byte *>(mapping);
+  std::memcpy(memory, as.code.data(), as.code.size());
+  std::memcpy(memory + data_offset, as.data.data(), as.data.size());
+  if (mprotect(memory, data_offset, PROT_READ | PROT_EXEC) != 0)
+    error(-1, "Failed to make the jitted code executable.");
+}
+
+jit_program::~jit_program() {
+  if (memory != nullptr)
+    munmap(memory, memory_size);
+}
+
+bool jit_program::supported() noexcept { return true; }
+
+int jit_program::run() const {
+  std::memset(memory + bss_offset, 0, bss_size);
+  using entry_point = int (*)();
+  const int exit_code = reinterpret_cast<entry_point>(memory)();
+  std::fflush(stdout);
+  return exit_code;
+}
+
+int jit_program::run_in_child() const {
+  std::fflush(stdout);
+  const pid_t child = fork();
+  if (child == -1)
+    error(-1, "Failed to fork for the jit.");
+  if (child == 0)
+    _exit(run());
+
+  int status = 0;
+  if (waitpid(child, &status, 0) != child)
+    error(-1, "Failed to wait for the jitted program.");
+  if (WIFSIGNALED(status))
+    error(-1, "The program was ended by signal " +
+                  std::to_string(WTERMSIG(status)) + " (" +
+                  strsignal(WTERMSIG(status)) + ").");
+  return WEXITSTATUS(status);
+}
+
+std::optional<double> jit_program::time_runs(const std::string &input,
+                                             unsigned runs) const {
+  // A trap of the program must not take down the compiler with it.
+  int fds[2];
+  if (pipe(fds) != 0)
+    error(-1, "Failed to create a pipe for the jit.");
+  std::fflush(stdout);
+  const pid_t child = fork();
+  if (child == -1)
+    error(-1, "Failed to fork for the jit.");
+
+  if (child == 0) {
+    close(fds[0]);
+    if (std::freopen("/dev/null", "w", stdout) == nullptr)
+      _exit(1);
+    double fastest = std::numeric_limits<double>::infinity();
+    for (unsigned i = 0; i < runs; ++i) {
+      if (std::freopen(input.c_str(), "r", stdin) == nullptr)
+        _exit(1);
+      const auto start = std::chrono::steady_clock::now();
+      if (run() != 0)
+        _exit(1);
+      const std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+      fastest = std::min(fastest, elapsed.count());
+    }
+    const bool sent = write(fds[1], &fastest, sizeof(fastest)) ==
+                      static_cast<ssize_t>(sizeof(fastest));
+    _exit(sent ? 0 : 1);
+  }
+
+  close(fds[1]);
+  double fastest = 0;
+  const bool received = read(fds[0], &fastest, sizeof(fastest)) ==
+                        static_cast<ssize_t>(sizeof(fastest));
+  close(fds[0]);
+  int status = 0;
+  waitpid(child, &status, 0);
+  if (!received || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    return std::nullopt;
+  return fastest;
+}
+#else
+jit_program::jit_program(std::string_view) {
+  error(-1, "The jit is supported only on x86-64 Linux.");
+}
+
+jit_program::~jit_program() = default;
+
+bool jit_program::supported() noexcept { return false; }
+
+int jit_program::run() const { unreachable(); }
+
+int jit_program::run_in_child() const { unreachable(); }
+
+std::optional<double> jit_program::time_runs(const std::string &,
+                                             unsigned) const {
+  unreachable();
+}
+#endif
@@ -0,0 +1,45 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+
+/// The assembly produced by codegen, assembled into the memory of this
+/// process. The 32 bit instructions are encoded as their x86-64 counterparts,
+/// the variables are addressed relative to the instruction pointer, and the
+/// calls of the I/O routines are bound to the implementations of wcomp.
+class jit_program {
+  std::byte *memory = nullptr;
+  std::size_t memory_size = 0;
+  std::size_t data_offset = 0;
+  std::size_t bss_offset = 0;
+  std::size_t bss_size = 0;
+
+public:
+  explicit jit_program(std::string_view assembly);
+  jit_program(const jit_program &) = delete;
+  jit_program &operator=(const jit_program &) = delete;
+  ~jit_program();
+
+  /// Whether the jit works on this platform.
+  static bool supported() noexcept;
+
+  /// Runs the program from the beginning, with zeroed variables.
+  /// Returns the exit code of the program.
+  int run() const;
+
+  /// Runs the program like run, but in a child process, so that a trap of the
+  /// program does not end this one. Returns the exit code of the program, or
+  /// throws a compile_error if a signal ended it.
+  int run_in_child() const;
+
+  /// Runs the program the given times in a child process, each time reading
+  /// the input file and discarding the output. Returns the seconds the
+  /// fastest run took, or nothing if the program failed.
+  std::optional<double> time_runs(const std::string &input,
+                                  unsigned runs) const;
+};
+
+#endif // JIT_H
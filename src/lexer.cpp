@@ -0,0 +1,281 @@
+#include "lexer.h"
+#include "grammar.hpp"
+#include "utility.h"
+
+#include <array>
+#include <bit>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+using tok = yy::parser::token;
+
+[[noreturn]] void fail(const std::string &msg) {
+  throw compile_error{-1, msg};
+}
+
+enum char_class : unsigned char {
+  space = 1 << 0,
+  identifier_start = 1 << 1,
+  identifier_part = 1 << 2,
+  digit = 1 << 3,
+};
+
+constexpr std::array<unsigned char, 256> make_char_classes() {
+  std::array<unsigned char, 256> classes{};
+  classes[' '] = classes['\t'] = classes['\n'] = space;
+  for (int c = 'a'; c <= 'z'; ++c)
+    classes[c] = identifier_start | identifier_part;
+  for (int c = 'A'; c <= 'Z'; ++c)
+    classes[c] = identifier_start | identifier_part;
+  classes['_'] = identifier_start | identifier_part;
+  for (int c = '0'; c <= '9'; ++c)
+    classes[c] = identifier_part | digit;
+  return classes;
+}
+constexpr std::array<unsigned char, 256> char_classes = make_char_classes();
+
+bool is(char c, char_class cls) noexcept {
+  return (char_classes[static_cast<unsigned char>(c)] & cls) != 0;
+}
+
+struct keyword {
+  std::string_view text;
+  int token = 0;
+};
+
+// Every keyword is at least two characters long, and these three properties
+// tell them apart. Anything else found in the slot of an identifier is just
+// another identifier.
+constexpr std::size_t keyword_hash(std::string_view text) noexcept {
+  return (static_cast<unsigned char>(text[0]) * 7u +
+          static_cast<unsigned char>(text[1]) * 2u + text.size()) %
+         32u;
+}
+constexpr std::size_t min_keyword_length = 2;
+constexpr std::size_t max_keyword_length = 7;
+
+constexpr std::array<keyword, 32> make_keyword_table() {
+  constexpr keyword keywords[] = {
+      {"program", tok::PROGRAM}, {"begin", tok::BEGIN_},
+      {"end", tok::END},         {"boolean", tok::BOOLEAN},
+      {"natural", tok::NATURAL}, {"read", tok::READ},
+      {"write", tok::WRITE},     {"if", tok::IF},
+      {"then", tok::THEN},       {"else", tok::ELSE},
+      {"endif", tok::ENDIF},     {"while", tok::WHILE},
+      {"do", tok::DO},           {"done", tok::DONE},
+      {"true", tok::TRUE},       {"false", tok::FALSE},
+      {"and", tok::AND},         {"or", tok::OR},
+      {"not", tok::NOT},
+  };
+  std::array<keyword, 32> table{};
+  for (const keyword &kw : keywords) {
+    keyword &slot = table[keyword_hash(kw.text)];
+    // Not a constant expression, thus fails the compilation on collision.
+    if (!slot.text.empty())
+      throw "The keyword hash is not perfect.";
+    slot = kw;
+  }
+  return table;
+}
+constexpr std::array<keyword, 32> keyword_table = make_keyword_table();
+
+int identifier_or_keyword(std::string_view text) noexcept {
+  if (text.size() < min_keyword_length || text.size() > max_keyword_length)
+    return tok::ID;
+  const keyword &candidate = keyword_table[keyword_hash(text)];
+  return candidate.text == text ? candidate.token : tok::ID;
+}
+
+const char *skip_identifier_part(const char *p, const char *end) noexcept {
+#ifdef __SSE2__
+  const __m128i case_bit = _mm_set1_epi8(0x20);
+  while (end - p >= 16) {
+    const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    // The bytes above 0x7f are negative, thus fall outside every range.
+    const __m128i lower = _mm_or_si128(chunk, case_bit);
+    const __m128i letter =
+        _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                      _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+    const __m128i number =
+        _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8('0' - 1)),
+                      _mm_cmplt_epi8(chunk, _mm_set1_epi8('9' + 1)));
+    const __m128i underscore = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('_'));
+    const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(
+        _mm_or_si128(_mm_or_si128(letter, number), underscore)));
+    if (mask != 0xffff)
+      return p + std::countr_one(mask);
+    p += 16;
+  }
+#endif
+  while (p != end && is(*p, identifier_part))
+    ++p;
+  return p;
+}
+
+/// Skips the spaces, tabs and newlines, counting the latter.
+const char *skip_spaces(const char *p, const char *end, int &line) noexcept {
+  // Most tokens are separated by a single space.
+  while (p != end && *p == ' ')
+    ++p;
+  if (p == end || !is(*p, space))
+    return p;
+#ifdef __SSE2__
+  while (end - p >= 16) {
+    const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    const __m128i newlines = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n'));
+    const __m128i spaces =
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')),
+                     _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t')));
+    const unsigned space_mask = static_cast<unsigned>(
+        _mm_movemask_epi8(_mm_or_si128(spaces, newlines)));
+    const unsigned newline_mask =
+        static_cast<unsigned>(_mm_movemask_epi8(newlines));
+    const int count = std::countr_one(space_mask);
+    line += std::popcount(newline_mask & ((1u << count) - 1));
+    p += count;
+    if (count != 16)
+      return p;
+  }
+#endif
+  for (; p != end && is(*p, space); ++p)
+    line += *p == '\n';
+  return p;
+}
+} // namespace
+
+source_file::source_file(const std::string &path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    fail("Failed to open " + path);
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    fail("Failed to read " + path);
+  }
+
+  size = static_cast<std::size_t>(info.st_size);
+  if (size == 0) {
+    close(fd);
+    return;
+  }
+  void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    fail("Failed to map " + path);
+  madvise(mapping, size, MADV_SEQUENTIAL);
+  data = static_cast<const char *>(mapping);
+}
+
+void source_file::release_before(const char *position) noexcept {
+  static const std::size_t page_size = sysconf(_SC_PAGESIZE);
+  const std::size_t length = (position - data) / page_size * page_size;
+  if (data == nullptr || length <= released)
+    return;
+  madvise(const_cast<char *>(data) + released, length - released,
+          MADV_DONTNEED);
+  released = length;
+}
+
+source_file::~source_file() {
+  if (data != nullptr)
+    munmap(const_cast<char *>(data), size);
+}
+
+void lexer::skip_whitespace_and_comments() noexcept {
+  for (;;) {
+    cursor = skip_spaces(cursor, end, current_line);
+    if (cursor == end || *cursor != '#')
+      return;
+    const void *eol = std::memchr(cursor, '\n', end - cursor);
+    cursor = eol != nullptr ? static_cast<const char *>(eol) : end;
+  }
+}
+
+int lexer::next() {
+  if (first_token != 0) {
+    token_begin = cursor;
+    return std::exchange(first_token, 0);
+  }
+  skip_whitespace_and_comments();
+  token_line = current_line;
+  token_begin = cursor;
+  if (cursor == end)
+    return 0;
+
+  const char *begin = cursor;
+  const char c = *cursor++;
+
+  if (is(c, identifier_start)) {
+    cursor = skip_identifier_part(cursor, end);
+    token_text = std::string_view(begin, cursor - begin);
+    const int token = identifier_or_keyword(token_text);
+    if (token == tok::IF || token == tok::WHILE) {
+      if (++nesting > max_statement_nesting) {
+        error(token_line, "The statements are nested deeper than " +
+                              std::to_string(max_statement_nesting) +
+                              " levels.");
+      }
+    } else if (token == tok::ENDIF || token == tok::DONE) {
+      --nesting;
+    }
+    return token;
+  }
+
+  if (is(c, digit)) {
+    unsigned value = c - '0';
+    for (; cursor != end && is(*cursor, digit); ++cursor)
+      value = value * 10 + (*cursor - '0');
+    token_value = value;
+    return tok::NUM;
+  }
+
+  const bool followed_by_eq = cursor != end && *cursor == '=';
+  switch (c) {
+  case ',':
+    return tok::COMMA;
+  case '+':
+    return tok::ADD;
+  case '-':
+    return tok::SUB;
+  case '*':
+    return tok::MUL;
+  case '/':
+    return tok::DIV;
+  case '%':
+    return tok::MOD;
+  case '=':
+    return tok::EQ;
+  case '(':
+    return tok::LPAREN;
+  case ')':
+    return tok::RPAREN;
+  case ':':
+    if (!followed_by_eq)
+      break;
+    ++cursor;
+    return tok::ASSIGN;
+  case '<':
+    cursor += followed_by_eq;
+    return followed_by_eq ? tok::LE : tok::LT;
+  case '>':
+    cursor += followed_by_eq;
+    return followed_by_eq ? tok::GE : tok::GT;
+  }
+
+  std::string msg = "Unexpected character: '";
+  msg += c;
+  msg += "'.";
+  error(token_line, msg);
+}
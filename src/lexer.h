@@ -0,0 +1,73 @@
+#ifndef LEXER_H
+#define LEXER_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+/// A source file mapped read-only into the memory. The text stays valid as
+/// long as the object lives, so the tokens can refer into it.
+class source_file {
+  const char *data = nullptr;
+  std::size_t size = 0;
+  std::size_t released = 0;
+
+public:
+  explicit source_file(const std::string &path);
+  source_file(const source_file &) = delete;
+  source_file &operator=(const source_file &) = delete;
+  ~source_file();
+
+  std::string_view text() const noexcept { return {data, size}; }
+
+  /// Lets the kernel drop the pages of the text before the given position.
+  /// They are read again from the file if accessed later.
+  void release_before(const char *position) noexcept;
+};
+
+/// The deepest nesting of the if and while statements accepted from a source.
+/// The passes walk the statements recursively, so deeper ones could overflow
+/// the stack.
+constexpr int max_statement_nesting = 1000;
+
+/// Splits the source into the tokens of the parser. The identifiers are
+/// views into the source, the numbers are converted during the scanning.
+class lexer {
+  const char *token_begin = nullptr;
+  const char *cursor;
+  const char *end;
+  std::string_view token_text;
+  unsigned token_value = 0;
+  int token_line = 1;
+  int current_line = 1;
+  int first_token = 0;
+  int nesting = 0;
+
+public:
+  explicit lexer(std::string_view source) noexcept
+      : cursor{source.data()}, end{source.data() + source.size()} {}
+
+  /// Scans a piece of a source beginning on the given line. The given token
+  /// is returned first, before anything scanned.
+  lexer(std::string_view source, int first_line, int first_token) noexcept
+      : cursor{source.data()}, end{source.data() + source.size()},
+        token_line{first_line}, current_line{first_line},
+        first_token{first_token} {}
+
+  /// Returns the next token, or zero at the end of the source.
+  int next();
+
+  /// The text of the last identifier.
+  std::string_view text() const noexcept { return token_text; }
+  /// The value of the last number, modulo 2^32.
+  unsigned value() const noexcept { return token_value; }
+  /// The line where the last token begins.
+  int line() const noexcept { return token_line; }
+  /// Where the last token begins in the source.
+  const char *position() const noexcept { return token_begin; }
+
+private:
+  void skip_whitespace_and_comments() noexcept;
+};
+
+#endif // LEXER_H
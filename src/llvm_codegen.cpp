@@ -0,0 +1,213 @@
+#include "llvm_codegen.h"
+#include "cfg_analysis.h"
+#include "typecheck.h"
+#include "utility.h"
+
+#include <map>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <variant>
+
+namespace {
+std::string_view llvm_type(type ty) { return ty == boolean ? "i1" : "i32"; }
+
+std::string block_label(const basicblock &bb) {
+  return "bb_" + std::to_string(bb.id);
+}
+
+/// Emits the instructions of the basic blocks. The values are numbered
+/// across the whole function, as LLVM requires unique names.
+class ir_to_llvm {
+  const symbols &syms;
+  std::ostream &ss;
+  mutable unsigned next_value = 0;
+  mutable bool divides = false;
+
+public:
+  ir_to_llvm(const symbols &syms, std::ostream &ss) : syms{syms}, ss{ss} {}
+
+  std::string fresh_value() const {
+    return "%t" + std::to_string(next_value++);
+  }
+
+  const symbol &lookup(const std::string &name) const {
+    const auto it = syms.find(name);
+    if (it == syms.end())
+      error(-1, "Bug: Undeclared variable: " + name);
+    return it->second;
+  }
+
+  /// Returns the value holding the result of the expression.
+  std::string value_of(const expression &x) const {
+    return std::visit(
+        overloaded{
+            [&](const number_expression &x) { return std::to_string(x.value); },
+            [&](const boolean_expression &x) {
+              return std::string(x.value ? "true" : "false");
+            },
+            [&](const id_expression &x) {
+              const symbol &sym = lookup(x.name);
+              const std::string res = fresh_value();
+              ss << "  " << res << " = load " << llvm_type(sym.symbol_type)
+                 << ", ptr %var." << sym.name << '\n';
+              return res;
+            },
+            [&](const binop_expression &x) {
+              const type ty = infer_expression_type(syms, *x.left);
+              const std::string lhs = value_of(*x.left);
+              const std::string rhs = value_of(*x.right);
+              if (x.op == "/" || x.op == "%")
+                check_divisor(*x.right, rhs);
+              const std::string res = fresh_value();
+              ss << "  " << res << " = " << instruction_of(x.op) << ' '
+                 << llvm_type(ty) << ' ' << lhs << ", " << rhs << '\n';
+              return res;
+            },
+            [&](const not_expression &x) {
+              const std::string operand = value_of(*x.operand);
+              const std::string res = fresh_value();
+              ss << "  " << res << " = xor i1 " << operand << ", true\n";
+              return res;
+            }},
+        x);
+  }
+
+  /// Whether a division may trap, which needs the block of the trap.
+  bool may_divide_by_zero() const { return divides; }
+
+  /// udiv and urem are undefined for a zero divisor, so the optimizer could
+  /// assume it never happens. Like the div instruction of the native code,
+  /// a zero divisor traps instead, and the division continues in a block of
+  /// its own otherwise.
+  void check_divisor(const expression &divisor, std::string_view value) const {
+    if (const auto *number = std::get_if<number_expression>(&divisor);
+        number != nullptr && number->value != 0)
+      return;
+    divides = true;
+    const std::string zero = fresh_value();
+    const std::string label = "div.ok" + zero.substr(2);
+    ss << "  " << zero << " = icmp eq i32 " << value << ", 0\n";
+    ss << "  br i1 " << zero << ", label %div.by.zero, label %" << label
+       << '\n'
+       << label << ":\n";
+  }
+
+  static std::string_view instruction_of(std::string_view op) {
+    static const std::map<std::string_view, std::string_view> instructions{
+        {"+", "add"},       {"-", "sub"},        {"*", "mul"},
+        {"/", "udiv"},      {"%", "urem"},       {"<", "icmp ult"},
+        {">", "icmp ugt"},  {"<=", "icmp ule"},  {">=", "icmp uge"},
+        {"=", "icmp eq"},   {"and", "and"},      {"or", "or"}};
+    const auto it = instructions.find(op);
+    if (it == instructions.end())
+      error(-1, "Bug: Unsupported binary operator: " + std::string(op));
+    return it->second;
+  }
+
+  void store(const symbol &sym, std::string_view value) const {
+    ss << "  store " << llvm_type(sym.symbol_type) << ' ' << value
+       << ", ptr %var." << sym.name << '\n';
+  }
+
+  void operator()(const number_expression &x) const { value_of(x); }
+  void operator()(const boolean_expression &x) const { value_of(x); }
+  void operator()(const id_expression &x) const { value_of(x); }
+  void operator()(const binop_expression &x) const { value_of(x); }
+  void operator()(const not_expression &x) const { value_of(x); }
+
+  void operator()(const assign_statement &x) const {
+    store(lookup(x.left), value_of(*x.right));
+  }
+  void operator()(const read_statement &x) const {
+    const symbol &sym = lookup(x.id);
+    const std::string res = fresh_value();
+    if (sym.symbol_type == boolean) {
+      ss << "  " << res << " = call i8 @read_boolean()\n";
+      const std::string truth = fresh_value();
+      ss << "  " << truth << " = icmp ne i8 " << res << ", 0\n";
+      store(sym, truth);
+    } else {
+      ss << "  " << res << " = call i32 @read_natural()\n";
+      store(sym, res);
+    }
+  }
+  void operator()(const write_statement &x) const {
+    const std::string value = value_of(*x.value);
+    if (infer_expression_type(syms, *x.value) == boolean) {
+      const std::string widened = fresh_value();
+      ss << "  " << widened << " = zext i1 " << value << " to i8\n";
+      ss << "  call void @write_boolean(i8 " << widened << ")\n";
+    } else {
+      ss << "  call void @write_natural(i32 " << value << ")\n";
+    }
+  }
+  void operator()(const cassign &x) const {
+    const std::string condition = value_of(*x.condition);
+    const std::string res = fresh_value();
+    ss << "  " << res << " = select i1 " << condition << ", i32 "
+       << x.true_value << ", i32 " << x.false_value << '\n';
+    store(lookup(x.var.name), res);
+  }
+
+  // Control-flow:
+  void operator()(const selector &x) const {
+    const std::string condition = value_of(*x.condition);
+    ss << "  br i1 " << condition << ", label %" << block_label(x.true_branch)
+       << ", label %" << block_label(x.false_branch) << '\n';
+  }
+  void operator()(const jump &x) const {
+    ss << "  br label %" << block_label(x.target) << '\n';
+  }
+  void operator()(const switcher &x) const {
+    // No other value is ever assigned to the selector.
+    const std::string selected = value_of(x.var);
+    ss << "  switch i32 " << selected << ", label %unreachable [\n";
+    for (const basicblock *target : x.branches)
+      ss << "    i32 " << target->id << ", label %" << block_label(*target)
+         << '\n';
+    ss << "  ]\n";
+  }
+};
+} // namespace
+
+std::string llvm_codegen(const cfg &cfg, const symbols &syms) {
+  std::stringstream ss;
+  ss << "; ModuleID = 'wcomp'\n\n"
+        "declare void @write_natural(i32)\n"
+        "declare i32 @read_natural()\n"
+        "declare void @write_boolean(i8)\n"
+        "declare i8 @read_boolean()\n"
+        "declare void @llvm.trap()\n\n"
+        "define i32 @main() {\n"
+        "entry:\n";
+
+  // The variables start from zero, like in the bss.
+  for (const auto &[name, sym] : syms)
+    ss << "  %var." << sym.name << " = alloca " << llvm_type(sym.symbol_type)
+       << '\n';
+  for (const auto &[name, sym] : syms)
+    ss << "  store " << llvm_type(sym.symbol_type)
+       << (sym.symbol_type == boolean ? " false" : " 0") << ", ptr %var."
+       << sym.name << '\n';
+  ss << "  br label %" << block_label(*cfg.entry) << '\n';
+
+  ir_to_llvm emitter{syms, ss};
+  bool needs_unreachable = false;
+  for (const basicblock *bb : reachable_blocks(cfg)) {
+    ss << '\n' << block_label(*bb) << ":\n";
+    for (const ir_instruction &inst : bb->instructions) {
+      needs_unreachable |= std::holds_alternative<switcher>(inst);
+      std::visit(emitter, inst);
+    }
+    if (bb == cfg.exit)
+      ss << "  ret i32 0\n";
+  }
+
+  if (needs_unreachable)
+    ss << "\nunreachable:\n  unreachable\n";
+  if (emitter.may_divide_by_zero())
+    ss << "\ndiv.by.zero:\n  call void @llvm.trap()\n  unreachable\n";
+  ss << "}\n";
+  return ss.str();
+}
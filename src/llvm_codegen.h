@@ -0,0 +1,15 @@
+#ifndef LLVM_CODEGEN_H
+#define LLVM_CODEGEN_H
+
+#include "cfg.h"
+#include "expressions.h"
+
+#include <string>
+
+/// Translates the graph into textual LLVM IR: a single main function with an
+/// alloca for each variable and a block for each basic block, calling the
+/// same I/O routines as the assembly. The module has no target triple, so
+/// clang compiles it for its default target.
+std::string llvm_codegen(const cfg &cfg, const symbols &syms);
+
+#endif // LLVM_CODEGEN_H
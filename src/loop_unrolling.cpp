@@ -0,0 +1,557 @@
+#include "loop_unrolling.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <variant>
+#include <vector>
+
+namespace {
+using block_mapping = std::map<const basicblock *, basicblock *>;
+
+/// A loop moving a variable by a constant step in each iteration, until
+/// 'var op bound' no longer holds. The variable is assigned only in the latch,
+/// and the bound only depends on variables the loop does not assign.
+struct counting_loop {
+  const symbol *var;
+  std::string op;
+  const expression *bound;
+  bool increasing;
+  std::uint32_t step;
+  basicblock *latch;
+  basicblock *exit;
+};
+
+std::optional<unsigned> parse_number(std::string_view digits) {
+  unsigned value = 0;
+  const auto [end, ec] =
+      std::from_chars(digits.data(), digits.data() + digits.size(), value);
+  if (ec != std::errc{} || end != digits.data() + digits.size() ||
+      digits.empty())
+    return std::nullopt;
+  return value;
+}
+
+double frequency(const block_frequencies &freqs, const basicblock *bb) {
+  const auto it = freqs.find(bb);
+  return it == freqs.end() ? 1 : it->second;
+}
+
+std::unique_ptr<expression> clone(const std::unique_ptr<expression> &x) {
+  return std::make_unique<expression>(*x);
+}
+
+/// Copies the instruction, redirecting its jumps according to the mapping.
+ir_instruction copy_instruction(const ir_instruction &inst,
+                                const block_mapping &mapping) {
+  const auto target = [&mapping](basicblock &bb) -> basicblock & {
+    const auto it = mapping.find(&bb);
+    return it == mapping.end() ? bb : *it->second;
+  };
+  return std::visit(
+      overloaded{[&](const auto &x) -> ir_instruction { return x; },
+                 [&](const assign_statement &x) -> ir_instruction {
+                   return assign_statement{x.get_line(), x.left,
+                                           clone(x.right)};
+                 },
+                 [&](const write_statement &x) -> ir_instruction {
+                   return write_statement{x.get_line(), clone(x.value)};
+                 },
+                 [&](const selector &x) -> ir_instruction {
+                   return selector{clone(x.condition), target(x.true_branch),
+                                   target(x.false_branch)};
+                 },
+                 [&](const jump &x) -> ir_instruction {
+                   return jump{target(x.target)};
+                 },
+                 [&](const switcher &x) -> ir_instruction {
+                   switcher res{x.var, {}};
+                   for (basicblock *branch : x.branches)
+                     res.branches.push_back(&target(*branch));
+                   return res;
+                 },
+                 [&](const cassign &x) -> ir_instruction {
+                   return cassign{x.var, clone(x.condition), x.true_value,
+                                  x.false_value};
+                 }},
+      inst);
+}
+
+/// Copies the blocks, the edges between them lead to the copies.
+block_mapping copy_blocks(cfg &graph, const std::vector<basicblock *> &blocks) {
+  block_mapping mapping;
+  for (const basicblock *bb : blocks)
+    mapping.emplace(bb, graph.create_bb());
+  for (const basicblock *bb : blocks)
+    for (const ir_instruction &inst : bb->instructions)
+      mapping.at(bb)->add_ir_instruction(copy_instruction(inst, mapping));
+  return mapping;
+}
+
+void replace_terminator(basicblock &bb, ir_instruction terminator) {
+  bb.pop_last_ir_instruction();
+  bb.add_ir_instruction(std::move(terminator));
+}
+
+/// Makes the edges of the block leading to 'from' lead to 'to' instead.
+void redirect(basicblock &bb, const basicblock &from, basicblock &to) {
+  const block_mapping mapping{{&from, &to}};
+  replace_terminator(bb, copy_instruction(bb.instructions.back(), mapping));
+}
+
+/// Collects the variables the instruction assigns.
+void assigned_variables(const ir_instruction &inst,
+                        std::set<std::string> &vars) {
+  std::visit(overloaded{[&](const auto &) {},
+                        [&](const assign_statement &x) { vars.insert(x.left); },
+                        [&](const read_statement &x) { vars.insert(x.id); },
+                        [&](const cassign &x) { vars.insert(x.var.name); }},
+             inst);
+}
+
+bool uses_any(const expression &x, const std::set<std::string> &vars) {
+  return std::visit(
+      overloaded{[&](const auto &) { return false; },
+                 [&](const id_expression &x) {
+                   return vars.count(x.name) != 0;
+                 },
+                 [&](const binop_expression &x) {
+                   return uses_any(*x.left, vars) || uses_any(*x.right, vars);
+                 },
+                 [&](const not_expression &x) {
+                   return uses_any(*x.operand, vars);
+                 }},
+      x);
+}
+
+const std::string *variable_name(const expression &x) {
+  const auto *id = std::get_if<id_expression>(&x);
+  return id != nullptr ? &id->name : nullptr;
+}
+
+std::optional<std::uint32_t> constant_value(const expression &x) {
+  const auto *number = std::get_if<number_expression>(&x);
+  if (number == nullptr)
+    return std::nullopt;
+  return number->value;
+}
+
+/// Recognizes 'var := var + step', 'var := step + var' and 'var := var - step'
+/// and returns whether the variable increases, along with the step.
+std::optional<std::pair<bool, std::uint32_t>>
+induction_step(const assign_statement &x) {
+  const auto *op = std::get_if<binop_expression>(x.right.get());
+  if (op == nullptr || (op->op != "+" && op->op != "-"))
+    return std::nullopt;
+  const std::string *lhs = variable_name(*op->left);
+  const std::string *rhs = variable_name(*op->right);
+  std::optional<std::uint32_t> step;
+  if (lhs != nullptr && *lhs == x.left)
+    step = constant_value(*op->right);
+  else if (op->op == "+" && rhs != nullptr && *rhs == x.left)
+    step = constant_value(*op->left);
+  if (!step.has_value() || *step == 0)
+    return std::nullopt;
+  return std::pair{op->op == "+", *step};
+}
+
+std::string flipped(const std::string &op) {
+  if (op == "<")
+    return ">";
+  if (op == ">")
+    return "<";
+  if (op == "<=")
+    return ">=";
+  return "<=";
+}
+
+std::optional<counting_loop>
+find_counting_loop(const symbols &syms, const std::vector<basicblock *> &body,
+                   const basicblock &header) {
+  std::vector<basicblock *> latches;
+  for (basicblock *bb : body) {
+    const std::vector<basicblock *> succs = successors(*bb);
+    if (std::find(succs.begin(), succs.end(), &header) != succs.end())
+      latches.push_back(bb);
+  }
+  if (latches.size() != 1)
+    return std::nullopt;
+  basicblock &latch = *latches.front();
+  const auto *exit_check = std::get_if<selector>(&latch.instructions.back());
+  if (exit_check == nullptr || &exit_check->true_branch != &header ||
+      std::find(body.begin(), body.end(), &exit_check->false_branch) !=
+          body.end())
+    return std::nullopt;
+
+  const auto *condition =
+      std::get_if<binop_expression>(exit_check->condition.get());
+  if (condition == nullptr ||
+      (condition->op != "<" && condition->op != "<=" && condition->op != ">" &&
+       condition->op != ">="))
+    return std::nullopt;
+
+  std::set<std::string> assigned;
+  for (const basicblock *bb : body)
+    for (const ir_instruction &inst : bb->instructions)
+      assigned_variables(inst, assigned);
+
+  // Either side of the comparison might be the counter.
+  const std::pair<const expression *, const expression *> sides[] = {
+      {condition->left.get(), condition->right.get()},
+      {condition->right.get(), condition->left.get()}};
+  for (const auto &[counter, bound] : sides) {
+    const std::string *name = variable_name(*counter);
+    if (name == nullptr || syms.at(*name).symbol_type != natural)
+      continue;
+    const std::string op = counter == condition->left.get()
+                               ? condition->op
+                               : flipped(condition->op);
+
+    // The only assignment of the counter must step it in the latch.
+    const assign_statement *update = nullptr;
+    unsigned assignments = 0;
+    for (const basicblock *bb : body) {
+      for (const ir_instruction &inst : bb->instructions) {
+        std::set<std::string> vars;
+        assigned_variables(inst, vars);
+        if (vars.count(*name) == 0)
+          continue;
+        ++assignments;
+        if (bb == &latch)
+          update = std::get_if<assign_statement>(&inst);
+      }
+    }
+    if (assignments != 1 || update == nullptr || uses_any(*bound, assigned))
+      continue;
+    const auto step = induction_step(*update);
+    if (!step.has_value())
+      continue;
+    const auto [increasing, amount] = *step;
+    if (increasing != (op == "<" || op == "<="))
+      continue;
+    return counting_loop{&syms.at(*name),   op,     bound,
+                         increasing,        amount, &latch,
+                         &exit_check->false_branch};
+  }
+  return std::nullopt;
+}
+
+std::vector<basicblock *> predecessors_outside(const cfg &graph,
+                                               const basicblock &header,
+                                               const loop &l) {
+  std::vector<basicblock *> res;
+  for (const auto &bb : graph.blocks) {
+    if (l.blocks.count(bb.get()) != 0 || bb->instructions.empty())
+      continue;
+    const std::vector<basicblock *> succs = successors(*bb);
+    if (std::find(succs.begin(), succs.end(), &header) != succs.end())
+      res.push_back(bb.get());
+  }
+  return res;
+}
+
+/// Returns how many times the body of the loop runs if the counter is set to
+/// a constant right before entering it and the bound is a constant too.
+std::optional<unsigned> trip_count(const counting_loop &c,
+                                   const std::vector<basicblock *> &entries,
+                                   unsigned max_trip_count) {
+  const std::optional<std::uint32_t> bound = constant_value(*c.bound);
+  if (entries.size() != 1 || !bound.has_value())
+    return std::nullopt;
+
+  const auto &instructions = entries.front()->instructions;
+  std::optional<std::uint32_t> value;
+  for (auto it = instructions.rbegin(); it != instructions.rend(); ++it) {
+    std::set<std::string> vars;
+    assigned_variables(*it, vars);
+    if (vars.count(c.var->name) == 0)
+      continue;
+    if (const auto *init = std::get_if<assign_statement>(&*it))
+      value = constant_value(*init->right);
+    break;
+  }
+  if (!value.has_value())
+    return std::nullopt;
+
+  const auto holds = [&](std::uint32_t v) {
+    if (c.op == "<")
+      return v < *bound;
+    if (c.op == "<=")
+      return v <= *bound;
+    if (c.op == ">")
+      return v > *bound;
+    return v >= *bound;
+  };
+  for (unsigned trips = 1; trips <= max_trip_count; ++trips) {
+    *value = c.increasing ? *value + c.step : *value - c.step;
+    if (!holds(*value))
+      return trips;
+  }
+  return std::nullopt;
+}
+
+/// Builds the condition of at least 'distance' more steps being left before
+/// the loop condition fails, which implies the loop condition itself.
+/// Returns nullptr if that never holds.
+std::unique_ptr<expression> steps_left(const counting_loop &c,
+                                       std::uint32_t distance) {
+  const int line = c.var->line;
+  if (const std::optional<std::uint32_t> bound = constant_value(*c.bound)) {
+    // Shift the constant bound, unless it overflows.
+    const std::uint64_t shifted = c.increasing
+                                      ? std::uint64_t{*bound} - distance
+                                      : std::uint64_t{*bound} + distance;
+    if (shifted > UINT32_MAX)
+      return nullptr;
+    return std::make_unique<expression>(binop_expression{
+        line, c.op,
+        std::make_unique<expression>(id_expression{line, c.var->name}),
+        std::make_unique<expression>(
+            number_expression{static_cast<unsigned>(shifted)})});
+  }
+
+  const auto var = [&] {
+    return std::make_unique<expression>(id_expression{line, c.var->name});
+  };
+  const auto bound = [&] { return std::make_unique<expression>(*c.bound); };
+  const auto binop = [line](std::string op, std::unique_ptr<expression> lhs,
+                            std::unique_ptr<expression> rhs) {
+    return std::make_unique<expression>(
+        binop_expression{line, std::move(op), std::move(lhs), std::move(rhs)});
+  };
+
+  // The difference is only meaningful if the loop condition holds.
+  auto span = c.increasing ? binop("-", bound(), var())
+                           : binop("-", var(), bound());
+  const bool strict = c.op == "<" || c.op == ">";
+  auto enough = std::make_unique<expression>(number_expression{distance});
+  return binop("and", binop(c.op, var(), bound()),
+               binop(strict ? ">" : ">=", std::move(span), std::move(enough)));
+}
+
+class loop_unroller {
+  const symbols &syms;
+  cfg &graph;
+  const unroll_policy &policy;
+  block_frequencies &freqs;
+  unsigned remaining_budget;
+
+  std::vector<basicblock *> body;
+  basicblock *header = nullptr;
+  std::vector<block_mapping> copies;
+
+  /// The block in the given copy of the body, the 0th being the original.
+  basicblock &in_copy(std::size_t copy, basicblock &bb) const {
+    return copy == 0 ? bb : *copies[copy - 1].at(&bb);
+  }
+
+  void make_copies(unsigned count) {
+    copies.clear();
+    for (unsigned i = 1; i < count; ++i)
+      copies.push_back(copy_blocks(graph, body));
+  }
+
+  /// Divides the executions of the loop among the copies.
+  void distribute_frequencies(unsigned count) {
+    for (basicblock *bb : body) {
+      const double share = frequency(freqs, bb) / count;
+      for (std::size_t i = 0; i != count; ++i)
+        freqs[&in_copy(i, *bb)] = share;
+    }
+  }
+
+  void unroll_completely(const counting_loop &c, unsigned trips) {
+    make_copies(trips);
+    for (std::size_t i = 0; i != trips; ++i) {
+      basicblock &next = i + 1 == trips ? *c.exit : in_copy(i + 1, *header);
+      replace_terminator(in_copy(i, *c.latch), jump{next});
+    }
+    distribute_frequencies(trips);
+  }
+
+  /// The copies run while at least factor iterations are left, the original
+  /// loop runs the rest.
+  void unroll_counting(const counting_loop &c, unsigned factor,
+                       std::unique_ptr<expression> enough_left,
+                       const std::vector<basicblock *> &entries) {
+    const auto &exit_check = std::get<selector>(c.latch->instructions.back());
+
+    basicblock &remainder = *graph.create_bb();
+    remainder.add_ir_instruction(
+        selector{clone(exit_check.condition), *header, *c.exit});
+    basicblock &preheader = *graph.create_bb();
+
+    make_copies(factor + 1);
+    // The original loop is left as is, the copies are numbered from one.
+    for (std::size_t i = 1; i != factor; ++i)
+      replace_terminator(in_copy(i, *c.latch), jump{in_copy(i + 1, *header)});
+    replace_terminator(in_copy(factor, *c.latch),
+                       selector{clone(enough_left), in_copy(1, *header),
+                                remainder});
+
+    preheader.add_ir_instruction(
+        selector{std::move(enough_left), in_copy(1, *header), *header});
+    for (basicblock *entry : entries)
+      redirect(*entry, *header, preheader);
+    if (graph.entry == header)
+      graph.entry = &preheader;
+
+    const double entered = frequency(freqs, header) / factor;
+    distribute_frequencies(factor + 1);
+    freqs[&preheader] = entered;
+    freqs[&remainder] = entered;
+  }
+
+  /// Every copy of the body keeps its exit checks.
+  void unroll_generic(unsigned factor) {
+    std::vector<basicblock *> latches;
+    for (basicblock *bb : body) {
+      const std::vector<basicblock *> succs = successors(*bb);
+      if (std::find(succs.begin(), succs.end(), header) != succs.end())
+        latches.push_back(bb);
+    }
+
+    make_copies(factor);
+    for (std::size_t i = 0; i != factor; ++i)
+      for (basicblock *latch : latches)
+        redirect(in_copy(i, *latch), in_copy(i, *header),
+                 in_copy((i + 1) % factor, *header));
+    distribute_frequencies(factor);
+  }
+
+public:
+  loop_unroller(const symbols &syms, cfg &graph, const unroll_policy &policy,
+                block_frequencies &freqs)
+      : syms{syms}, graph{graph}, policy{policy}, freqs{freqs},
+        remaining_budget{policy.budget} {}
+
+  bool unroll(const loop &l) {
+    body.clear();
+    header = nullptr;
+    std::size_t size = 0;
+    for (const auto &bb : graph.blocks) {
+      if (l.blocks.count(bb.get()) == 0)
+        continue;
+      body.push_back(bb.get());
+      size += bb->instructions.size();
+      if (bb.get() == l.header)
+        header = bb.get();
+      // The ids of the dispatched blocks are stored in variables.
+      for (const ir_instruction &inst : bb->instructions)
+        if (std::holds_alternative<switcher>(inst) ||
+            std::holds_alternative<cassign>(inst))
+          return false;
+    }
+    if (header == nullptr || size == 0)
+      return false;
+
+    const std::vector<basicblock *> entries =
+        predecessors_outside(graph, *header, l);
+    const std::optional<counting_loop> counting =
+        find_counting_loop(syms, body, *header);
+
+    if (counting.has_value()) {
+      const std::optional<unsigned> trips =
+          trip_count(*counting, entries, policy.max_trip_count);
+      if (trips.has_value() && (*trips - 1) * size <= remaining_budget) {
+        unroll_completely(*counting, *trips);
+        remaining_budget -= (*trips - 1) * size;
+        return true;
+      }
+
+      // Each copy of the body and the two checks before and after them.
+      const std::size_t fits =
+          remaining_budget < 2 ? 0 : (remaining_budget - 2) / size;
+      const unsigned factor =
+          static_cast<unsigned>(std::min<std::size_t>(policy.factor, fits));
+      const std::uint64_t distance =
+          factor < 2 ? 0 : std::uint64_t{counting->step} * (factor - 1);
+      std::unique_ptr<expression> enough_left =
+          factor < 2 || distance > UINT32_MAX
+              ? nullptr
+              : steps_left(*counting, static_cast<std::uint32_t>(distance));
+      if (enough_left != nullptr) {
+        unroll_counting(*counting, factor, std::move(enough_left), entries);
+        remaining_budget -= static_cast<unsigned>(factor * size + 2);
+        return true;
+      }
+    }
+
+    const unsigned factor = static_cast<unsigned>(
+        std::min<std::size_t>(policy.factor, remaining_budget / size + 1));
+    if (factor < 2)
+      return false;
+    unroll_generic(factor);
+    remaining_budget -= static_cast<unsigned>((factor - 1) * size);
+    return true;
+  }
+};
+} // namespace
+
+std::optional<unroll_policy> parse_unroll_policy(std::string_view spec) {
+  const std::pair<std::string_view, unsigned unroll_policy::*> fields[] = {
+      {"factor:", &unroll_policy::factor},
+      {"budget:", &unroll_policy::budget},
+      {"full:", &unroll_policy::max_trip_count}};
+  unroll_policy policy;
+
+  while (!spec.empty()) {
+    const auto comma = spec.find(',');
+    const std::string_view item = spec.substr(0, comma);
+    spec = comma == std::string_view::npos ? "" : spec.substr(comma + 1);
+
+    const auto field =
+        std::find_if(std::begin(fields), std::end(fields), [item](auto &f) {
+          return item.substr(0, f.first.size()) == f.first;
+        });
+    if (field == std::end(fields))
+      return std::nullopt;
+    const std::optional<unsigned> value =
+        parse_number(item.substr(field->first.size()));
+    if (!value.has_value())
+      return std::nullopt;
+    policy.*(field->second) = *value;
+  }
+  if (policy.factor == 0)
+    return std::nullopt;
+  return policy;
+}
+
+std::string format_unroll_policy(const unroll_policy &policy) {
+  const unroll_policy defaults;
+  std::string res = "factor:" + std::to_string(policy.factor);
+  if (policy.budget != defaults.budget)
+    res += ",budget:" + std::to_string(policy.budget);
+  if (policy.max_trip_count != defaults.max_trip_count)
+    res += ",full:" + std::to_string(policy.max_trip_count);
+  return res;
+}
+
+bool unroll_loops(const symbols &syms, cfg &graph, const unroll_policy &policy,
+                  const loop_info &loops, block_frequencies &freqs) {
+  std::set<const loop *> outer;
+  for (const auto &l : loops.loops())
+    if (l->parent != nullptr)
+      outer.insert(l->parent);
+
+  std::vector<const loop *> innermost;
+  for (const auto &l : loops.loops())
+    if (outer.count(l.get()) == 0)
+      innermost.push_back(l.get());
+  std::stable_sort(innermost.begin(), innermost.end(),
+                   [&freqs](const loop *lhs, const loop *rhs) {
+                     return frequency(freqs, lhs->header) >
+                            frequency(freqs, rhs->header);
+                   });
+
+  loop_unroller unroller{syms, graph, policy, freqs};
+  bool changed = false;
+  for (const loop *l : innermost)
+    changed |= unroller.unroll(*l);
+  return changed;
+}
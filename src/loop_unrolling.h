@@ -0,0 +1,40 @@
+#ifndef LOOP_UNROLLING_H
+#define LOOP_UNROLLING_H
+
+#include "cfg.h"
+#include "cfg_analysis.h"
+#include "expressions.h"
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+struct unroll_policy {
+  /// Copies of the body in an unrolled loop.
+  unsigned factor = 4;
+  /// Instructions the unrolling may add to the whole program.
+  unsigned budget = 2000;
+  /// Loops iterating at most this many times are unrolled completely.
+  unsigned max_trip_count = 16;
+};
+
+/// Parses a comma separated list of 'factor:<n>', 'budget:<instructions>' and
+/// 'full:<trip count>'.
+std::optional<unroll_policy> parse_unroll_policy(std::string_view spec);
+
+/// The spec parse_unroll_policy reads back into the policy. The budget and
+/// the trip count are left out if they are the default ones.
+std::string format_unroll_policy(const unroll_policy &policy);
+
+/// Unrolls the innermost loops, the hottest first, as long as the budget
+/// lasts. A loop iterating a known number of times is unrolled completely.
+/// A loop counting a variable up or down to an invariant bound is unrolled
+/// into a loop checking once per factor iterations whether enough are left,
+/// and falls back to the original loop for the remaining ones. Any other
+/// loop keeps its exit check in each copy of its body.
+/// The frequencies of the copies are added to the freqs.
+/// Returns whether the graph changed.
+bool unroll_loops(const symbols &syms, cfg &graph, const unroll_policy &policy,
+                  const loop_info &loops, block_frequencies &freqs);
+
+#endif // LOOP_UNROLLING_H
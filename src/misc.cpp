@@ -9,10 +9,24 @@
 #include <sstream>
 #include <string_view>
 
-#include <FlexLexer.h>
+int depth_of(const expression &expr) noexcept {
+  return std::visit(overloaded{[](const binop_expression &x) { return x.depth; },
+                               [](const not_expression &x) { return x.depth; },
+                               [](const auto &) { return 1; }},
+                    expr);
+}
+
+binop_expression::binop_expression(int line, std::string op,
+                                   std::unique_ptr<expression> left,
+                                   std::unique_ptr<expression> right)
+    : line(line), op(std::move(op)), left(std::move(left)),
+      right(std::move(right)) {
+  if (this->left && this->right)
+    depth = std::max(depth_of(*this->left), depth_of(*this->right)) + 1;
+}
 
 binop_expression::binop_expression(const binop_expression &other)
-    : line{other.line}, op{other.op} {
+    : line{other.line}, op{other.op}, depth{other.depth} {
   if (other.left.get() != nullptr) {
     auto subexpr_clone = std::make_unique<expression>(*other.left);
     left = std::move(subexpr_clone);
@@ -26,13 +40,21 @@ binop_expression::binop_expression(const binop_expression &other)
 binop_expression &binop_expression::operator=(const binop_expression &other) {
   line = other.line;
   op = other.op;
+  depth = other.depth;
   left = std::make_unique<expression>(*other.left);
   right = std::make_unique<expression>(*other.right);
   return *this;
 }
 
+not_expression::not_expression(int line, std::string op,
+                               std::unique_ptr<expression> operand)
+    : line(line), op(std::move(op)), operand(std::move(operand)) {
+  if (this->operand)
+    depth = depth_of(*this->operand) + 1;
+}
+
 not_expression::not_expression(const not_expression &other)
-    : line{other.line}, op{other.op} {
+    : line{other.line}, op{other.op}, depth{other.depth} {
   if (other.operand.get() != nullptr) {
     auto subexpr_clone = std::make_unique<expression>(*other.operand);
     operand = std::move(subexpr_clone);
@@ -42,6 +64,7 @@ not_expression::not_expression(const not_expression &other)
 not_expression &not_expression::operator=(const not_expression &other) {
   line = other.line;
   op = other.op;
+  depth = other.depth;
   operand = std::make_unique<expression>(*other.operand);
   return *this;
 }
@@ -49,8 +72,7 @@ not_expression &not_expression::operator=(const not_expression &other) {
 void unreachable() { assert(false && "Unreachable!"); }
 
 void error(int line, const std::string_view &msg) {
-  std::cerr << "Line " << line << ": Error: " << msg << '\n';
-  std::exit(1);
+  throw compile_error{line, std::string{msg}};
 }
 
 std::ostream &repeat(std::ostream &os, char input, size_t num) {
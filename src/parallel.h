@@ -0,0 +1,41 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <thread>
+#include <vector>
+
+/// Calls f with each index of [0, count), on as many threads as the hardware
+/// supports but at most one for each index, and waits for them. A single
+/// thread is the calling one. The exception thrown for the lowest index, if
+/// any, is rethrown once every call is done.
+template <typename F> void parallel_for(std::size_t count, F f) {
+  std::vector<std::exception_ptr> failures(count);
+  std::atomic<std::size_t> next{0};
+  const auto work = [&] {
+    for (std::size_t i = next++; i < count; i = next++) {
+      try {
+        f(i);
+      } catch (...) {
+        failures[i] = std::current_exception();
+      }
+    }
+  };
+  const std::size_t thread_count = std::min<std::size_t>(
+      count, std::max(1u, std::thread::hardware_concurrency()));
+  if (thread_count <= 1) {
+    work();
+  } else {
+    std::vector<std::jthread> workers;
+    for (std::size_t i = 0; i < thread_count; ++i)
+      workers.emplace_back(work);
+  }
+  for (const std::exception_ptr &failure : failures)
+    if (failure)
+      std::rethrow_exception(failure);
+}
+
+#endif // PARALLEL_H
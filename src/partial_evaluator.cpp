@@ -0,0 +1,235 @@
+#include "partial_evaluator.h"
+#include "typecheck.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <variant>
+#include <vector>
+
+namespace {
+/// The booleans are held as 0 and 1.
+using value = unsigned;
+
+struct written_value {
+  int line;
+  type value_type;
+  value written;
+};
+
+class evaluator {
+  const symbols &syms;
+  std::map<std::string, value> variables;
+
+public:
+  std::vector<written_value> output;
+  basicblock *block;
+  std::size_t position = 0;
+
+  evaluator(const symbols &syms, basicblock &entry)
+      : syms{syms}, block{&entry} {
+    for (const auto &[name, sym] : syms)
+      variables.emplace(name, 0);
+  }
+
+  const std::map<std::string, value> &state() const { return variables; }
+
+  /// Returns the value of the expression, if it has one.
+  std::optional<value> eval(const expression &x) const {
+    return std::visit(
+        overloaded{
+            [&](const number_expression &x) -> std::optional<value> {
+              return x.value;
+            },
+            [&](const boolean_expression &x) -> std::optional<value> {
+              return x.value;
+            },
+            [&](const id_expression &x) -> std::optional<value> {
+              return variables.at(x.name);
+            },
+            [&](const binop_expression &x) -> std::optional<value> {
+              const std::optional<value> lhs = eval(*x.left);
+              const std::optional<value> rhs = eval(*x.right);
+              if (!lhs || !rhs)
+                return std::nullopt;
+              return apply(x.op, *lhs, *rhs);
+            },
+            [&](const not_expression &x) -> std::optional<value> {
+              const std::optional<value> operand = eval(*x.operand);
+              if (!operand)
+                return std::nullopt;
+              return *operand == 0;
+            }},
+        x);
+  }
+
+  static std::optional<value> apply(const std::string &op, value lhs,
+                                    value rhs) {
+    if (op == "+")
+      return lhs + rhs;
+    if (op == "-")
+      return lhs - rhs;
+    if (op == "*")
+      return lhs * rhs;
+    // Dividing by zero traps at runtime, which is left for the runtime.
+    if (op == "/")
+      return rhs == 0 ? std::nullopt : std::optional<value>{lhs / rhs};
+    if (op == "%")
+      return rhs == 0 ? std::nullopt : std::optional<value>{lhs % rhs};
+    if (op == "<")
+      return lhs < rhs;
+    if (op == ">")
+      return lhs > rhs;
+    if (op == "<=")
+      return lhs <= rhs;
+    if (op == ">=")
+      return lhs >= rhs;
+    if (op == "=")
+      return lhs == rhs;
+    if (op == "and")
+      return lhs && rhs;
+    if (op == "or")
+      return lhs || rhs;
+    error(-1, "Bug: Unsupported binary operator: " + op);
+  }
+
+  void branch_to(basicblock &target) {
+    block = &target;
+    position = 0;
+  }
+
+  /// Executes the next instruction. Returns false, without any effect, if it
+  /// can not be executed at compile time.
+  bool step() {
+    const ir_instruction &inst = block->instructions[position];
+    const auto next = [&] {
+      ++position;
+      return true;
+    };
+    return std::visit(
+        overloaded{
+            [&](const auto &x) {
+              // The bare expressions have no effect unless they trap.
+              return eval(x) ? next() : false;
+            },
+            [&](const assign_statement &x) {
+              const std::optional<value> v = eval(*x.right);
+              if (!v)
+                return false;
+              variables.at(x.left) = *v;
+              return next();
+            },
+            [&](const read_statement &) { return false; },
+            [&](const write_statement &x) {
+              const std::optional<value> v = eval(*x.value);
+              if (!v)
+                return false;
+              output.push_back(written_value{
+                  x.get_line(), infer_expression_type(syms, *x.value), *v});
+              return next();
+            },
+            [&](const selector &x) {
+              const std::optional<value> condition = eval(*x.condition);
+              if (!condition)
+                return false;
+              branch_to(*condition ? x.true_branch : x.false_branch);
+              return true;
+            },
+            [&](const jump &x) {
+              branch_to(x.target);
+              return true;
+            },
+            [&](const switcher &x) {
+              const value id = variables.at(x.var.name);
+              const auto target = std::find_if(
+                  x.branches.begin(), x.branches.end(),
+                  [id](const basicblock *bb) { return bb->id == id; });
+              if (target == x.branches.end())
+                return false;
+              branch_to(**target);
+              return true;
+            },
+            [&](const cassign &x) {
+              const std::optional<value> condition = eval(*x.condition);
+              if (!condition)
+                return false;
+              variables.at(x.var.name) = static_cast<value>(
+                  *condition ? x.true_value : x.false_value);
+              return next();
+            }},
+        inst);
+  }
+};
+
+std::unique_ptr<expression> constant(type ty, value v) {
+  if (ty == boolean)
+    return std::make_unique<expression>(boolean_expression{v != 0});
+  return std::make_unique<expression>(number_expression{v});
+}
+
+/// Moves the instructions from the position onwards into a new block, which
+/// the block then jumps to.
+basicblock &split_block(cfg &graph, basicblock &bb, std::size_t position) {
+  basicblock &rest = *graph.create_bb();
+  std::vector<ir_instruction> tail;
+  while (bb.instructions.size() > position)
+    tail.push_back(bb.pop_last_ir_instruction());
+  for (auto it = tail.rbegin(); it != tail.rend(); ++it)
+    rest.add_ir_instruction(std::move(*it));
+  bb.add_ir_instruction(jump{rest});
+  if (graph.exit == &bb)
+    graph.exit = &rest;
+  return rest;
+}
+} // namespace
+
+bool partially_evaluate(const symbols &syms, cfg &graph, std::size_t fuel) {
+  evaluator state{syms, *graph.entry};
+  std::size_t executed = 0;
+  bool finished = false;
+  bool reached_read = false;
+  for (; executed != fuel; ++executed) {
+    if (state.position == state.block->instructions.size()) {
+      finished = state.block == graph.exit;
+      break;
+    }
+    if (state.output.size() > max_prefix_instructions)
+      return false;
+    if (!state.step()) {
+      // Nothing else depends on the input before the first read.
+      reached_read = std::holds_alternative<read_statement>(
+          state.block->instructions[state.position]);
+      break;
+    }
+  }
+  if (executed == 0 || !(finished || reached_read))
+    return false;
+
+  std::vector<assign_statement> assignments;
+  // Nothing reads the variables once the program is done.
+  if (!finished) {
+    for (const auto &[name, v] : state.state()) {
+      if (v == 0)
+        continue;
+      const symbol &sym = syms.at(name);
+      assignments.push_back(
+          assign_statement{sym.line, name, constant(sym.symbol_type, v)});
+    }
+  }
+  if (state.output.size() + assignments.size() > max_prefix_instructions)
+    return false;
+
+  basicblock &rest = split_block(graph, *state.block, state.position);
+  basicblock &prefix = *graph.create_bb();
+  for (const written_value &w : state.output)
+    prefix.add_ir_instruction(
+        write_statement{w.line, constant(w.value_type, w.written)});
+  for (assign_statement &x : assignments)
+    prefix.add_ir_instruction(std::move(x));
+  prefix.add_ir_instruction(jump{rest});
+  graph.entry = &prefix;
+  return true;
+}
@@ -0,0 +1,25 @@
+#ifndef PARTIAL_EVALUATOR_H
+#define PARTIAL_EVALUATOR_H
+
+#include "cfg.h"
+#include "expressions.h"
+
+#include <cstddef>
+
+/// The most writes and assignments the evaluated prefix may be replaced by.
+constexpr std::size_t max_prefix_instructions = 256;
+
+/// Executes the program at compile time from its entry, for at most `fuel`
+/// instructions, until the first read. If the execution got there, or to the
+/// end of the program, the executed prefix is replaced by a new entry block
+/// writing the constants it printed and assigning the variables it left
+/// non-zero, which then continues where the execution stopped. A program that
+/// never reads is left with its writes alone. The graph is left as it was if
+/// the fuel ran out, the execution hit a division by zero, or the new block
+/// would exceed max_prefix_instructions, as a loop running on past the fuel
+/// would only be copied into straight-line code. The blocks of the prefix are
+/// left for simplify_cfg to remove.
+/// Returns whether the graph changed.
+bool partially_evaluate(const symbols &syms, cfg &graph, std::size_t fuel);
+
+#endif // PARTIAL_EVALUATOR_H
@@ -0,0 +1,198 @@
+#include "passes.h"
+#include "cfg_analysis.h"
+#include "utility.h"
+
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <set>
+#include <sstream>
+#include <variant>
+
+namespace {
+constexpr pass_kind all_passes[] = {
+    pass_kind::simplify, pass_kind::partial_eval, pass_kind::unroll,
+    pass_kind::remap,    pass_kind::flatten,      pass_kind::cse};
+
+class cfg_verifier {
+  const symbols &syms;
+  const cfg &graph;
+  std::string_view after;
+  std::set<const basicblock *> blocks;
+  std::set<bb_idx> ids;
+
+public:
+  cfg_verifier(const symbols &syms, const cfg &graph, std::string_view after)
+      : syms{syms}, graph{graph}, after{after} {}
+
+  void run() {
+    for (const auto &bb : graph.blocks) {
+      blocks.insert(bb.get());
+      if (!ids.insert(bb->id).second)
+        fail(*bb, "is not the only block with its id");
+      if (bb->id >= graph.next_bb_idx)
+        fail(*bb, "has an id the graph may assign again");
+    }
+    if (blocks.count(graph.entry) == 0)
+      fail("the entry is not a block of the graph");
+    if (blocks.count(graph.exit) == 0)
+      fail("the exit is not a block of the graph");
+
+    for (const auto &bb : graph.blocks)
+      for (std::size_t i = 0; i < bb->instructions.size(); ++i)
+        check(*bb, bb->instructions[i], i + 1 == bb->instructions.size());
+
+    for (const basicblock *bb : reachable_blocks(graph))
+      if (bb != graph.exit && successors(*bb).empty())
+        fail(*bb, "ends the program, but it is not the exit");
+  }
+
+private:
+  [[noreturn]] void fail(const std::string &msg) const {
+    std::stringstream ss;
+    ss << "Invalid control-flow graph after the " << after << " pass: " << msg
+       << '.';
+    error(-1, ss.str());
+  }
+
+  [[noreturn]] void fail(const basicblock &bb, const std::string &msg) const {
+    fail("bb_" + std::to_string(bb.id) + ' ' + msg);
+  }
+
+  void check_variable(const basicblock &bb, const std::string &name) const {
+    if (syms.count(name) == 0)
+      fail(bb, "uses the undeclared " + name);
+  }
+
+  void check_target(const basicblock &bb, const basicblock &target) const {
+    if (blocks.count(&target) == 0)
+      fail(bb, "jumps to a removed block");
+  }
+
+  void check_value(const basicblock &bb, bb_idx value) const {
+    if (ids.count(value) == 0)
+      fail(bb, "selects the missing bb_" + std::to_string(value));
+  }
+
+  void check(const basicblock &bb, const expression &x) const {
+    std::visit(overloaded{[&](const id_expression &x) {
+                            check_variable(bb, x.name);
+                          },
+                          [&](const binop_expression &x) {
+                            check(bb, *x.left);
+                            check(bb, *x.right);
+                          },
+                          [&](const not_expression &x) {
+                            check(bb, *x.operand);
+                          },
+                          [](const auto &) {}},
+               x);
+  }
+
+  void check(const basicblock &bb, const ir_instruction &inst,
+             bool last) const {
+    const bool control_flow = std::holds_alternative<selector>(inst) ||
+                              std::holds_alternative<jump>(inst) ||
+                              std::holds_alternative<switcher>(inst);
+    if (control_flow && !last)
+      fail(bb, "continues after a control-flow instruction");
+    std::visit(overloaded{[&](const assign_statement &x) {
+                            check_variable(bb, x.left);
+                            check(bb, *x.right);
+                          },
+                          [&](const read_statement &x) {
+                            check_variable(bb, x.id);
+                          },
+                          [&](const write_statement &x) {
+                            check(bb, *x.value);
+                          },
+                          [&](const selector &x) {
+                            check(bb, *x.condition);
+                            check_target(bb, x.true_branch);
+                            check_target(bb, x.false_branch);
+                          },
+                          [&](const jump &x) { check_target(bb, x.target); },
+                          [&](const switcher &x) {
+                            check_variable(bb, x.var.name);
+                            for (const basicblock *target : x.branches)
+                              check_target(bb, *target);
+                          },
+                          [&](const cassign &x) {
+                            check_variable(bb, x.var.name);
+                            check(bb, *x.condition);
+                            check_value(bb, x.true_value);
+                            check_value(bb, x.false_value);
+                          },
+                          [&](const auto &x) {
+                            fail(bb, "evaluates an expression on its own");
+                          }},
+               inst);
+  }
+};
+} // namespace
+
+std::string_view pass_name(pass_kind pass) {
+  switch (pass) {
+  case pass_kind::simplify:
+    return "simplify";
+  case pass_kind::partial_eval:
+    return "peval";
+  case pass_kind::unroll:
+    return "unroll";
+  case pass_kind::remap:
+    return "remap";
+  case pass_kind::flatten:
+    return "flatten";
+  case pass_kind::cse:
+    return "cse";
+  }
+  unreachable();
+}
+
+std::optional<std::vector<pass_kind>>
+parse_pass_pipeline(std::string_view spec) {
+  std::vector<pass_kind> res;
+  while (!spec.empty()) {
+    const auto comma = spec.find(',');
+    const std::string_view item = spec.substr(0, comma);
+    spec = comma == std::string_view::npos ? "" : spec.substr(comma + 1);
+
+    const auto *it = std::begin(all_passes);
+    while (it != std::end(all_passes) && pass_name(*it) != item)
+      ++it;
+    if (it == std::end(all_passes))
+      return std::nullopt;
+    res.push_back(*it);
+  }
+  return res;
+}
+
+void verify_cfg(const symbols &syms, const cfg &graph,
+                std::string_view after) {
+  cfg_verifier{syms, graph, after}.run();
+}
+
+void print_pass_timings(std::ostream &os,
+                        const std::vector<pass_timing> &timings) {
+  const auto original_flags = os.flags();
+  const auto original_precision = os.precision();
+  os << "Pass timings:\n";
+  os << std::fixed << std::setprecision(3);
+  os << "  " << std::left << std::setw(24) << "pass" << std::right
+     << std::setw(12) << "ms" << "  changed\n";
+  double total = 0;
+  for (const pass_timing &t : timings) {
+    os << "  " << std::left << std::setw(24) << t.name << std::right
+       << std::setw(12) << t.milliseconds;
+    if (t.skipped)
+      os << "  skipped";
+    else if (t.changed.has_value())
+      os << "  " << (*t.changed ? "yes" : "no");
+    os << '\n';
+    total += t.milliseconds;
+  }
+  os << "  " << std::left << std::setw(24) << "total" << std::right
+     << std::setw(12) << total << '\n';
+  os.flags(original_flags);
+  os.precision(original_precision);
+}
@@ -0,0 +1,54 @@
+#ifndef PASSES_H
+#define PASSES_H
+
+#include "cfg.h"
+#include "expressions.h"
+
+#include <iosfwd>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// The passes transforming the control-flow graph, in the order they run by
+/// default. The simplification runs again after the passes changing the
+/// control flow.
+enum class pass_kind {
+  simplify,
+  partial_eval,
+  unroll,
+  remap,
+  flatten,
+  cse,
+};
+
+/// The name of the pass on the command line: 'simplify', 'peval', 'unroll',
+/// 'remap', 'flatten' or 'cse'.
+std::string_view pass_name(pass_kind pass);
+
+/// Parses a comma separated list of pass names.
+std::optional<std::vector<pass_kind>>
+parse_pass_pipeline(std::string_view spec);
+
+/// Checks that the graph is well-formed: the entry and the exit are among its
+/// blocks, the ids are unique and below next_bb_idx, the control-flow
+/// instructions end the blocks and target blocks of the graph, the reachable
+/// blocks other than the exit end with one, and every variable is declared.
+/// Throws a compile_error naming the pass that left it broken otherwise.
+void verify_cfg(const symbols &syms, const cfg &graph, std::string_view after);
+
+/// The time spent in a pass, or in computing an analysis for the passes.
+struct pass_timing {
+  std::string name;
+  double milliseconds = 0;
+  /// Whether the pass changed the program, empty for the analyses.
+  std::optional<bool> changed;
+  /// The pass had nothing to do, since the graph did not change after it
+  /// last ran.
+  bool skipped = false;
+};
+
+void print_pass_timings(std::ostream &os,
+                        const std::vector<pass_timing> &timings);
+
+#endif // PASSES_H
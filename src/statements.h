@@ -4,6 +4,8 @@
 #include "expressions.h"
 #include "utility.h"
 
+#include <functional>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -105,6 +107,14 @@ struct ast {
   std::string prog_name;
   symbols syms;
   statements stmts;
+  /// The lines of the 'begin' and the 'end' keywords.
+  int begin_line = 0;
+  int end_line = 0;
+  /// The first and the last line of each top-level statement.
+  std::vector<std::pair<int, int>> statement_lines;
+  /// If set, receives the type checked top-level statements one by one as
+  /// they are parsed, instead of collecting them into stmts.
+  std::function<void(statement)> statement_sink;
 };
 
 #endif // STATEMENTS_H
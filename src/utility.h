@@ -2,18 +2,30 @@
 #define UTILITY_H
 
 #include <iostream>
+#include <stdexcept>
+#include <string>
 #include <string_view>
 
 template <class... Ts> struct overloaded : Ts... { using Ts::operator()...; };
 template <class... Ts> overloaded(Ts...) -> overloaded<Ts...>;
 
+/// Reports a problem of the compiled program, or of the inputs of the
+/// compiler, to the caller of the compilation.
+class compile_error : public std::runtime_error {
+public:
+  /// The line of the source, or -1 if the problem is not tied to one.
+  int line;
+
+  compile_error(int line, const std::string &msg)
+      : std::runtime_error{msg}, line{line} {}
+};
+
 [[noreturn]] void unreachable();
+/// Throws a compile_error.
 [[noreturn]] void error(int line, const std::string_view &msg);
 
 std::ostream &repeat(std::ostream &os, char input, size_t num);
 
-extern bool do_constant_propagation;
-
 template <typename T> class save_and_restore {
   T &place;
   T original;
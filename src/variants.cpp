@@ -0,0 +1,198 @@
+#include "variants.h"
+
+#include "cost_model.h"
+#include "jit.h"
+#include "parallel.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <ostream>
+#include <random>
+#include <sstream>
+
+namespace {
+/// The settings turned by the autotuner.
+struct tuning_choice {
+  std::optional<flatten_policy> flattening;
+  std::optional<unroll_policy> unrolling;
+  std::optional<unsigned> tail_merging;
+  std::size_t seed = 0;
+
+  transformations apply(transformations t) const {
+    t.flattening = flattening;
+    t.unrolling = unrolling;
+    t.codegen.tail_merging = tail_merging;
+    t.remap_bb_ids_seed = seed;
+    t.codegen.serialization_seed = seed;
+    return t;
+  }
+
+  /// The flags reproducing the settings.
+  std::string flags() const {
+    std::stringstream ss;
+    if (flattening.has_value())
+      ss << "--flatten-cfg=" << format_flatten_policy(*flattening) << ' ';
+    if (unrolling.has_value())
+      ss << "--unroll-loops=" << format_unroll_policy(*unrolling) << ' ';
+    if (tail_merging.has_value())
+      ss << "--merge-tails=" << *tail_merging << ' ';
+    ss << "--remap-basic-block-ids=" << seed
+       << " --random-basic-block-serialization-seed=" << seed;
+    return ss.str();
+  }
+};
+
+/// Draws settings at least as strong as the requested ones: at least the
+/// requested share of the executions is flattened, by local dispatchers
+/// exactly if those were requested, and by replicated ones if requested. The
+/// unrolling and the tail merging do not weaken the obfuscation, so they are
+/// drawn freely.
+tuning_choice draw_choice(const tuning_choice &requested, std::size_t seed) {
+  std::mt19937 gen(seed);
+  const auto coin = [&gen] { return std::bernoulli_distribution{}(gen); };
+  tuning_choice res;
+  res.seed = seed;
+  if (requested.flattening.has_value()) {
+    const flatten_policy &minimum = *requested.flattening;
+    const unsigned steps = (100 - minimum.budget_percent) / 10;
+    const unsigned budget =
+        minimum.budget_percent +
+        10 * std::uniform_int_distribution<unsigned>{0, steps}(gen);
+    flatten_policy policy;
+    policy.budget_percent = std::min(budget, 100u);
+    policy.hierarchical = minimum.hierarchical;
+    policy.replicated = minimum.replicated || coin();
+    res.flattening = policy;
+  }
+  constexpr unsigned unroll_factors[] = {0, 2, 4, 8};
+  if (const unsigned factor = unroll_factors[std::uniform_int_distribution<
+          std::size_t>{0, std::size(unroll_factors) - 1}(gen)]) {
+    res.unrolling = unroll_policy{};
+    res.unrolling->factor = factor;
+  }
+  if (coin())
+    res.tail_merging = 2;
+  return res;
+}
+} // namespace
+
+std::size_t shared_passes(const transformations &t) {
+  transformations varied = t;
+  varied.unrolling = unroll_policy{};
+  varied.remap_bb_ids_seed = 0;
+  varied.flattening = flatten_policy{};
+  const std::vector<pass_kind> passes = pipeline(varied);
+  constexpr pass_kind varying[] = {pass_kind::unroll, pass_kind::remap,
+                                   pass_kind::flatten};
+  return std::find_first_of(passes.begin(), passes.end(), std::begin(varying),
+                            std::end(varying)) -
+         passes.begin();
+}
+
+std::size_t run_shared_passes(lowered_program &program,
+                              const transformations &t) {
+  const std::size_t shared = shared_passes(t);
+  const std::vector<pass_kind> passes = pipeline(t);
+  run_passes(program, {passes.begin(), passes.begin() + shared}, t);
+  return shared;
+}
+
+lowered_program transform_copy(const lowered_program &program,
+                               const transformations &t, std::size_t shared) {
+  lowered_program copy = clone(program);
+  const std::vector<pass_kind> passes = pipeline(t);
+  run_passes(copy, {passes.begin() + shared, passes.end()}, t);
+  finish_passes(copy);
+  return copy;
+}
+
+std::vector<diagnostic> emit_variants(lowered_program program,
+                                      const transformations &t,
+                                      std::size_t count, std::size_t seed_base,
+                                      const std::filesystem::path &dir,
+                                      const std::string &stem) {
+  const std::size_t shared = run_shared_passes(program, t);
+  // The files failed to be written, by variant.
+  std::vector<std::optional<std::string>> failed(count);
+  parallel_for(count, [&](std::size_t i) {
+    const std::size_t seed = seed_base + i;
+    transformations variant = t;
+    variant.remap_bb_ids_seed = seed;
+    variant.codegen.serialization_seed = seed;
+
+    const lowered_program copy = transform_copy(program, variant, shared);
+
+    const std::filesystem::path file =
+        dir / (stem + '.' + std::to_string(seed) + ".asm");
+    std::ofstream os(file);
+    os << codegen(copy.graph, copy.syms, copy.freqs, variant.codegen);
+    if (!os)
+      failed[i] = file.string();
+  });
+
+  std::vector<diagnostic> res;
+  for (const std::optional<std::string> &file : failed)
+    if (file.has_value())
+      res.push_back(diagnostic{-1, "Failed to write " + *file + "."});
+  return res;
+}
+
+void autotune(lowered_program program, const transformations &t,
+              std::size_t count, std::size_t seed_base,
+              const std::optional<std::string> &input, std::ostream &os,
+              std::ostream &log) {
+  constexpr unsigned timed_runs = 3;
+  const bool run_natively = input.has_value() && jit_program::supported();
+
+  struct candidate {
+    tuning_choice choice;
+    std::string assembly;
+    std::optional<double> score;
+  };
+  std::vector<candidate> candidates(count);
+  const tuning_choice requested{t.flattening, t.unrolling,
+                                t.codegen.tail_merging, seed_base};
+  candidates[0].choice = requested;
+  for (std::size_t i = 1; i < count; ++i)
+    candidates[i].choice = draw_choice(requested, requested.seed + i);
+
+  const std::size_t shared = run_shared_passes(program, t);
+
+  parallel_for(count, [&](std::size_t i) {
+    candidate &c = candidates[i];
+    const transformations variant = c.choice.apply(t);
+    const lowered_program copy = transform_copy(program, variant, shared);
+    c.assembly = codegen(copy.graph, copy.syms, copy.freqs, variant.codegen);
+    if (!run_natively)
+      c.score =
+          estimate_cost(emit(copy, variant).blocks, copy.freqs).total_cycles;
+  });
+
+  // The runs are timed one after the other, so that they do not disturb
+  // each other.
+  if (run_natively)
+    for (candidate &c : candidates)
+      c.score = jit_program{c.assembly}.time_runs(*input, timed_runs);
+
+  const candidate *best = nullptr;
+  log << "Autotuning candidates ("
+      << (run_natively ? "seconds of the fastest run" : "estimated cycles")
+      << "):\n";
+  for (const candidate &c : candidates) {
+    log << "  " << std::setw(14);
+    if (c.score.has_value())
+      log << *c.score;
+    else
+      log << "failed";
+    log << "  " << c.choice.flags() << '\n';
+    if (c.score.has_value() && (best == nullptr || *c.score < *best->score))
+      best = &c;
+  }
+  if (best == nullptr)
+    error(-1, "None of the candidates ran successfully.");
+  log << "Selected: " << best->choice.flags() << '\n';
+  os << best->assembly;
+}
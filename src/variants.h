@@ -0,0 +1,49 @@
+#ifndef VARIANTS_H
+#define VARIANTS_H
+
+#include "compiler.h"
+
+#include <cstddef>
+#include <filesystem>
+#include <iosfwd>
+#include <optional>
+#include <string>
+#include <vector>
+
+/// The number of passes preceding the first one the copies of the program
+/// may differ in: the unrolling, the remapping or the flattening. These run
+/// only once, before the program is copied.
+std::size_t shared_passes(const transformations &t);
+
+/// Runs the passes the copies of the program share. Returns their number.
+std::size_t run_shared_passes(lowered_program &program,
+                              const transformations &t);
+
+/// Runs the rest of the passes on a copy of the program.
+lowered_program transform_copy(const lowered_program &program,
+                               const transformations &t, std::size_t shared);
+
+/// Compiles a variant for each seed of [seed_base, seed_base + count) into
+/// '<dir>/<stem>.<seed>.asm'. The seed drives both the remapping of the block
+/// ids and the serialization. The optimizations run only once, the rest of
+/// the passes for each variant, on as many threads as the hardware supports.
+/// Returns an error for each file that could not be written.
+std::vector<diagnostic> emit_variants(lowered_program program,
+                                      const transformations &t,
+                                      std::size_t count, std::size_t seed_base,
+                                      const std::filesystem::path &dir,
+                                      const std::string &stem);
+
+/// Compiles the requested settings with the seed_base, and settings drawn
+/// for the seeds of [seed_base + 1, seed_base + count), on as many threads as
+/// the hardware supports, and writes the assembly of the fastest one to os.
+/// With an input, each candidate runs on it natively, otherwise the cost
+/// model scores them. The candidates and the flags reproducing the selected
+/// one are reported to the log. Throws a compile_error if none of them ran
+/// successfully.
+void autotune(lowered_program program, const transformations &t,
+              std::size_t count, std::size_t seed_base,
+              const std::optional<std::string> &input, std::ostream &os,
+              std::ostream &log);
+
+#endif // VARIANTS_H
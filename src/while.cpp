@@ -1,64 +1,157 @@
-#include "FlexLexer.h"
-#include "grammar.hpp"
-
-#include "ast_dumper.h"
-#include "ast_to_cfg.h"
-#include "cfg.h"
-#include "cfg_dumper.h"
+#include "cfg_analysis.h"
 #include "cfg_transformer.h"
-#include "codegen.h"
-#include "expressions.h"
-#include "statements.h"
+#include "compiler.h"
+#include "constant_encoding.h"
+#include "loop_unrolling.h"
+#include "passes.h"
 #include "utility.h"
 
-#include <cstdlib>
 #include <fstream>
 #include <iostream>
-#include <map>
-#include <random>
-#include <sstream>
 #include <string>
 
 #include <CLI/CLI.hpp>
 
-yyFlexLexer *lexer;
-
-int yylex(yy::parser::semantic_type *yylval,
-          yy::parser::location_type *yylloc) {
-  yylloc->begin.line = lexer->lineno();
-  int token = lexer->yylex();
-  if (token == yy::parser::token::ID || token == yy::parser::token::NUM) {
-    yylval->build(std::string(lexer->YYText()));
-  }
-  return token;
-}
 
-void yy::parser::error(const location_type &loc, const std::string &msg) {
-  std::cerr << "Line " << loc.begin.line << ": " << msg << std::endl;
-  exit(1);
-}
-
-int main(int argc, char **argv) {
+namespace {
+int run(int argc, char **argv) {
   CLI::App app("Obfuscicating While compiler");
   std::string src;
-  app.add_option("source", src, "while source code")
-      ->required()
-      ->check(CLI::ExistingFile);
+  CLI::Option *source = app.add_option("source", src, "while source code")
+                            ->check(CLI::ExistingFile);
 
-  // Compilation and interpretation are mutually exclusive.
+  // Instead of the source, the program can come from a serialized cfg.
+  std::optional<std::string> from_cfg_file;
+  std::optional<std::string> emit_cfg_file;
+  CLI::Option *from_cfg =
+      app.add_option("--from-cfg", from_cfg_file,
+                     "Reads the control-flow graph written by --emit-cfg "
+                     "instead of parsing a source.")
+          ->check(CLI::ExistingFile);
+  source->excludes(from_cfg);
+  CLI::Option *emit_cfg =
+      app.add_option("--emit-cfg", emit_cfg_file,
+                     "Writes the transformed control-flow graph and the "
+                     "symbols to this file in a compact binary format.");
+
+  // Compilation, interpretation and jitting are mutually exclusive.
   CLI::Option *compile =
       app.add_flag("-c,--compile")
           ->multi_option_policy(CLI::MultiOptionPolicy::Throw);
   CLI::Option *interpret =
       app.add_flag("-i,--interpret")
           ->multi_option_policy(CLI::MultiOptionPolicy::Throw);
+  CLI::Option *jit =
+      app.add_flag("--jit", "Assembles the generated code in memory and runs "
+                            "it right away, without invoking nasm or a linker.")
+          ->multi_option_policy(CLI::MultiOptionPolicy::Throw);
+  CLI::Option *batch =
+      app.add_flag("--batch",
+                   "Runs the program for every line of the standard input as "
+                   "a separate input record, several records at a time in "
+                   "SIMD lanes, printing the output of each record followed "
+                   "by an empty line. The transformations are not applied.")
+          ->multi_option_policy(CLI::MultiOptionPolicy::Throw);
   compile->excludes(interpret);
+  compile->excludes(jit);
+  compile->excludes(batch);
   interpret->excludes(compile);
+  interpret->excludes(jit);
+  interpret->excludes(batch);
+  jit->excludes(compile);
+  jit->excludes(interpret);
+  jit->excludes(batch);
+  batch->excludes(compile);
+  batch->excludes(interpret);
+  batch->excludes(jit);
 
-  bool flatten_cfg{false};
-  bool encode_constants{false};
+  std::optional<std::string> emit_format;
+  CLI::Option *emit_option =
+      app.add_option("--emit", emit_format,
+                     "Compiles to NASM assembly (asm, like -c) or to textual "
+                     "LLVM IR (llvm) for clang. The constants are not encoded "
+                     "in the LLVM IR.")
+          ->check(CLI::IsMember({"asm", "llvm"}));
+  emit_option->excludes(interpret);
+  emit_option->excludes(jit);
+  emit_option->excludes(batch);
+
+  std::optional<std::string> flatten_spec;
+  std::optional<std::string> unroll_spec;
+  std::optional<std::string> profile_file;
+  bool xor_encode_constants{false};
+  std::optional<std::string> constant_encoding_spec;
+  std::optional<double> constant_encoding_budget;
   std::optional<std::size_t> remap_bb_ids_seed;
   std::optional<std::size_t> serialization_seed;
+  std::optional<unsigned> tail_merging;
+  bool debug_info{false};
+  std::optional<std::string> symbol_map_file;
+
+  bool no_simplify_cfg{false};
+  CLI::Option *no_simplify =
+      app.add_flag("--no-simplify-cfg", no_simplify_cfg,
+                   "Keeps the empty blocks and the jump chains of the "
+                   "control-flow graph.")
+          ->multi_option_policy(CLI::MultiOptionPolicy::Throw);
+
+  std::size_t partial_eval_fuel{10000};
+  CLI::Option *fuel =
+      app.add_option("--partial-eval-fuel", partial_eval_fuel,
+                     "The number of instructions executed at compile time, up "
+                     "to the first read, to replace the input-independent "
+                     "prefix of the program with its output. 0 disables it. "
+                     "Defaults to 10000.");
+
+  bool no_cse{false};
+  CLI::Option *no_cse_option =
+      app.add_flag("--no-cse", no_cse,
+                   "Keeps recomputing the common subexpressions within the "
+                   "basic blocks.")
+          ->multi_option_policy(CLI::MultiOptionPolicy::Throw);
+
+  std::optional<unsigned> optimization_level;
+  CLI::Option *level =
+      app.add_option("-O", optimization_level,
+                     "-O0 disables the simplification of the control-flow "
+                     "graph, the partial evaluation and the common "
+                     "subexpression elimination, -O1 only the partial "
+                     "evaluation. -O2 is the default.")
+          ->check(CLI::Range(0u, 2u));
+
+  std::optional<std::string> passes_spec;
+  CLI::Option *passes =
+      app.add_option("--passes", passes_spec,
+                     "Runs these passes in this order, instead of "
+                     "'simplify,peval,simplify,unroll,simplify,remap,flatten,"
+                     "cse'. The unrolling, the remapping and the flattening "
+                     "take their settings from their options, and the "
+                     "remapping needs a seed.")
+          ->check([](const std::string &spec) {
+            return parse_pass_pipeline(spec).has_value()
+                       ? std::string{}
+                       : "Invalid pass pipeline: " + spec;
+          });
+  for (CLI::Option *other : {no_simplify, no_cse_option, level})
+    passes->excludes(other);
+
+  bool verify_each{false};
+  app.add_flag("--verify-each", verify_each,
+               "Checks that the control-flow graph is well-formed after "
+               "each pass.")
+      ->multi_option_policy(CLI::MultiOptionPolicy::Throw);
+
+  bool time_passes{false};
+  app.add_flag("--time-passes", time_passes,
+               "Reports the time spent in each pass and analysis.")
+      ->multi_option_policy(CLI::MultiOptionPolicy::Throw);
+
+  bool estimate_cost{false};
+  std::optional<double> max_overhead;
+
+  std::optional<std::size_t> variant_count;
+  std::size_t seed_base{0};
+  std::string output_dir;
 
   bool dump_ast{false};
   bool dump_cfg_text{false};
@@ -72,70 +165,278 @@ int main(int argc, char **argv) {
                "Dumps the Control-flow graph in Graphwiz dot format.")
       ->multi_option_policy(CLI::MultiOptionPolicy::Throw);
 
-  app.add_flag("--flatten-cfg", flatten_cfg, "Flatten the control-flow graph.")
-      ->multi_option_policy(CLI::MultiOptionPolicy::Throw);
+  CLI::Option *flatten =
+      app.add_flag("--flatten-cfg{all}", flatten_spec,
+                   "Flatten the control-flow graph. Optionally takes a comma "
+                   "separated policy: 'all', 'hierarchical' (a local "
+                   "dispatcher for each loop), 'replicated' (a copy of the "
+                   "dispatch at the end of each block), 'budget:<percent>' "
+                   "(flatten only the coldest blocks accounting for at most "
+                   "this share of the executions).")
+          ->multi_option_policy(CLI::MultiOptionPolicy::Throw)
+          ->check([](const std::string &spec) {
+            return parse_flatten_policy(spec).has_value()
+                       ? std::string{}
+                       : "Invalid flattening policy: " + spec;
+          });
 
-  app.add_flag("--remap-basic-block-ids", remap_bb_ids_seed,
-               "Remap basic block ids.")
-      ->multi_option_policy(CLI::MultiOptionPolicy::Throw);
+  CLI::Option *unroll =
+      app.add_flag("--unroll-loops{factor:4}", unroll_spec,
+                   "Unroll the innermost loops before flattening. Optionally "
+                   "takes a comma separated policy: 'factor:<n>' (copies of "
+                   "the body, 4 by default), 'budget:<n>' (instructions added "
+                   "to the program, 2000 by default), 'full:<n>' (unroll the "
+                   "loops iterating at most this many times completely, 16 by "
+                   "default).")
+          ->multi_option_policy(CLI::MultiOptionPolicy::Throw)
+          ->check([](const std::string &spec) {
+            return parse_unroll_policy(spec).has_value()
+                       ? std::string{}
+                       : "Invalid unrolling policy: " + spec;
+          });
 
-  app.add_flag("--xor-encode-constants", encode_constants,
-               "Xor encode constants.")
-      ->multi_option_policy(CLI::MultiOptionPolicy::Throw);
+  CLI::Option *profile_option =
+      app.add_option("--block-profile", profile_file,
+                     "Execution counts of the basic blocks as '<block id> "
+                     "<count>' lines, used instead of the loop depth based "
+                     "estimation.")
+          ->check(CLI::ExistingFile);
+
+  CLI::Option *remap =
+      app.add_flag("--remap-basic-block-ids", remap_bb_ids_seed,
+                   "Remap basic block ids.")
+          ->multi_option_policy(CLI::MultiOptionPolicy::Throw);
+
+  CLI::Option *xor_encode =
+      app.add_flag("--xor-encode-constants", xor_encode_constants,
+                   "Xor encode constants.")
+          ->multi_option_policy(CLI::MultiOptionPolicy::Throw);
 
-  app.add_option(
+  CLI::Option *encode =
+      app.add_flag("--encode-constants{auto}", constant_encoding_spec,
+                   "Encode constants. Optionally takes the scheme: 'xor', "
+                   "'add', 'mul', 'table', or 'auto' to pick the strongest "
+                   "one fitting the budget for each constant.")
+          ->multi_option_policy(CLI::MultiOptionPolicy::Throw)
+          ->check([](const std::string &spec) {
+            return parse_constant_encoding_policy(spec).has_value()
+                       ? std::string{}
+                       : "Invalid constant encoding: " + spec;
+          });
+  xor_encode->excludes(encode);
+  encode->excludes(xor_encode);
+
+  app.add_option("--constant-encoding-budget", constant_encoding_budget,
+                 "The decoding cycles a single constant may cost during a run "
+                 "of the program, when the schemes are picked automatically.")
+      ->needs(encode);
+
+  CLI::Option *random_remap = app.add_option(
       "--random-remap-basic-blocks-seed", remap_bb_ids_seed,
       "Randomize the identifier of the basic blocks in the control-flow graph. "
       "Specify the seed for the pseudo-random sequence. -1 means random seed.");
 
-  app.add_option(
+  CLI::Option *shuffle = app.add_option(
       "--random-basic-block-serialization-seed", serialization_seed,
       "Randomize the order of the basic blocks when emitting assembly."
       "Specify the seed for the pseudo-random sequence. -1 means random seed.");
 
+  CLI::Option *merge_tails =
+      app.add_flag("--merge-tails{2}", tail_merging,
+                   "Folds the blocks with identical instructions into one "
+                   "and replaces the identical instruction sequences ending "
+                   "the blocks with a jump to a single copy. Optionally takes "
+                   "the shortest sequence worth sharing, 2 instructions by "
+                   "default.")
+          ->multi_option_policy(CLI::MultiOptionPolicy::Throw)
+          ->check(CLI::PositiveNumber);
+
+  CLI::Option *debug =
+      app.add_flag("--debug-info", debug_info,
+                   "Attributes the instructions to the lines of the source "
+                   "with %line directives, which 'nasm -g -F dwarf' turns "
+                   "into DWARF line information.")
+          ->multi_option_policy(CLI::MultiOptionPolicy::Throw);
+  debug->excludes(from_cfg);
+  CLI::Option *symbol_map =
+      app.add_option("--symbol-map", symbol_map_file,
+                     "Writes the label of each emitted block along with its "
+                     "id before the remapping and its source lines to this "
+                     "file.");
+
+  CLI::Option *estimate =
+      app.add_flag("--estimate-cost", estimate_cost,
+                   "Estimates the cycles spent in each basic block, loop and "
+                   "in total, and the overhead of each enabled "
+                   "transformation.")
+          ->multi_option_policy(CLI::MultiOptionPolicy::Throw);
+  app.add_option("--max-overhead", max_overhead,
+                 "Fails if the estimated overhead of the transformations "
+                 "exceeds this percentage.")
+      ->needs(estimate);
+
+  CLI::Option *variants =
+      app.add_option("--variants", variant_count,
+                     "Compiles this many variants of the program into the "
+                     "output directory, each remapped and serialized with its "
+                     "own seed. The other transformations apply to all.")
+          ->check(CLI::PositiveNumber);
+  app.add_option("--seed-base", seed_base,
+                 "The seed of the first variant or autotuning candidate, the "
+                 "rest get the following ones.");
+  CLI::Option *output =
+      app.add_option("-o,--output-dir", output_dir,
+                     "The directory receiving the variants.")
+          ->check(CLI::ExistingDirectory);
+  variants->needs(output);
+  output->needs(variants);
+  variants->excludes(compile);
+  variants->excludes(interpret);
+  variants->excludes(jit);
+  variants->excludes(estimate);
+  variants->excludes(batch);
+  variants->excludes(emit_option);
+
+  std::optional<std::size_t> autotune_count;
+  std::optional<std::string> autotune_input;
+  CLI::Option *autotune_option =
+      app.add_option("--autotune", autotune_count,
+                     "Compiles this many candidate settings in parallel and "
+                     "writes the assembly of the fastest one. The first "
+                     "candidate is the requested settings, the rest flatten "
+                     "at least as much, with the unrolling, the tail merging "
+                     "and the seeds drawn at random. The flags reproducing "
+                     "each candidate are reported.")
+          ->check(CLI::PositiveNumber);
+  app.add_option("--input", autotune_input,
+                 "The input the autotuning candidates run on natively to time "
+                 "them. Without it the cost model scores them. The timed code "
+                 "is the assembly re-encoded for x86-64 by the JIT, not the "
+                 "32 bit binary assembled from it, so the timings rank the "
+                 "candidates only approximately.")
+      ->check(CLI::ExistingFile)
+      ->needs(autotune_option);
+  for (CLI::Option *other :
+       {compile, interpret, jit, batch, emit_option, remap, random_remap,
+        shuffle, estimate, variants, passes})
+    autotune_option->excludes(other);
+
+  CLI::Option *stream =
+      app.add_flag("--stream",
+                   "Compiles to assembly one top-level statement at a time, "
+                   "writing the code of each as soon as it is lowered, so "
+                   "the memory is bounded by the largest statement instead "
+                   "of the whole program. Nothing but the plain translation "
+                   "is possible this way.")
+          ->multi_option_policy(CLI::MultiOptionPolicy::Throw);
+  for (CLI::Option *other :
+       {from_cfg, emit_cfg, interpret, jit, batch, emit_option, flatten,
+        unroll, remap, random_remap, xor_encode, encode, shuffle, merge_tails,
+        debug, symbol_map, estimate, variants, autotune_option, level, passes})
+    stream->excludes(other);
+
+  std::optional<std::string> watch_file;
+  CLI::Option *watch_option =
+      app.add_option("--watch", watch_file,
+                     "Compiles to assembly into this file, then keeps "
+                     "recompiling the top-level statements touched by each "
+                     "change of the source until interrupted. Each group of "
+                     "statements sharing a line is transformed on its own, "
+                     "and the partial evaluation is not applied.");
+  watch_option->needs(source);
+  for (CLI::Option *other :
+       {emit_cfg, compile, interpret, jit, batch, emit_option, profile_option,
+        debug, symbol_map, estimate, variants, autotune_option, stream})
+    watch_option->excludes(other);
+
   CLI11_PARSE(app, argc, argv);
 
-  const auto build_ast_from = [](std::istream &is) {
-    ast ast;
-    std::unique_ptr lexer = std::make_unique<yyFlexLexer>(&is);
-    ::lexer = lexer.get();
-    yy::parser parser{ast};
-    parser.parse();
-    ::lexer = nullptr;
-    return ast;
-  };
-
-  std::ifstream input(src.c_str());
-  ast code = build_ast_from(input);
-
-  if (dump_ast)
-    ast_dumper{std::cerr}(code);
-
-  cfg graph = ast_to_cfg(std::move(code.stmts));
-
-  if (remap_bb_ids_seed.has_value()) {
-    if (remap_bb_ids_seed.value() == -1) {
-      std::random_device rd;
-      std::mt19937 gen(rd());
-      remap_block_ids(graph, gen);
-    } else {
-      std::mt19937 gen(remap_bb_ids_seed.value());
-      remap_block_ids(graph, gen);
-    }
+  if (source->count() == 0 && from_cfg->count() == 0) {
+    std::cerr << "Error: Either a source or --from-cfg is required.\n";
+    return 1;
   }
 
-  if (flatten_cfg)
-    flatten(code.syms, graph);
+  compile_options opts;
+  transformations &enabled = opts.transforms;
+  if (optimization_level.has_value())
+    set_optimization_level(enabled, *optimization_level);
+  if (fuel->count() != 0)
+    enabled.partial_eval_fuel = partial_eval_fuel;
+  enabled.remap_bb_ids_seed = remap_bb_ids_seed;
+  if (no_cse)
+    enabled.eliminate_common_subexpressions = false;
+  if (flatten_spec.has_value())
+    enabled.flattening = parse_flatten_policy(*flatten_spec).value();
+  if (unroll_spec.has_value())
+    enabled.unrolling = parse_unroll_policy(*unroll_spec).value();
+  if (no_simplify_cfg)
+    enabled.simplify_cfg = false;
+  if (passes_spec.has_value())
+    opts.selected_passes = parse_pass_pipeline(*passes_spec).value();
+  enabled.verify = verify_each;
+  if (xor_encode_constants)
+    enabled.codegen.constant_encoding = parse_constant_encoding_policy("xor");
+  if (constant_encoding_spec.has_value())
+    enabled.codegen.constant_encoding =
+        parse_constant_encoding_policy(*constant_encoding_spec).value();
+  if (constant_encoding_budget.has_value())
+    enabled.codegen.constant_encoding->budget = *constant_encoding_budget;
+  enabled.codegen.serialization_seed = serialization_seed;
+  enabled.codegen.tail_merging = tail_merging;
+  if (debug_info)
+    enabled.codegen.source_name = src;
 
-  if (dump_cfg_dot)
-    dot_cfg_dumper{std::cerr}(graph);
-  if (dump_cfg_text)
-    text_cfg_dumper{std::cerr}(graph);
+  if (profile_file.has_value()) {
+    std::ifstream is(profile_file->c_str());
+    opts.profile = read_block_profile(is);
+  }
+  opts.from_cfg = from_cfg_file.has_value();
+  opts.dump_ast = dump_ast;
+  opts.dump_cfg_text = dump_cfg_text;
+  opts.dump_cfg_dot = dump_cfg_dot;
+  opts.time_passes = time_passes;
+  opts.estimate_cost = estimate_cost;
+  opts.max_overhead = max_overhead;
+  opts.cfg_file = emit_cfg_file;
+  opts.symbol_map_file = symbol_map_file;
+  opts.seed_base = seed_base;
+  opts.output_dir = output_dir;
+  opts.tuning_input = autotune_input;
+
+  if (emit_format == "llvm")
+    opts.format = output_format::llvm;
+  if (stream->count() == 1) {
+    opts.action = compile_action::stream;
+  } else if (watch_file.has_value()) {
+    opts.action = compile_action::watch;
+    opts.watch_output = *watch_file;
+  } else if (variant_count.has_value()) {
+    opts.action = compile_action::variants;
+    opts.count = *variant_count;
+  } else if (autotune_count.has_value()) {
+    opts.action = compile_action::autotune;
+    opts.count = *autotune_count;
+  } else if (batch->count() == 1) {
+    opts.action = compile_action::batch;
+  } else if (jit->count() == 1) {
+    opts.action = compile_action::jit;
+  } else if (compile->count() == 0 && !emit_format.has_value()) {
+    // Interpreting is not supported.
+    opts.action = compile_action::none;
+  }
 
-  if (compile->count() == 1) {
-    std::cout << codegen(graph, code.syms, serialization_seed,
-                         encode_constants);
-  } else {
-    //::execute(ast);
+  const compile_result res = compile_file(from_cfg_file.value_or(src), opts,
+                                          std::cout, std::cerr, std::cin);
+  print_diagnostics(std::cerr, res.diagnostics);
+  return res.succeeded() ? res.exit_code : 1;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  try {
+    return run(argc, argv);
+  } catch (const compile_error &e) {
+    print_diagnostics(std::cerr, {diagnostic{e.line, e.what()}});
+    return 1;
   }
 }
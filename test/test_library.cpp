@@ -0,0 +1,101 @@
+// Compiles the sources given as arguments through the library, many times
+// concurrently, and checks that every compilation agrees with a sequential
+// one. A broken source must come back with a diagnostic instead of ending
+// the process.
+
+#include "compiler.h"
+#include "jit.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+std::string read_file(const char *path) {
+  std::ifstream is(path);
+  std::stringstream ss;
+  ss << is.rdbuf();
+  return ss.str();
+}
+
+int fail(const std::string &msg) {
+  std::cerr << "FAIL: " << msg << '\n';
+  return 1;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  compile_options opts;
+  opts.transforms.flattening = flatten_policy{};
+  opts.transforms.remap_bb_ids_seed = 42;
+  opts.transforms.codegen.serialization_seed = 42;
+
+  std::vector<std::string> sources;
+  std::vector<std::string> expected;
+  for (int i = 1; i < argc; ++i) {
+    sources.push_back(read_file(argv[i]));
+    const compile_result res = compile(sources.back(), opts);
+    if (!res.succeeded())
+      return fail(std::string("Diagnostics for ") + argv[i]);
+    expected.push_back(res.output);
+  }
+
+  constexpr int thread_count = 8;
+  std::vector<int> mismatches(thread_count, 0);
+  {
+    std::vector<std::jthread> threads;
+    for (int t = 0; t < thread_count; ++t)
+      threads.emplace_back([&, t] {
+        for (std::size_t i = 0; i < sources.size(); ++i)
+          mismatches[t] += compile(sources[i], opts).output != expected[i];
+      });
+  }
+  for (int count : mismatches)
+    if (count != 0)
+      return fail("A concurrent compilation differs from the sequential one");
+
+  const compile_result broken =
+      compile("program p\nnatural a\nbegin\na := true\nend\n", opts);
+  if (broken.succeeded() || !broken.output.empty())
+    return fail("The type error went unnoticed");
+  if (broken.diagnostics.front().line != 4)
+    return fail("The type error is reported on the wrong line");
+
+  const compile_result unparsable = compile("program p\nbegin\n:=\n", opts);
+  if (unparsable.succeeded() || unparsable.diagnostics.front().line != 3)
+    return fail("The syntax error is reported on the wrong line");
+
+  std::string deep = "program p\nnatural a\nbegin\na := a";
+  for (int i = 0; i < 100000; ++i)
+    deep += " + a";
+  deep += "\nend\n";
+  const compile_result too_deep = compile(deep, opts);
+  if (too_deep.succeeded() || too_deep.diagnostics.front().line != 4)
+    return fail("The too deep expression went unnoticed");
+
+  // The modes of the command line run through the options as well.
+  compile_options report = opts;
+  report.estimate_cost = true;
+  report.dump_cfg_text = true;
+  const compile_result reported = compile(sources.front(), report);
+  if (!reported.succeeded() || reported.output != expected.front() ||
+      reported.log.find("overhead") == std::string::npos)
+    return fail("The cost report is missing from the log");
+
+  compile_options unselected = opts;
+  unselected.selected_passes = std::vector{pass_kind::simplify};
+  if (compile(sources.front(), unselected).succeeded())
+    return fail("The flattening ran without the flatten pass");
+
+  compile_options jit = opts;
+  jit.action = compile_action::jit;
+  jit.transforms.partial_eval_fuel = 0;
+  const compile_result trapped =
+      compile("program p\nnatural a\nbegin\nwrite(5 / a)\nend\n", jit);
+  if (jit_program::supported() && trapped.succeeded())
+    return fail("The trap of the jitted program went unnoticed");
+  return 0;
+}